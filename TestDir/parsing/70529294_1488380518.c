@@ -3,10 +3,13 @@
  * Received from Paul Shields
  * Revised by Bill Menger 12/3/2013 - repair byte-swap on header 2 in trace headers
  *                                  - reset trace counter for multiple file option
+ * Build : cc -o cp_segy cp_segy.c -lm -lpthread
 */
+#define _FILE_OFFSET_BITS 64
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/file.h> 
+#include <sys/resource.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
@@ -15,6 +18,17 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <math.h>
+#include <stddef.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <signal.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifndef SEEK_SET
 #define SEEK_SET 0
@@ -228,10 +242,86 @@ typedef struct  segy_tr_hd {
 
 static unsigned short sample_size[] = { 4, 4, 2, 2, sizeof(float) };
 
+/* Trace header fields by name, for the options working on any field */
+
+typedef struct hd_field {
+    char *name;
+    short offset, size;
+} HD_FIELD;
+
+#define TR_FIELD(f) { #f, offsetof(SEGY_TR_HD, f), sizeof(((SEGY_TR_HD*)0)->f) }
+
+static HD_FIELD tr_fields[] = {
+    TR_FIELD(traseqlin), TR_FIELD(traseqrel), TR_FIELD(field_rec),
+    TR_FIELD(tracnb_fld), TR_FIELD(esp), TR_FIELD(cdp_ens), TR_FIELD(tr_in_cdp),
+    TR_FIELD(trace_id), TR_FIELD(nbvst), TR_FIELD(nbhst), TR_FIELD(data_use),
+    TR_FIELD(srdist), TR_FIELD(rcv_elev), TR_FIELD(src_elec), TR_FIELD(src_depth),
+    TR_FIELD(drcv_elev), TR_FIELD(dsrc_elev), TR_FIELD(wsrc_depth),
+    TR_FIELD(wgrp_depth), TR_FIELD(scaler_dep), TR_FIELD(scaler_cor),
+    TR_FIELD(src_X), TR_FIELD(src_Y), TR_FIELD(grp_X), TR_FIELD(grp_Y),
+    TR_FIELD(cor_unit), TR_FIELD(weath_vel), TR_FIELD(sweath_vel),
+    TR_FIELD(upht_src), TR_FIELD(upht_grp), TR_FIELD(stcor_src),
+    TR_FIELD(stcor_grp), TR_FIELD(st_cor), TR_FIELD(lag_A), TR_FIELD(lag_B),
+    TR_FIELD(delay), TR_FIELD(mute_start), TR_FIELD(mute_end),
+    TR_FIELD(nb_samples), TR_FIELD(sampling), TR_FIELD(gain_type),
+    TR_FIELD(inst_gain), TR_FIELD(init_gain), TR_FIELD(correlated),
+    TR_FIELD(swp_start), TR_FIELD(swp_end), TR_FIELD(swp_length),
+    TR_FIELD(swp_type), TR_FIELD(swp_tap_st), TR_FIELD(swp_tap_ed),
+    TR_FIELD(taper_type), TR_FIELD(alias_freq), TR_FIELD(alias_slope),
+    TR_FIELD(notch_freq), TR_FIELD(notch_slope), TR_FIELD(low_cut),
+    TR_FIELD(high_cut), TR_FIELD(low_slope), TR_FIELD(high_slope),
+    TR_FIELD(year_of_rec), TR_FIELD(day_of_rec), TR_FIELD(hour_of_rec),
+    TR_FIELD(mn_of_rec), TR_FIELD(scnd_of_rec), TR_FIELD(time_basis),
+    TR_FIELD(tr_weigth), TR_FIELD(gnb_roll_one), TR_FIELD(gnb_tr_one),
+    TR_FIELD(gnb_tr_last), TR_FIELD(gap_size), TR_FIELD(overtravel),
+    TR_FIELD(maxtr), TR_FIELD(statnu_mid), TR_FIELD(statnu_so),
+    TR_FIELD(statnu_rec), TR_FIELD(line_nu), TR_FIELD(sp_nu),
+    TR_FIELD(wat_bot_mid), TR_FIELD(line_nu2), TR_FIELD(sp_nu2),
+    TR_FIELD(X_mid), TR_FIELD(Y_mid), TR_FIELD(X_s), TR_FIELD(Y_s),
+    TR_FIELD(X_g), TR_FIELD(Y_g),
+    { 0, 0, 0 }
+};
+
+static HD_FIELD *find_field(char *name, int lg)
+{
+    HD_FIELD *f;
+    for( f = tr_fields ; f->name ; f++ )
+	if( strlen(f->name) == lg && !strncmp(f->name, name, lg) )
+	    return f;
+    return 0;
+}
+
+static int get_field(char *hd, HD_FIELD *f)
+{
+    if( f->size == 2 ) {
+	BYTE2 v;
+	memcpy(&v, hd + f->offset, 2);
+	return (short)ntohs(v);
+    }
+    else {
+	BYTE4 v;
+	memcpy(&v, hd + f->offset, 4);
+	return (int)ntohl(v);
+    }
+}
+
+static void set_field(char *hd, HD_FIELD *f, int value)
+{
+    if( f->size == 2 ) {
+	BYTE2 v = htons((short)value);
+	memcpy(hd + f->offset, &v, 2);
+    }
+    else {
+	BYTE4 v = htonl(value);
+	memcpy(hd + f->offset, &v, 4);
+    }
+}
+
 #define  DIFF(h1,h2,part)  \
-        (bcmp((h1)->part, (h2)->part, sizeof((h1)->part)))
+        (bcmp(&(h1)->part, &(h2)->part, sizeof((h1)->part)))
 
 #define  MAX_SIZE  40244
+#define  MAX_SAMPLES  ((MAX_SIZE-240)/2)
 
 
 #define  isprint(c) \
@@ -338,9 +428,13 @@ FILE *fout;
 }
 
 static char buf[MAX_SIZE], out_buf[MAX_SIZE];
-static float fb[3000];
+static float fb[MAX_SAMPLES];
 static int nb_tr = 0;
+static int lg_last_trace = 0;  /* Length of the last trace written */
 static char *multiple_file, *multiple_host;
+static char *multiple_input = 0;
+static int compressed_in = 0;   /* The last input opened is compressed */
+static int range = 0;
 static char dev_name[510];
 
 int mygetopt(argc, argv, opt, val)
@@ -447,11 +541,76 @@ int sz;
     }
 }
 
+/*
+  Selection by area ( -area )
+
+  The trace is kept when its point ( midpoint, source or receiver, with
+  scaler_cor applied ) is in a polygon, or in a box when two corners only
+  are given.
+  */
+
+#define AREA_MID 0
+#define AREA_SRC 1
+#define AREA_RCV 2
+
+static int area_kind = AREA_MID;
+static int area_nb = 0;                 /* Number of vertices */
+static double *area_x, *area_y;
+static double area_x0, area_y0, area_x1, area_y1;       /* Bounding box */
+
+static double scale_coordinate(int v, short scaler)
+{
+    if( scaler > 0 )
+	return (double)v * scaler;
+    if( scaler < 0 )
+	return (double)v / -scaler;
+    return v;
+}
+
+static void trace_point(SEGY_TR_HD *tr_hd, int kind, double *x, double *y)
+{
+    short scaler = ntohs(tr_hd->scaler_cor);
+    double xs = scale_coordinate(ntohl(tr_hd->src_X), scaler);
+    double ys = scale_coordinate(ntohl(tr_hd->src_Y), scaler);
+    double xg = scale_coordinate(ntohl(tr_hd->grp_X), scaler);
+    double yg = scale_coordinate(ntohl(tr_hd->grp_Y), scaler);
+
+    switch( kind ) {
+      case AREA_SRC : *x = xs; *y = ys; break;
+      case AREA_RCV : *x = xg; *y = yg; break;
+      default : *x = (xs+xg) / 2; *y = (ys+yg) / 2; break;
+    }
+}
+
+static int point_in_area(double x, double y)
+{
+    int i, j, in = 0;
+    if( x < area_x0 || x > area_x1 || y < area_y0 || y > area_y1 )
+	return 0;
+    if( area_nb == 2 )
+	return 1;
+    /* Crossings of an horizontal ray */
+    for( i = 0, j = area_nb-1 ; i < area_nb ; j = i++ )
+	if( ( area_y[i] > y ) != ( area_y[j] > y )
+	    && x < area_x[j] + (area_x[i]-area_x[j]) * (y-area_y[j]) / (area_y[i]-area_y[j]) )
+	    in = !in;
+    return in;
+}
+
+static int trace_in_polygon(SEGY_TR_HD *tr_hd)
+{
+    double x, y;
+    trace_point(tr_hd, area_kind, &x, &y);
+    return point_in_area(x, y);
+}
+
 static int cdp_min = 0, cdp_max = 0;
 
 static int trace_is_in_area(tr_hd)
 SEGY_TR_HD *tr_hd;
 {
+    if( area_nb && !trace_in_polygon(tr_hd) )
+	return 0;
     if( cdp_min >= cdp_max )
 	return 1;
     if( ntohl(tr_hd->cdp_ens) <= cdp_min )
@@ -461,6 +620,132 @@ SEGY_TR_HD *tr_hd;
     return 1;
 }
 
+/*
+  Geometry ( -geometry "[x0 y0 azimuth dil dxl [il0 xl0]] [field] [il=field] [xl=field]" )
+
+  From src_X, src_Y, grp_X, grp_Y and scaler_cor, srdist gets the source to
+  receiver distance and X_mid, Y_mid the midpoint ( in the units of the
+  coordinates, scaler_cor applying to them too ).  With a grid, line_nu2
+  and sp_nu2, or the fields given by il= and xl=, get the inline and
+  crossline numbers of the bin of the midpoint : the bin il0 xl0 ( default
+  1 1 ) is centred on x0 y0, the crossline numbers grow along azimuth
+  ( degrees clockwise from north ) by bins of dxl and the inline numbers at
+  right angle, clockwise, by bins of dil.  The source to receiver azimuth
+  in degrees goes in field if given.
+  Each quantity is one loop over the headers given : -patch and the copy
+  loop ( read_trace_batch() ) give them by batches, -ckpt one at a time.
+  The loops call floor, atan2 and the byte swaps, so they are not all
+  vectorized.
+  */
+
+#define GEOM_BATCH 256
+
+static int geometry = 0, geom_grid = 0;
+static double geom_x0, geom_y0, geom_sin, geom_cos, geom_dil, geom_dxl;
+static double geom_il0 = 1, geom_xl0 = 1;
+static HD_FIELD *geom_az_field = 0, *geom_il_field = 0, *geom_xl_field = 0;
+
+static void geometry_run(char **hd, int nb)
+{
+    double s[GEOM_BATCH], xs[GEOM_BATCH], ys[GEOM_BATCH], xg[GEOM_BATCH], yg[GEOM_BATCH];
+    double mx[GEOM_BATCH], my[GEOM_BATCH], dx[GEOM_BATCH], dy[GEOM_BATCH], v[GEOM_BATCH];
+    int first;
+
+    for( first = 0 ; first < nb ; first += GEOM_BATCH ) {
+	int i, n = nb - first < GEOM_BATCH ? nb - first : GEOM_BATCH;
+	char **h = hd + first;
+
+	for( i = 0 ; i < n ; i++ ) {
+	    SEGY_TR_HD *t = (SEGY_TR_HD*)h[i];
+	    short scaler = ntohs(t->scaler_cor);
+	    s[i] = scaler > 0 ? scaler : scaler < 0 ? -1.0 / scaler : 1;
+	    xs[i] = (int)ntohl(t->src_X);
+	    ys[i] = (int)ntohl(t->src_Y);
+	    xg[i] = (int)ntohl(t->grp_X);
+	    yg[i] = (int)ntohl(t->grp_Y);
+	}
+	for( i = 0 ; i < n ; i++ ) {
+	    mx[i] = (xs[i] + xg[i]) * 0.5;
+	    my[i] = (ys[i] + yg[i]) * 0.5;
+	    dx[i] = (xg[i] - xs[i]) * s[i];
+	    dy[i] = (yg[i] - ys[i]) * s[i];
+	}
+	for( i = 0 ; i < n ; i++ )
+	    v[i] = sqrt(dx[i]*dx[i] + dy[i]*dy[i]);
+	for( i = 0 ; i < n ; i++ ) {
+	    SEGY_TR_HD *t = (SEGY_TR_HD*)h[i];
+	    t->srdist = htonl((int)floor(v[i] + 0.5));
+	    t->X_mid = htonl((int)floor(mx[i] + 0.5));
+	    t->Y_mid = htonl((int)floor(my[i] + 0.5));
+	}
+	if( geom_az_field ) {
+	    for( i = 0 ; i < n ; i++ )
+		v[i] = fmod(atan2(dx[i], dy[i]) * 180 / M_PI + 360, 360);
+	    for( i = 0 ; i < n ; i++ )
+		set_field(h[i], geom_az_field, (int)floor(v[i] + 0.5) % 360);
+	}
+	if( geom_grid ) {
+	    /* dx, dy : inline and crossline numbers */
+	    for( i = 0 ; i < n ; i++ ) {
+		double u = mx[i]*s[i] - geom_x0, w = my[i]*s[i] - geom_y0;
+		dx[i] = floor((u*geom_cos - w*geom_sin) / geom_dil + 0.5) + geom_il0;
+		dy[i] = floor((u*geom_sin + w*geom_cos) / geom_dxl + 0.5) + geom_xl0;
+	    }
+	    for( i = 0 ; i < n ; i++ ) {
+		set_field(h[i], geom_il_field, (int)dx[i]);
+		set_field(h[i], geom_xl_field, (int)dy[i]);
+	    }
+	}
+    }
+}
+
+static void setup_geometry(char *buf)
+{
+    double g[7];
+    char *tok, *end;
+    int n = 0;
+
+    geom_il_field = find_field("line_nu2", 8);
+    geom_xl_field = find_field("sp_nu2", 6);
+    for( tok = strtok(buf, " \t") ; tok ; tok = strtok(0, " \t") ) {
+	double d = strtod(tok, &end);
+	HD_FIELD **f = &geom_az_field;
+	if( *end == 0 && n < 7 && !geom_az_field ) {
+	    g[n++] = d;
+	    continue;
+	}
+	/* il=field, xl=field : where the bin numbers go */
+	if( !strncmp(tok, "il=", 3) || !strncmp(tok, "xl=", 3) ) {
+	    f = tok[0] == 'i' ? &geom_il_field : &geom_xl_field;
+	    tok += 3;
+	}
+	else if( geom_az_field )
+	    f = 0;
+	if( f == 0 || (*f = find_field(tok, strlen(tok))) == 0 ) {
+	    fprintf(stderr, "-geometry : bad field %s\n", tok);
+	    exit(1);
+	}
+    }
+    if( (n != 0 && n != 5 && n != 7) || (n && (g[3] <= 0 || g[4] <= 0)) ) {
+	fprintf(stderr, "-geometry : x0 y0 azimuth dil dxl [il0 xl0] expected\n");
+	exit(1);
+    }
+    geometry = 1;
+    geom_grid = n > 0;
+    if( geom_grid ) {
+	geom_x0 = g[0];
+	geom_y0 = g[1];
+	geom_sin = sin(g[2] * M_PI / 180);
+	geom_cos = cos(g[2] * M_PI / 180);
+	geom_dil = g[3];
+	geom_dxl = g[4];
+    }
+    if( n == 7 ) {
+	geom_il0 = g[5];
+	geom_xl0 = g[6];
+    }
+}
+
 #define USAGE \
 " %s -i <input> [ -o output ] [ -dump ]\n\
    -o name : the input is checked and copied to name\n\
@@ -484,28 +769,104 @@ SEGY_TR_HD *tr_hd;
    -all : Skip end of file on read. Useful to read a tape containing \n\
      multiple files in one run.\n\
    -cov [file off1 sz1 ...] : extract coverage in 'file'.\n\
+   -stats file : write the number of traces, dead traces, min, max and rms\n\
+     of the amplitudes in file\n\
+     -cube, -bricks, -pyramid, -cov and -stats may be given together : each\n\
+     one then runs on its own thread, the input being read once\n\
      The coverage file will be written in 'file', seven values per trace.\n\
      Each value is defined by its offset in byte ( beginning at 0 )\n\
      and the size ( 2 for 2byte integer and 4 for 4bytes integer )\n\
      All these arguments must be enclosed in \"\n\
+   -bricks \"file l0 l1 dl t0 t1 dt s0 s1 ds\" : write the volume described\n\
+     as for -cube in a bricked file, fast to read along any axis\n\
+   -brick_extract \"file what output\" : extract from a bricked file, what\n\
+     being inline i, crossline i, time i or box i0 i1 j0 j1 k0 k1\n\
+   -pyramid \"file [levels] [box or rms]\" : write previews of the traces\n\
+     decimated by 2, 4, 8 ... ( 6 levels by default ) in tiles, with an index\n\
+   -set \"field = expression; ...\" : rewrite trace header fields, the\n\
+     expressions using field names, numbers, + - * / %%, comparisons, && || !\n\
+     and abs sqrt hypot atan2 min max\n\
+   -geometry \"[x0 y0 azimuth dil dxl [il0 xl0]] [field] [il=field] [xl=field]\" :\n\
+     compute srdist and X_mid, Y_mid from the coordinates and, with the grid\n\
+     centred on x0 y0 ( bin il0 xl0 ), crosslines along azimuth ( degrees from\n\
+     north ) and bins dil x dxl, the inline and crossline numbers in line_nu2\n\
+     and sp_nu2, or in the fields given by il=field and xl=field; the source\n\
+     to receiver azimuth goes in field if given.  Done before -set\n\
+   -where \"expression\" : keep the traces whose headers, as read, make the\n\
+     expression ( same syntax as -set ) true; on a disk file only the\n\
+     selected traces are read; with -area and an index, it filters the\n\
+     traces of the area\n\
+   -filter \"spec[;spec...]\" : zero phase frequency filter, spec being\n\
+     bandpass f1 f2 f3 f4, notch f width or response file ( lines freq amp )\n\
+   -nmo \"file [linear or sinc] [stretch]\" : NMO correction with the velocities\n\
+     of file ( lines cdp time(ms) velocity ), the samples stretched more\n\
+     than stretch %% ( default 50 ) being muted\n\
+   -agc window : automatic gain control on a window of the given length ( ms )\n\
+   -stack [sorted or memory] : stack the traces by CDP ( word 6 ).  The\n\
+     input is sorted by CDP or the CDPs are kept in the memory given ( MB ),\n\
+     which must hold all the CDPs open together, else some are written twice\n\
+   -check : validate the input ( a disk file ) in parallel and exit.\n\
+     Trace length, number of samples, sample interval, sequence numbers\n\
+     and some header values are checked.\n\
+   -tmin t, -tmax t : only copy the samples between the times t ( ms )\n\
+   -resample n : keep one sample out of n after an anti-alias filter.\n\
+     The number of samples and the sample interval of the headers are updated\n\
+   -resync : when a trace read on a disk file or a pipe does not look like\n\
+     a trace, skip the bytes up to the next plausible trace header\n\
+   -area \"mid|src|rcv x0 y0 x1 y1 [x2 y2 ...] [index file]\" : keep the traces\n\
+     whose midpoint, source or receiver is in the box ( two corners ) or\n\
+     the polygon; with index, a grid index of the input kept in file ( file1,\n\
+     file2, ... for +name inputs ) is used ( and built if needed ) to read\n\
+     only the selected traces\n\
+   -dedupe \"drop or report [field ...]\" : drop or report the traces whose\n\
+     samples and given header fields are the same as an earlier trace\n\
+   -su_in, -su_out : the input / output is in the Seismic Unix format\n\
+   -ckpt \"file [n]\" : save the state of a disk to disk copy in file\n\
+     every n traces ( default 10000 ); not with -cov, -dump_sp, -crc,\n\
+     -bricks, -stats, -pyramid or -cube\n\
+   -resume : with -ckpt, go on with the copy from the saved state\n\
+   -route \"field [n]\" : with -o +name, write each trace in name-<field value>,\n\
+     keeping at most n outputs open; name lists the outputs\n\
+   -aws_in, -aws_out : the input / output is a tape image ( AWSTAPE ) on disk\n\
+   -tape_block n : write n traces in each record of the output tape\n\
+   -tape_buffer n : read or write the tape by its own thread through a\n\
+     buffer of n MB ( 2 at least ), the drive streaming while the other\n\
+     side is slow\n\
+   -crc file : write the CRC32C of the headers and of each trace of the\n\
+     output in file\n\
+   -verify file : check the input ( a disk file ) against the checksums\n\
+     written in file by -crc, in parallel, and exit\n\
+   -diff \"file [tolerance] [n]\" : compare the input with file ( disk files ),\n\
+     in parallel, giving the header fields which differ, the sample errors\n\
+     above tolerance ( default 0 ) and the n first differing traces, and exit\n\
+   -patch journal : apply -geometry and -set to the headers of the input\n\
+     ( a disk file ) in place, writing back the changed headers only, and\n\
+     exit; journal allows to go on after a crash by giving the same command\n\
+   -threads n : number of threads of the parallel modes and of the zstd\n\
+     decompression ( default : all cores )\n\
      Version 2013.12.3 Please contact Bill Menger for help\n"
 
         
 #define READ(file, buf, size) \
-( is_blocked ? read_block(file, buf, MAX_SIZE) : \
+( su_in ? read_su(file, buf, size) : \
+  resync_pending ? resync_read(file, buf, size) : \
+  is_blocked ? read_block(file, buf, MAX_SIZE) : \
   (is_tape ? read_tape(fileno(file), buf, MAX_SIZE) : fread(buf, 1, size, file)) )
 
 static int write_and_check(FILE * file, char * buf, size_t size);
+static int write_header(FILE *file, char *buf, size_t size);
 #define CHECK_SPLIT(file) if( split_output > 0 && nb_written_traces >= nb_split_to_write ) file = new_file_for_split(file);
 
 static SEGY_HD segy_hd;
 static char ebcdic_hd[3200];
 static short nb_samples, data_format, byte_per_sample;
+static short sample_interval;    /* Input sample interval ( micro-seconds ) */
 static size_t  lg_tr;
 static int dump_hd, is_tape = 0, is_blocked = 0, no_headers = 0;
 static int output_is_tape = 0;
 static int nb_written_traces = 0;
 static int max_written_traces = -1;
+static int max_reached = 0;             /* -max_traces reached : end the copy */
 static int skip_tr = 0;
 static short output_fmt = -1;
 static char error_hd = 0;
@@ -519,22 +880,566 @@ static char ext_ebcdic_file[100];
 static int cdpfirst = -1;
 static int cdplast = -1;
 
+/*
+  Tape images ( -aws_in, -aws_out ) and tape blocking ( -tape_block )
+
+  A tape image is a disk file in the AWSTAPE format : each record is
+  written as segments of at most 65535 bytes, each one preceded by a
+  6 bytes header ( length of the segment, length of the previous one, both
+  little endian, and flags ).  A filemark is a header alone.  The tape
+  code calls tape_read(), tape_write() and tape_op() which either talk
+  to the drive or emulate it on the image, so the tape paths can be run
+  on ordinary disks.
+
+  With -tape_block n, n traces are written in each record of an output
+  tape.  On input, a record which holds several traces is given back
+  trace by trace.  With -tape_buffer, see below, the records go through
+  a ring buffer served by a thread.
+  */
+
+#define TAPE_MAX_RECORD (1<<20)
+#define AWS_NEW_REC     0x80
+#define AWS_TAPEMARK    0x40
+#define AWS_END_REC     0x20
+#define AWS_MAX_SEG     65535
+
+static int aws_in = 0, aws_out = 0;     /* Input / output are tape images */
+static int aws_prev = 0;                /* Length of the last segment written */
+static int tape_block = 1;              /* Traces per output record */
+static char *tape_blk;                  /* Output record being filled */
+static int tape_blk_lg = 0, tape_blk_nb = 0;
+static char *tape_rec;                  /* Last input record */
+static int tape_rec_lg = 0, tape_rec_pos = 0;
+static size_t tape_lg_tr = 0;           /* Trace length for the deblocking */
+static long long tape_nb_rec = 0, tape_nb_bytes = 0;
+
+static int aws_write_hd(int fd, int lg, int flags)
+{
+    unsigned char hd[6];
+    hd[0] = lg & 0xff;
+    hd[1] = lg >> 8;
+    hd[2] = aws_prev & 0xff;
+    hd[3] = aws_prev >> 8;
+    hd[4] = flags;
+    hd[5] = 0;
+    aws_prev = lg;
+    return write(fd, hd, 6) == 6 ? 0 : -1;
+}
+
+/* Read a record, 0 on a filemark or at the end of the image */
+
+static int aws_read(int fd, char *buf, int lg)
+{
+    unsigned char hd[6];
+    int nb = 0;
+
+    for( ;; ) {
+	int seg, n;
+	n = read(fd, hd, 6);
+	if( n == 0 )
+	    return 0;
+	if( n != 6 ) {
+	    errno = EIO;
+	    return -1;
+	}
+	if( hd[4] & AWS_TAPEMARK )
+	    return 0;
+	seg = hd[0] | hd[1] << 8;
+	n = seg <= lg - nb ? seg : lg - nb;
+	if( read(fd, buf+nb, n) != n ) {
+	    errno = EIO;
+	    return -1;
+	}
+	/* Too long for the buffer : the end is lost, as on a drive */
+	if( n < seg )
+	    lseek(fd, seg - n, SEEK_CUR);
+	nb += n;
+	if( hd[4] & AWS_END_REC )
+	    return nb;
+    }
+}
+
+static int aws_write(int fd, char *buf, int lg)
+{
+    int nb = 0;
+    do {
+	int seg = lg - nb < AWS_MAX_SEG ? lg - nb : AWS_MAX_SEG;
+	int flags = nb == 0 ? AWS_NEW_REC : 0;
+	if( nb + seg == lg )
+	    flags |= AWS_END_REC;
+	if( aws_write_hd(fd, seg, flags) != 0 || write(fd, buf+nb, seg) != seg )
+	    return nb;
+	nb += seg;
+    } while( nb < lg );
+    return nb;
+}
+
+/*
+  Tape buffer ( -tape_buffer n )
+
+  With a buffer of n MB, the drive is served by its own thread : on input
+  it reads the records ahead, on output it writes the records queued by
+  the trace loop, so that the drive keeps streaming while the processing
+  or the disk side is slow.  The buffer is a ring of records, each one
+  preceded by a RING_REC.  The reader stops after a filemark or an error
+  and goes on with the next tape_read(), the positioning done by tape_op()
+  in between being seen.  tape_op() on the output waits for the ring to be
+  written.  A write error is reported by the next tape_write() or by
+  tape_op(), the records still in the ring being lost.
+
+  A stop is a wait of the drive thread ( empty ring on output, full ring on
+  input ) once the streaming has begun, counted once however many times
+  the thread wakes up.  The filling is sampled at each record taken or
+  put by the drive thread.  The ring must hold the largest record, hence
+  at least 2 MB.  A reader that cannot queue a record sets the error,
+  returned by the next tape_read().
+  */
+
+#define RING_WRAP (-2)                  /* The records go on at the beginning */
+#define RING_ALIGN(n) (((size_t)(n) + 7) & ~(size_t)7)
+
+typedef struct ring_rec {
+    int lg;                             /* 0 filemark, -1 error */
+    int err;                            /* errno of an error */
+} RING_REC;
+
+typedef struct tape_ring {
+    int fd, output;
+    char *data;
+    size_t size, head, tail, used;
+    int paused;                         /* Reader stopped on a filemark or an error */
+    int busy;                           /* Writer writing a record */
+    int draining, stop, error;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    long long nb_rec, nb_stops;
+    double fill_sum, fill_min;
+} TAPE_RING;
+
+static size_t tape_buffer_size = 0;
+static TAPE_RING *ring_in = 0, *ring_out = 0;
+
+static void ring_sample(TAPE_RING *r)
+{
+    double fill = (double)r->used / r->size;
+    if( r->nb_rec == 0 || fill < r->fill_min )
+	r->fill_min = fill;
+    r->fill_sum += fill;
+    r->nb_rec++;
+}
+
+/* Copy a record in, waiting for room; -1 if the ring is stopped */
+
+static int ring_put(TAPE_RING *r, char *buf, int lg, int err)
+{
+    RING_REC rec;
+    size_t pos, need = sizeof(RING_REC) + RING_ALIGN(lg > 0 ? lg : 0);
+    int stalled = 0;
+
+    if( need > r->size )
+	return -1;
+    pthread_mutex_lock(&r->lock);
+    for( ;; ) {
+	size_t waste;
+	if( r->stop || r->error ) {
+	    pthread_mutex_unlock(&r->lock);
+	    return -1;
+	}
+	if( r->used == 0 )
+	    r->head = r->tail = 0;      /* Empty : no wrap needed */
+	waste = r->size - r->head < need ? r->size - r->head : 0;
+	if( r->size - r->used >= need + waste ) {
+	    if( waste ) {
+		((RING_REC*)(r->data + r->head))->lg = RING_WRAP;
+		r->used += waste;
+		r->head = 0;
+	    }
+	    break;
+	}
+	if( !r->output && r->nb_rec > 0 && !stalled ) {
+	    r->nb_stops++;
+	    stalled = 1;
+	}
+	pthread_cond_wait(&r->cond, &r->lock);
+    }
+    if( !r->output )
+	ring_sample(r);
+    pos = r->head;
+    pthread_mutex_unlock(&r->lock);
+
+    /* The room is kept : copy without the lock */
+    rec.lg = lg;
+    rec.err = err;
+    memcpy(r->data + pos, &rec, sizeof(RING_REC));
+    if( lg > 0 )
+	memcpy(r->data + pos + sizeof(RING_REC), buf, lg);
+
+    pthread_mutex_lock(&r->lock);
+    r->head = pos + need;
+    if( r->head == r->size )
+	r->head = 0;
+    r->used += need;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    return 0;
+}
+
+/* Copy the next record out, waiting for it; -2 if the ring is stopped */
+
+static int ring_get(TAPE_RING *r, char *buf, int lg, int *err)
+{
+    RING_REC rec;
+    size_t pos;
+    int n, stalled = 0;
+
+    pthread_mutex_lock(&r->lock);
+    for( ;; ) {
+	if( r->used > 0 ) {
+	    memcpy(&rec, r->data + r->tail, sizeof(RING_REC));
+	    if( rec.lg != RING_WRAP )
+		break;
+	    r->used -= r->size - r->tail;
+	    r->tail = 0;
+	    continue;
+	}
+	if( r->stop ) {
+	    pthread_mutex_unlock(&r->lock);
+	    return -2;
+	}
+	if( !r->output && r->error ) {
+	    /* The reader is gone */
+	    *err = r->error;
+	    pthread_mutex_unlock(&r->lock);
+	    return -1;
+	}
+	if( !r->output && r->paused ) {
+	    /* The reader goes on */
+	    r->paused = 0;
+	    pthread_cond_broadcast(&r->cond);
+	}
+	if( r->output && r->nb_rec > 0 && !r->draining && !stalled ) {
+	    r->nb_stops++;
+	    stalled = 1;
+	}
+	pthread_cond_wait(&r->cond, &r->lock);
+    }
+    if( r->output ) {
+	ring_sample(r);
+	r->busy = 1;
+    }
+    pos = r->tail;
+    pthread_mutex_unlock(&r->lock);
+
+    n = rec.lg < lg ? rec.lg : lg;
+    if( n > 0 )
+	memcpy(buf, r->data + pos + sizeof(RING_REC), n);
+    *err = rec.err;
+
+    pthread_mutex_lock(&r->lock);
+    pos += sizeof(RING_REC) + RING_ALIGN(rec.lg > 0 ? rec.lg : 0);
+    r->used -= pos - r->tail;
+    r->tail = pos == r->size ? 0 : pos;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    return n;
+}
+
+static void *ring_reader(void *arg)
+{
+    TAPE_RING *r = (TAPE_RING*)arg;
+    char *rec = malloc(TAPE_MAX_RECORD);
+
+    for( ;; ) {
+	int nb = aws_in ? aws_read(r->fd, rec, TAPE_MAX_RECORD) : read(r->fd, rec, TAPE_MAX_RECORD);
+	if( ring_put(r, rec, nb < 0 ? -1 : nb, nb < 0 ? errno : 0) != 0 ) {
+	    pthread_mutex_lock(&r->lock);
+	    if( !r->stop && !r->error )
+		r->error = EMSGSIZE;
+	    pthread_cond_broadcast(&r->cond);
+	    pthread_mutex_unlock(&r->lock);
+	    break;
+	}
+	if( nb <= 0 ) {
+	    /* Wait for the trace loop to take the filemark or the error */
+	    pthread_mutex_lock(&r->lock);
+	    r->paused = 1;
+	    pthread_cond_broadcast(&r->cond);
+	    while( r->paused && !r->stop )
+		pthread_cond_wait(&r->cond, &r->lock);
+	    pthread_mutex_unlock(&r->lock);
+	}
+	if( r->stop )
+	    break;
+    }
+    free(rec);
+    return 0;
+}
+
+static void *ring_writer(void *arg)
+{
+    TAPE_RING *r = (TAPE_RING*)arg;
+    char *rec = malloc(TAPE_MAX_RECORD);
+    int err;
+
+    for( ;; ) {
+	int lg = ring_get(r, rec, TAPE_MAX_RECORD, &err), nb;
+	if( lg == -2 )
+	    break;
+	nb = aws_out ? aws_write(r->fd, rec, lg) : write(r->fd, rec, lg);
+	pthread_mutex_lock(&r->lock);
+	if( nb != lg ) {
+	    r->error = nb < 0 ? errno : EIO;
+	    if( r->error == 0 )
+		r->error = EIO;
+	}
+	r->busy = 0;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	if( nb != lg )
+	    break;
+    }
+    free(rec);
+    return 0;
+}
+
+static int ring_drain(TAPE_RING *r);
+
+/* An exit() in the trace loop must not lose the records queued */
+
+static void ring_exit()
+{
+    if( ring_out )
+	ring_drain(ring_out);
+}
+
+static TAPE_RING *ring_new(int fd, int output)
+{
+    TAPE_RING *r = calloc(1, sizeof(TAPE_RING));
+    r->fd = fd;
+    r->output = output;
+    r->size = RING_ALIGN(tape_buffer_size);
+    r->data = malloc(r->size);
+    if( r->data == 0 ) {
+	fprintf(stderr, "-tape_buffer : cannot allocate %ld MB\n", (long)(r->size >> 20));
+	exit(1);
+    }
+    pthread_mutex_init(&r->lock, 0);
+    pthread_cond_init(&r->cond, 0);
+    pthread_create(&r->thread, 0, output ? ring_writer : ring_reader, r);
+    if( output )
+	atexit(ring_exit);
+    return r;
+}
+
+static void ring_report(TAPE_RING *r)
+{
+    fprintf(stderr, "Tape buffer ( %s ) : %lld records, %lld drive stops, "
+	    "%.0f %% full on average, %.0f %% at least\n", r->output ? "output" : "input",
+	    r->nb_rec, r->nb_stops, r->nb_rec ? 100 * r->fill_sum / r->nb_rec : 0.0,
+	    100 * r->fill_min);
+}
+
+/* Wait for the output ring to be written, -1 on a write error */
+
+static int ring_drain(TAPE_RING *r)
+{
+    int error;
+    pthread_mutex_lock(&r->lock);
+    r->draining = 1;
+    while( (r->used > 0 || r->busy) && !r->error )
+	pthread_cond_wait(&r->cond, &r->lock);
+    r->draining = 0;
+    error = r->error;
+    pthread_mutex_unlock(&r->lock);
+    if( error ) {
+	errno = error;
+	return -1;
+    }
+    return 0;
+}
+
+static void ring_free(TAPE_RING *r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    r->paused = 0;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, 0);
+    ring_report(r);
+    free(r->data);
+    free(r);
+}
+
+/* Before a positioning : no record on the way */
+
+static void ring_sync(int fd)
+{
+    if( ring_out && ring_out->fd == fd && ring_drain(ring_out) != 0 ) {
+	/* Write error : what is left is lost, the writer starts again */
+	pthread_join(ring_out->thread, 0);
+	fprintf(stderr, "Tape buffer : write error, %ld bytes lost\n", (long)ring_out->used);
+	ring_out->head = ring_out->tail = ring_out->used = 0;
+	ring_out->error = 0;
+	pthread_create(&ring_out->thread, 0, ring_writer, ring_out);
+    }
+    if( ring_in && ring_in->fd == fd ) {
+	pthread_mutex_lock(&ring_in->lock);
+	while( !ring_in->paused )
+	    pthread_cond_wait(&ring_in->cond, &ring_in->lock);
+	ring_in->head = ring_in->tail = ring_in->used = 0;
+	pthread_mutex_unlock(&ring_in->lock);
+    }
+}
+
+static int ring_read(int fd, char *buf, int lg)
+{
+    int nb, err;
+    if( ring_in && ring_in->fd != fd ) {
+	ring_free(ring_in);
+	ring_in = 0;
+    }
+    if( ring_in == 0 )
+	ring_in = ring_new(fd, 0);
+    nb = ring_get(ring_in, buf, lg, &err);
+    if( nb < 0 )
+	errno = err;
+    return nb;
+}
+
+static int ring_write(int fd, char *buf, int lg)
+{
+    if( ring_out && ring_out->fd != fd ) {
+	/* New tape : the previous one has been drained by tape_op() */
+	if( ring_drain(ring_out) != 0 )
+	    return -1;
+	ring_out->fd = fd;
+    }
+    if( ring_out == 0 )
+	ring_out = ring_new(fd, 1);
+    if( ring_put(ring_out, buf, lg, 0) != 0 ) {
+	errno = ring_out->error ? ring_out->error : EIO;
+	return -1;
+    }
+    return lg;
+}
+
+static int tape_read(int fd, char *buf, int lg)
+{
+    if( tape_buffer_size )
+	return ring_read(fd, buf, lg);
+    return aws_in ? aws_read(fd, buf, lg) : read(fd, buf, lg);
+}
+
+static int tape_write(int fd, char *buf, int lg)
+{
+    int nb = tape_buffer_size ? ring_write(fd, buf, lg)
+	: aws_out ? aws_write(fd, buf, lg) : write(fd, buf, lg);
+    if( nb > 0 ) {
+	tape_nb_rec++;
+	tape_nb_bytes += nb;
+    }
+    return nb;
+}
+
+/* The MTIOCTOP operations used here : MTWEOF, MTFSF, MTFSR and MTOFFL */
+
+static int tape_op(int fd, int image, int op, int count)
+{
+    struct mtop mt;
+
+    if( tape_buffer_size )
+	ring_sync(fd);
+    if( !image ) {
+	mt.mt_op = op;
+	mt.mt_count = count;
+	return ioctl(fd, MTIOCTOP, &mt);
+    }
+    while( count-- > 0 ) {
+	int nb;
+	switch( op ) {
+	  case MTWEOF :
+	    if( aws_write_hd(fd, 0, AWS_TAPEMARK) != 0 )
+		return -1;
+	    aws_prev = 0;
+	    break;
+	  case MTFSF :
+	    while( ( nb = aws_read(fd, tape_rec, TAPE_MAX_RECORD) ) > 0 )
+		;
+	    if( nb < 0 )
+		return -1;
+	    break;
+	  case MTFSR :
+	    if( aws_read(fd, tape_rec, TAPE_MAX_RECORD) <= 0 )
+		return -1;
+	    break;
+	  default :
+	    break;
+	}
+    }
+    return 0;
+}
+
+/* Write the traces gathered in the current output record */
+
+static int flush_tape_block(FILE *file)
+{
+    int nb = 0;
+    if( tape_blk_lg > 0 ) {
+	nb = tape_write(fileno(file), tape_blk, tape_blk_lg);
+	if( nb != tape_blk_lg )
+	    perror("write");
+    }
+    tape_blk_lg = tape_blk_nb = 0;
+    return nb;
+}
+
+/* End of an output tape : last record and, for an image, two filemarks */
+
+static void close_tape_output(FILE *file)
+{
+    flush_tape_block(file);
+    if( aws_out )
+	tape_op(fileno(file), 1, MTWEOF, 2);
+    if( ring_out ) {
+	ring_sync(fileno(file));
+	ring_free(ring_out);
+	ring_out = 0;
+    }
+    fprintf(stderr, "%lld tape records written, %lld bytes per record\n",
+	    tape_nb_rec, tape_nb_rec ? tape_nb_bytes / tape_nb_rec : 0);
+}
+
+/* Give back a record read in tape_rec, trace by trace when it holds several */
+
+static int tape_deblock(char *buf, int lg, int nb)
+{
+    tape_rec_pos = tape_rec_lg = 0;
+    if( nb > 0 && tape_lg_tr > 0 && nb > tape_lg_tr && nb % tape_lg_tr == 0 ) {
+	tape_rec_lg = nb;
+	tape_rec_pos = nb = tape_lg_tr;
+    }
+    if( nb > lg )
+	nb = lg;
+    if( nb > 0 )
+	memcpy(buf, tape_rec, nb);
+    return nb;
+}
+
 static FILE *new_file_for_split(FILE *file)
 {
-    if( output_is_tape ) {
+    if( output_is_tape )
+	flush_tape_block(file);
+    if( output_is_tape && !aws_out ) {
 	// Goto next tape.
 	int fd = fileno(file);
 	int itest, ret;
 	/* Write two EOFS */
-	struct mtop mtc;
-	struct mtop mt_command;
-	mtc.mt_op = MTWEOF;
-	mtc.mt_count = 2;
-	if( ioctl(fd, MTIOCTOP, &mtc) == -1 )
+	if( tape_op(fd, 0, MTWEOF, 2) == -1 )
 	    perror("ioctl");
 	fprintf(stderr, "Ejecting current tape\n");
-	mt_command.mt_op = MTOFFL;
-	ret = ioctl(fd, MTIOCTOP, &mt_command);
+	ret = tape_op(fd, 0, MTOFFL, 1);
 	fclose(file);
 	itest = 0;
 	again_split :
@@ -566,14 +1471,19 @@ static FILE *new_file_for_split(FILE *file)
 
 	char *p = dev_name+strlen(dev_name)-1;
 	(*p)++;
+	if( aws_out ) {
+	    /* Next image */
+	    tape_op(fileno(file), 1, MTWEOF, 2);
+	    aws_prev = 0;
+	}
 	fclose(file);
 	file = fopen(dev_name, "w");
     }
     nb_split_to_write += split_output;
     if ( split_hd ){
 	fprintf( stderr,"split_d %d \n", split_hd);
-	write_and_check(file, ebcdic_hd, (size_t) 3200);
-	write_and_check(file, (char *) &segy_hd, (size_t) 400);
+	write_header(file, ebcdic_hd, (size_t) 3200);
+	write_header(file, (char *) &segy_hd, (size_t) 400);
     }
     return file;
 }
@@ -584,23 +1494,31 @@ char *buf;
 int lg;
 {
     int retry = 0;
-    int nb = read(fd, buf, lg);
+    int nb;
+
+    /* Next trace of a multi-trace record */
+    if( tape_rec_pos < tape_rec_lg ) {
+	memcpy(buf, tape_rec+tape_rec_pos, tape_lg_tr);
+	tape_rec_pos += tape_lg_tr;
+	return tape_lg_tr;
+    }
+    if( tape_rec == 0 )
+	tape_rec = malloc(TAPE_MAX_RECORD);
+
+    nb = tape_read(fd, tape_rec, TAPE_MAX_RECORD);
     if( nb == 0 && all_files_in_input ) {
 	/* Skip to next file */
-	struct mtop mt;
-	mt.mt_op = MTFSF;
-	mt.mt_count = 1;
-	if( ioctl(fd, MTIOCTOP, &mt) != 0 ) {
+	if( tape_op(fd, aws_in, MTFSF, 1) != 0 ) {
 	  perror("ioctl");
 	  return -1; 
 	}
-	nb = read(fd, buf, MAX_SIZE);
+	nb = tape_read(fd, tape_rec, TAPE_MAX_RECORD);
 	if( nb == 3200 ) {
 	  fprintf(stderr, "New file, read succesfully 3200 bytes\n");
-	    nb = read(fd, buf, MAX_SIZE);
+	    nb = tape_read(fd, tape_rec, TAPE_MAX_RECORD);
 	    if( nb == 400 ){
 	      fprintf(stderr, "New file, read succesfully 400 bytes\n");
-	      nb = read(fd, buf, lg);
+	      nb = tape_read(fd, tape_rec, TAPE_MAX_RECORD);
 	      if ( nb < 0 ) perror( "read_tape" );
 	    }
 	}
@@ -608,53 +1526,411 @@ int lg;
 
     while ( nb < 0 && retry < 100 ){
       	/* Skip to next file */
-	struct mtop mt;
-	mt.mt_op = MTFSR;
-	mt.mt_count = 5;
-	if( ioctl(fd, MTIOCTOP, &mt) != 0 ) {
+	if( tape_op(fd, aws_in, MTFSR, 5) != 0 ) {
 	  perror("ioctl FSR");
 	  return -1;
 	}
 	fprintf(stderr, "Successfully Skipped 5 records\n");
-	nb = read(fd, buf, lg);
+	nb = tape_read(fd, tape_rec, TAPE_MAX_RECORD);
 	retry++;
     }
-    return nb;
+    return tape_deblock(buf, lg, nb);
 }
 
-void change_buf(in,nb)
-int *in, nb;
-{
-in[0] = nb;
-  }
+/*
+  Checksums ( -crc sidecar, -verify sidecar )
 
-static int write_and_check(file, buf, lg)
-FILE *file;
-char *buf;
-size_t lg;
+  CRC32C ( Castagnoli ) of the 3600 bytes of tape headers, of each trace and
+  of the whole output, as written.  The crc32 instruction of SSE4.2 is used
+  when the processor has it.  The sidecar holds a CRC_HD then the CRC of
+  each trace in order.
+  */
+
+#define CRC_MAGIC "SEGYCRC1"
+
+typedef struct crc_hd {
+    char magic[8];
+    unsigned hd_crc;            /* CRC of the 3200 and 400 bytes headers */
+    unsigned file_crc;          /* CRC of the whole output */
+    unsigned lg_tr;             /* Length of a trace */
+    unsigned dummy;
+    long long nb_traces;
+} CRC_HD;
+
+static unsigned crc32c_table[256];
+static unsigned (*crc32c_fn)(unsigned crc, unsigned char *p, size_t n) = 0;
+static FILE *crc_file = 0;
+static CRC_HD crc_hd;
+
+static unsigned crc32c_sw(unsigned crc, unsigned char *p, size_t n)
 {
-    struct stat st;
-    struct mtop mt_command;
-    int nb, fd = fileno(file);
-    if( DEBUG) fprintf(stderr,"%d: FILE=%d buf=%X lg=%d\n",__LINE__,fd,buf,lg);
+    crc = ~crc;
+    while( n-- )
+	crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
 
-    /* Change the trace sequence number within reel */
-    if ( lg != 3200 && lg != 400 ){
-SEGY_TR_HD *tr_tmp_hd = (SEGY_TR_HD*)buf;
-int test_trace=ntohl(tr_tmp_hd->traseqlin);   
-int test_trace2=tr_tmp_hd->traseqrel; /* ntohl(tr_tmp_hd->traseqrel); */
-int test_trace3=ntohl(tr_tmp_hd->tr_in_cdp);
-if(DEBUG)fprintf(stderr, "%d:    traseqlin %d, traseqrel %d tr_in_cdp %d\n",__LINE__, test_trace,test_trace2,test_trace3 );
-if(DEBUG)fprintf(stderr, "%d: BS traseqlin %d, traseqrel %d tr_in_cdp %d\n",__LINE__, tr_tmp_hd->traseqlin,tr_tmp_hd->traseqrel,tr_tmp_hd->tr_in_cdp );
-      nb_tr++;
-      change_buf(buf+4,htonl(nb_tr));
-      test_trace2=ntohl(tr_tmp_hd->traseqrel);
-      if(DEBUG)fprintf(stderr, "%d:    traseqlin %d, traseqrel %d tr_in_cdp %d\n",__LINE__, test_trace,test_trace2,test_trace3 );
-      if(DEBUG)fprintf(stderr,"%d: nb_tr=%d\n",__LINE__,nb_tr);
-    } else {
-      nb_tr=0;
+#if defined(__GNUC__) && defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static unsigned crc32c_hw(unsigned crc, unsigned char *p, size_t n)
+{
+    unsigned long long c = ~crc;
+    while( n >= 8 ) {
+	unsigned long long v;
+	memcpy(&v, p, 8);
+	c = __builtin_ia32_crc32di(c, v);
+	p += 8;
+	n -= 8;
     }
+    while( n-- )
+	c = __builtin_ia32_crc32qi((unsigned)c, *p++);
+    return ~(unsigned)c;
+}
+#endif
 
+static unsigned crc32c(unsigned crc, char *p, size_t n)
+{
+    if( crc32c_fn == 0 ) {
+	int i, k;
+	for( i = 0 ; i < 256 ; i++ ) {
+	    unsigned c = i;
+	    for( k = 0 ; k < 8 ; k++ )
+		c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+	    crc32c_table[i] = c;
+	}
+	crc32c_fn = crc32c_sw;
+#if defined(__GNUC__) && defined(__x86_64__)
+	if( __builtin_cpu_supports("sse4.2") )
+	    crc32c_fn = crc32c_hw;
+#endif
+    }
+    return (*crc32c_fn)(crc, (unsigned char*)p, n);
+}
+
+static void setup_checksum(char *name)
+{
+    crc_file = fopen(name, "w");
+    if( crc_file == 0 ) {
+	perror(name);
+	exit(1);
+    }
+    memset(&crc_hd, 0, sizeof(crc_hd));
+    memcpy(crc_hd.magic, CRC_MAGIC, 8);
+    fwrite(&crc_hd, sizeof(crc_hd), 1, crc_file);
+}
+
+/* Called by write_and_check() for each block written, hd for a tape header */
+
+static void checksum_block(char *buf, size_t lg, int hd)
+{
+    crc_hd.file_crc = crc32c(crc_hd.file_crc, buf, lg);
+    if( hd )
+	crc_hd.hd_crc = crc32c(crc_hd.hd_crc, buf, lg);
+    else {
+	unsigned c = crc32c(0, buf, lg);
+	crc_hd.lg_tr = lg;
+	crc_hd.nb_traces++;
+	fwrite(&c, sizeof(c), 1, crc_file);
+    }
+}
+
+static void close_checksum()
+{
+    fseek(crc_file, 0, SEEK_SET);
+    fwrite(&crc_hd, sizeof(crc_hd), 1, crc_file);
+    fclose(crc_file);
+    fprintf(stdout, "CRC32C of the output %08x, %lld traces\n",
+	    crc_hd.file_crc, crc_hd.nb_traces);
+}
+
+/*
+  Seismic Unix traces ( -su_in, -su_out )
+
+  A SU file is made of the traces only : the 240 bytes header in the
+  byte order of the machine, the fields up to byte 180 being those of
+  SEG-Y, then the samples in native floats.  In input, read_su() makes
+  a SEG-Y stream of it for READ, with tape headers built from the first
+  trace and samples in format 5.  In output, write_and_check() drops the
+  tape headers and swaps the trace headers, the samples being written
+  in format 5.  The byte order of the header is changed by a permutation
+  computed once from tr_fields.
+  */
+
+#define SU_LG_HD 180    /* Part of the header common to SEG-Y and SU */
+
+static int su_in = 0, su_out = 0;
+static int su_state = 0;                /* 0 : EBCDIC to give, 1 : binary header, 2 : traces */
+static int su_pending = 0;              /* First header read in advance */
+static char su_first[240];
+static char su_buf[MAX_SIZE];
+static unsigned char su_perm[SU_LG_HD];
+static int su_perm_done = 0;
+
+static void su_header(char *out, char *in)
+{
+    int i;
+    if( !su_perm_done ) {
+	HD_FIELD *f;
+	for( i = 0 ; i < SU_LG_HD ; i++ )
+	    su_perm[i] = i;
+	if( ntohs(1) != 1 )
+	    for( f = tr_fields ; f->name ; f++ )
+		if( f->offset + f->size <= SU_LG_HD )
+		    for( i = 0 ; i < f->size ; i++ )
+			su_perm[f->offset+i] = f->offset + f->size-1-i;
+	su_perm_done = 1;
+    }
+    for( i = 0 ; i < SU_LG_HD ; i++ )
+	out[i] = in[su_perm[i]];
+    memset(out+SU_LG_HD, 0, 240-SU_LG_HD);
+}
+
+static int read_su(FILE *file, char *buf, int size)
+{
+    SEGY_TR_HD *hd = (SEGY_TR_HD*)su_buf;
+    SEGY_HD *bh = (SEGY_HD*)buf;
+    int nb;
+
+    switch( su_state ) {
+      case 0 :
+	if( fread(su_first, 1, 240, file) != 240 )
+	    return 0;
+	su_pending = 1;
+	su_state = 1;
+	memset(buf, 0x40, 3200);        /* EBCDIC blanks */
+	return 3200;
+      case 1 :
+	su_header(su_buf, su_first);
+	memset(buf, 0, 400);
+	bh->sampling = hd->sampling;
+	bh->nb_samples = hd->nb_samples;
+	bh->data_form = htons(5);
+	bh->nb_tra_rec = htons(1);
+	su_state = 2;
+	return 400;
+    }
+    if( su_pending )
+	memcpy(su_buf, su_first, 240);
+    else if( ( nb = fread(su_buf, 1, 240, file) ) != 240 )
+	return nb > 0 ? -1 : 0;
+    su_pending = 0;
+    su_header(buf, su_buf);
+    nb = size - 240;
+    if( nb > 0 )
+	nb = fread(buf+240, 1, nb, file);
+    return 240 + nb;
+}
+
+/*
+  Routing of the traces ( -route field with -o +name )
+
+  Each trace goes to name-<value of the field>, with the tape headers in
+  front.  The outputs stay open as long as the descriptors allow it : when
+  route_max of them are open, the one not used for the longest time is
+  closed and opened again in append mode when a trace comes back to it.
+  Each open output has its own buffer.  At the end, name lists the
+  outputs with their number of traces.
+  */
+
+#define ROUTE_BUFFER (64<<10)
+
+typedef struct route_out {
+    int key, used;
+    FILE *file;
+    char *buffer;
+    long long last;             /* Last use, for the LRU */
+    int nb_tr;                  /* Trace sequence number in the output */
+    long long nb_traces;
+} ROUTE_OUT;
+
+static HD_FIELD *route_field = 0;
+static ROUTE_OUT *route_tab;
+static int route_size = 0, route_nb = 0, route_nb_open = 0, route_max = 0;
+static long long route_clock = 0, route_nb_reopen = 0;
+static FILE *route_list = 0;
+
+static ROUTE_OUT *route_lookup(int key)
+{
+    unsigned h;
+
+    if( 2*(route_nb+1) > route_size ) {
+	ROUTE_OUT *old = route_tab;
+	int i, old_size = route_size;
+	route_size = route_size ? 2*route_size : 256;
+	route_tab = calloc(route_size, sizeof(ROUTE_OUT));
+	for( i = 0 ; i < old_size ; i++ )
+	    if( old[i].used ) {
+		for( h = (unsigned)old[i].key * 2654435761u % route_size ; route_tab[h].used ; h = (h+1) % route_size )
+		    ;
+		route_tab[h] = old[i];
+	    }
+	free(old);
+    }
+    for( h = (unsigned)key * 2654435761u % route_size ;
+	 route_tab[h].used && route_tab[h].key != key ; h = (h+1) % route_size )
+	;
+    if( !route_tab[h].used ) {
+	route_tab[h].used = 1;
+	route_tab[h].key = key;
+	route_nb++;
+    }
+    return &route_tab[h];
+}
+
+static ROUTE_OUT *route_output(char *hd)
+{
+    ROUTE_OUT *r = route_lookup(get_field(hd, route_field));
+
+    if( r->file == 0 ) {
+	char name[600];
+	int i;
+
+	if( route_nb_open >= route_max ) {
+	    /* Close the least recently used output, and take its buffer */
+	    ROUTE_OUT *lru = 0;
+	    for( i = 0 ; i < route_size ; i++ )
+		if( route_tab[i].file && ( lru == 0 || route_tab[i].last < lru->last ) )
+		    lru = &route_tab[i];
+	    fclose(lru->file);
+	    lru->file = 0;
+	    r->buffer = lru->buffer;
+	    lru->buffer = 0;
+	    route_nb_open--;
+	}
+	if( r->nb_traces )
+	    route_nb_reopen++;
+	sprintf(name, "%s-%d", multiple_file, r->key);
+	r->file = fopen(name, r->nb_traces ? "a" : "w");
+	if( r->file == 0 ) {
+	    perror(name);
+	    exit(1);
+	}
+	if( r->buffer == 0 )
+	    r->buffer = malloc(ROUTE_BUFFER);
+	setvbuf(r->file, r->buffer, _IOFBF, ROUTE_BUFFER);
+	route_nb_open++;
+	if( r->nb_traces == 0 && no_headers == 0 && !su_out ) {
+	    fwrite(ebcdic_hd, 1, 3200, r->file);
+	    fwrite(&segy_hd, 1, 400, r->file);
+	}
+    }
+    r->last = route_clock++;
+    r->nb_traces++;
+    return r;
+}
+
+static void setup_route(char *p)
+{
+    char name[100];
+    struct rlimit rl;
+    int n = 0;
+
+    sscanf(p, "%99s %d", name, &n);
+    if( (route_field = find_field(name, strlen(name))) == 0 ) {
+	fprintf(stderr, "-route : unknown field %s\n", name);
+	exit(1);
+    }
+    if( multiple_file == 0 || multiple_file[0] == 0 || multiple_host ) {
+	fprintf(stderr, "-route needs an output -o +name on this host\n");
+	exit(1);
+    }
+    /* Keep some descriptors for the other files */
+    route_max = 512;
+    if( getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY
+	&& rl.rlim_cur < route_max + 32 )
+	route_max = rl.rlim_cur > 40 ? rl.rlim_cur - 32 : 8;
+    if( n > 0 && n < route_max )
+	route_max = n;
+    route_list = fopen(multiple_file, "w");
+    if( route_list == 0 ) {
+	perror(multiple_file);
+	exit(1);
+    }
+}
+
+static void close_route()
+{
+    int i;
+    for( i = 0 ; i < route_size ; i++ )
+	if( route_tab[i].used ) {
+	    if( route_tab[i].file )
+		fclose(route_tab[i].file);
+	    free(route_tab[i].buffer);
+	    fprintf(route_list, "%s-%d %lld\n", multiple_file, route_tab[i].key,
+		    route_tab[i].nb_traces);
+	}
+    fclose(route_list);
+    fprintf(stdout, "%d outputs, %lld reopened\n", route_nb, route_nb_reopen);
+}
+
+void change_buf(in,nb)
+int *in, nb;
+{
+in[0] = nb;
+  }
+
+static int writing_hd = 0;      /* write_and_check() is given a tape header */
+
+/* The tape headers go through here, whatever their length and the traces' */
+
+static int write_header(FILE *file, char *buf, size_t lg)
+{
+    int nb;
+    writing_hd = 1;
+    nb = write_and_check(file, buf, lg);
+    writing_hd = 0;
+    return nb;
+}
+
+static int write_and_check(file, buf, lg)
+FILE *file;
+char *buf;
+size_t lg;
+{
+    struct stat st;
+    int nb, fd = fileno(file);
+    if( DEBUG) fprintf(stderr,"%d: FILE=%d buf=%X lg=%d\n",__LINE__,fd,buf,lg);
+
+    if( route_field ) {
+	/* The tape headers are written with each output */
+	ROUTE_OUT *r;
+	if( writing_hd )
+	    return lg;
+	r = route_output(buf);
+	nb_tr = r->nb_tr++;
+	file = r->file;
+	fd = fileno(file);
+    }
+
+    /* Change the trace sequence number within reel */
+    if ( !writing_hd ){
+SEGY_TR_HD *tr_tmp_hd = (SEGY_TR_HD*)buf;
+int test_trace=ntohl(tr_tmp_hd->traseqlin);   
+int test_trace2=tr_tmp_hd->traseqrel; /* ntohl(tr_tmp_hd->traseqrel); */
+int test_trace3=ntohl(tr_tmp_hd->tr_in_cdp);
+if(DEBUG)fprintf(stderr, "%d:    traseqlin %d, traseqrel %d tr_in_cdp %d\n",__LINE__, test_trace,test_trace2,test_trace3 );
+if(DEBUG)fprintf(stderr, "%d: BS traseqlin %d, traseqrel %d tr_in_cdp %d\n",__LINE__, tr_tmp_hd->traseqlin,tr_tmp_hd->traseqrel,tr_tmp_hd->tr_in_cdp );
+      nb_tr++;
+      lg_last_trace = lg;
+      change_buf(buf+4,htonl(nb_tr));
+      test_trace2=ntohl(tr_tmp_hd->traseqrel);
+      if(DEBUG)fprintf(stderr, "%d:    traseqlin %d, traseqrel %d tr_in_cdp %d\n",__LINE__, test_trace,test_trace2,test_trace3 );
+      if(DEBUG)fprintf(stderr,"%d: nb_tr=%d\n",__LINE__,nb_tr);
+    } else {
+      nb_tr=0;
+    }
+
+    if( su_out ) {
+	/* No tape headers in SU */
+	if( writing_hd )
+	    return lg;
+	su_header(su_buf, buf);
+	memcpy(su_buf+240, buf+240, lg-240);
+	buf = su_buf;
+    }
+
+    if( crc_file )
+	checksum_block(buf, lg, writing_hd);
 
     if( output_is_tape == 0 ) {
       nb = fwrite(buf, 1, lg, file);
@@ -666,7 +1942,21 @@ if(DEBUG)fprintf(stderr, "%d: BS traseqlin %d, traseqrel %d tr_in_cdp %d\n",__LI
       }
     }
     /* if here, then output_is_not_tape!!! */
-    nb = write(fd, buf, lg);
+    if( !writing_hd && tape_block > 1 ) {
+	/* Gather the traces in a record */
+	if( tape_blk == 0 )
+	    tape_blk = malloc(TAPE_MAX_RECORD);
+	if( tape_blk_lg + lg > TAPE_MAX_RECORD && flush_tape_block(file) < 0 )
+	    return -1;
+	memcpy(tape_blk+tape_blk_lg, buf, lg);
+	tape_blk_lg += lg;
+	if( ++tape_blk_nb < tape_block )
+	    return lg;
+	return flush_tape_block(file) > 0 ? lg : -1;
+    }
+    if( tape_blk_lg > 0 )
+	flush_tape_block(file);
+    nb = tape_write(fd, buf, lg);
     if( nb == lg )
       return nb;
     if(DEBUG)fprintf(stderr,"%d: nb=%d lg=%d\n",__LINE__,nb,lg); 
@@ -680,14 +1970,10 @@ if(DEBUG)fprintf(stderr, "%d: BS traseqlin %d, traseqrel %d tr_in_cdp %d\n",__LI
 	    int itest, ret;
 	    char buf[100];
 	    /* Write two EOFS */
-	    struct mtop mtc;
-	    mtc.mt_op = MTWEOF;
-	    mtc.mt_count = 2;
-	    if( ioctl(fd, MTIOCTOP, &mtc) == -1 )
+	    if( tape_op(fd, 0, MTWEOF, 2) == -1 )
 		perror("ioctl");
 	    fprintf(stderr, "Ejecting current tape\n");
-	    mt_command.mt_op = MTOFFL;
-	    ret = ioctl(fd, MTIOCTOP, &mt_command);
+	    ret = tape_op(fd, 0, MTOFFL, 1);
 	    close(fd);
 	    again :
 	    itest = 0;
@@ -721,584 +2007,5054 @@ if(DEBUG)fprintf(stderr, "%d: BS traseqlin %d, traseqrel %d tr_in_cdp %d\n",__LI
     return -1;
 }
 
-int read_a_tape(fdin, fdout, file_info, tape_number, file_dump_sp)
-FILE *fdin, *fdout;
-FILE *file_info;   /* Dump informations/errors on this files */
-int tape_number;
-FILE *file_dump_sp; /* Dump trace header info on this file */
+/*
+  Resynchronization ( -resync )
+
+  When a trace read from a stream does not look like a trace ( number of
+  samples or sample interval not those of the binary header ), the input
+  has lost the alignment on the trace boundaries.  The input is then read
+  by large windows in which the key made of nb_samples and sampling ( bytes
+  115-118 of the trace header ) is searched.  A candidate is accepted when
+  the following trace header also matches and the sequence numbers go on.
+  The bytes of the window after the accepted trace are given back to READ.
+  Tapes are not concerned : a bad record is skipped by read_tape().
+  */
+
+#define RESYNC_WINDOW (4<<20)
+
+static int resync = 0;
+static int resync_last_seq = 0;
+static long long resync_skipped = 0;
+static int resync_count = 0;
+static char *resync_buf = 0;
+static size_t resync_pos = 0, resync_len = 0;
+
+#define resync_pending (resync_pos < resync_len)
+
+/* Serve a read from the bytes left by the last resynchronization */
+
+static int resync_read(FILE *file, char *buf, size_t size)
 {
-    size_t lg_tr_out,lg_tr;
-    int nb, lg_read, nb_samples_error = 0;
-    int skip_read = 0;
-    int current_trace = 1;
-    int try_count=0;
+    size_t nb = resync_len - resync_pos;
+    if( nb > size )
+	nb = size;
+    memcpy(buf, resync_buf+resync_pos, nb);
+    resync_pos += nb;
+    if( nb < size )
+	nb += fread(buf+nb, 1, size-nb, file);
+    return nb;
+}
 
-    /*  Read the EBCDIC Header */
-    
-    lg_read = is_tape ? MAX_SIZE : 3200;
-    nb = READ(fdin, buf, 3200);
-    if( nb == 0 )
-	return -1;
+static int resync_key(char *key)
+{
+    BYTE2 v[2];
+    v[0] = htons(nb_samples);
+    v[1] = htons(sample_interval);
+    memcpy(key, v, 4);
+    return v[1] == 0 ? 2 : 4;
+}
 
-    if( nb != 3200 ) {
-        if( error_hd ) {
-	    fprintf(file_info, "EBCDIC Header not of size 3200\n");
-	    fprintf(file_info, " ebcdic header %d \n\n", nb);
-	    hex_dmp(ebcdic_hd, 160, file_info);
-	}
-        if( nb == - 1) {
-          perror("cp_segy");
-        }
-    }
-    else
-	memcpy(ebcdic_hd, buf, 3200);
+static int trace_hd_is_plausible(SEGY_TR_HD *tr_hd)
+{
+    if( (short)ntohs(tr_hd->nb_samples) != nb_samples )
+	return 0;
+    if( sample_interval != 0 && (short)ntohs(tr_hd->sampling) != sample_interval )
+	return 0;
+    return 1;
+}
 
-    /* If an external ebcdic exists, read it now */
+/* First position of key ( lg_key bytes ) in s[0..n[ or -1 */
 
-    if( ext_ebcdic_file[0] != 0 ) {
-	int l;
-	FILE *f = fopen(ext_ebcdic_file, "r");
-	l = fread(ebcdic_hd, 1, 3200, f);
-	fclose(f);
-	if( l != 3200 ) {
-	    fprintf(stderr, "EBCDIC File %s has not correct length ?\n", ext_ebcdic_file);
-	    exit(1);
+static long find_key(char *s, size_t n, char *key, int lg_key)
+{
+    size_t i = 0;
+    if( n < lg_key )
+	return -1;
+    n -= lg_key - 1;
+#ifdef __SSE2__
+    {
+	/* Compare the first and the last byte of the key 16 positions at a time */
+	__m128i first = _mm_set1_epi8(key[0]);
+	__m128i last = _mm_set1_epi8(key[lg_key-1]);
+	for( ; i + 16 <= n ; i += 16 ) {
+	    __m128i b0 = _mm_loadu_si128((__m128i*)(s+i));
+	    __m128i b1 = _mm_loadu_si128((__m128i*)(s+i+lg_key-1));
+	    unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(b0, first),
+							    _mm_cmpeq_epi8(b1, last)));
+	    while( mask ) {
+		int bit = __builtin_ctz(mask);
+		if( !memcmp(s+i+bit, key, lg_key) )
+		    return i+bit;
+		mask &= mask-1;
+	    }
 	}
     }
-	
-
-    /*  Read the binary header */
-    
-    if( nb == 400 ) {
-        fprintf(stderr, " Previous header was 400, Try to use it as binary header\n");
-        if( tape_number == 1 )
-            write_and_check(fdout, ebcdic_hd, (size_t) 3200);
+#endif
+    for( ; i < n ; i++ ) {
+	char *p = memchr(s+i, key[0], n-i);
+	if( p == 0 )
+	    return -1;
+	i = p-s;
+	if( !memcmp(p, key, lg_key) )
+	    return i;
     }
-    else if( nb == 3200 ) 
-        nb = READ(fdin, buf, 400);
+    return -1;
+}
 
-    if( nb != 400 ) {
-        if( nb == -1 )
-                perror("Binary header");
-        else if( error_hd ) {
-	    fprintf(file_info,
-		    " Binary Header not  of size 400 ( actually %d )\n",
-                    nb);
-	    hex_dmp(buf, 400, file_info);
-        }
-	skip_read = 1;
-    }
-    else {
-	memcpy(&segy_hd, buf, 400);
-        if( dump_hd )
-            dump_segy_hd(&segy_hd, file_info);
+/* Is there an acceptable trace at offset k of the window ? */
+
+static int resync_candidate(char *w, size_t lg_w, size_t k, size_t lg_tr,
+			    char *key, int lg_key)
+{
+    SEGY_TR_HD *hd = (SEGY_TR_HD*)(w+k);
+    int seq = ntohl(hd->traseqrel);
+
+    if( k + 2*lg_tr <= lg_w ) {
+	/* The next trace is in the window : it must follow this one */
+	SEGY_TR_HD *next = (SEGY_TR_HD*)(w+k+lg_tr);
+	int seq_next = ntohl(next->traseqrel);
+	if( memcmp(((char*)next)+114, key, lg_key) )
+	    return 0;
+	return seq == 0 || seq_next == seq+1;
     }
+    /* Last trace of the window : only the sequence number can tell */
+    return seq > resync_last_seq;
+}
 
-    /* Write both headers */
-    data_format = ntohs(segy_hd.data_form);
-    if( output_fmt != -1 )
-      segy_hd.data_form = htons(output_fmt);    
-    if (DEBUG) fprintf(stderr,"%d: Output_format=%d\n",__LINE__,output_fmt);
-    if( multiple_file )
-	  fdout = next_file(ntohl(segy_hd.line_number));
-    if( fdout != 0 && no_headers == 0 && tape_number == 1 )
-	write_and_check(fdout, ebcdic_hd, (size_t) 3200);
-    if( fdout != 0 && no_headers == 0 && tape_number == 1 )
-	write_and_check(fdout, (char *) &segy_hd, (size_t) 400);
+/*
+  buf holds nb bytes which are not a trace.  Search the next trace and
+  put it in buf.  Return its length or 0 at the end of the input.
+  */
 
-    
-    /* If no copy, exit now */
+static int resync_input(FILE *file, char *buf, int nb, size_t lg_tr, FILE *file_info)
+{
+    char key[4];
+    int lg_key = resync_key(key);
+    size_t lg_max = RESYNC_WINDOW + 2*lg_tr;
+    size_t lg_w, start = 1;
+    long long skipped = 0;
+
+    if( resync_buf == 0 )
+	resync_buf = malloc(lg_max);
+
+    /* The window starts with the rejected bytes then what is not read yet */
+    memmove(resync_buf+nb, resync_buf+resync_pos, resync_len-resync_pos);
+    lg_w = nb + resync_len - resync_pos;
+    memcpy(resync_buf, buf, nb);
+    resync_pos = resync_len = 0;
+
+    while( 1 ) {
+	int at_end;
+	size_t last, end;
+	long p;
+
+	if( lg_w < lg_max )
+	    lg_w += fread(resync_buf+lg_w, 1, lg_max-lg_w, file);
+	at_end = lg_w < lg_max;
+
+	/* Before the end, a candidate must be followed by a whole trace */
+	last = at_end ? lg_w : lg_w - 2*lg_tr + 1;
+	while( start < last ) {
+	    size_t k;
+	    end = last + 114 + lg_key - 1;
+	    if( end > lg_w )
+		end = lg_w;
+	    if( start + 114 + lg_key > end )
+		break;
+	    p = find_key(resync_buf+start+114, end-start-114, key, lg_key);
+	    if( p < 0 )
+		break;
+	    k = start + p;
+	    if( resync_candidate(resync_buf, lg_w, k, lg_tr, key, lg_key) ) {
+		skipped += k;
+		resync_skipped += skipped;
+		resync_count++;
+		fprintf(file_info, "Resynchronized after trace %d : %lld bytes skipped\n",
+			resync_last_seq, skipped);
+		nb = k + lg_tr <= lg_w ? lg_tr : lg_w - k;
+		memcpy(buf, resync_buf+k, nb);
+		resync_pos = k + nb;
+		resync_len = lg_w;
+		resync_last_seq = ntohl(((SEGY_TR_HD*)buf)->traseqrel);
+		return nb;
+	    }
+	    start = k + 1;
+	}
 
-    if( fdout == 0 && check_trace == 0 )
-        return 0;
-    
-    /*  Compute trace length */
-    
-    if( tape_number == 1 ) {
-	  nb_samples = ntohs(segy_hd.nb_samples);
-        if (DEBUG) fprintf(stderr,"%d: nb_samples=%d\n",__LINE__,nb_samples);
-	/*        data_format = segy_hd.data_form; */
-	fprintf( stderr, " data_format : %d\n", data_format );
-        byte_per_sample = 4;
-        if( data_format == 3 ) byte_per_sample = 2;
-        if( output_fmt != -1 ) {
-            lg_tr_out = 240 + nb_samples * 2;
-            if( output_fmt != 3 )
-                lg_tr_out += nb_samples * 2;
-            segy_hd.data_form = htons(output_fmt);
-        }
-    }
-    else {
-        short nbs, dtf;
-        nbs = ntohs(segy_hd.nb_samples);
-        if(DEBUG) fprintf(stderr,"%d: nbs=%d\n",__LINE__,nbs);
-        dtf = ntohs(segy_hd.data_form);
-        if(DEBUG)fprintf(stderr,"%d: dtf=%d\n",__LINE__,dtf);
-        if( nbs != nb_samples ) 
-            fprintf(file_info,
-"Error for tape %d : number of samples not corresponding %d ( expected %d )\n",
-                    tape_number, nbs, nb_samples);
-        if( dtf != data_format )
-            fprintf(file_info,
-"Error for tape %d : data format not corresponding %d ( expected %d )\n", 
-                    tape_number, nbs, nb_samples);
+	if( at_end ) {
+	    skipped += lg_w;
+	    resync_skipped += skipped;
+	    fprintf(file_info, "No trace found after trace %d : %lld bytes skipped\n",
+		    resync_last_seq, skipped);
+	    return 0;
+	}
+
+	/* Nothing before last : keep the tail, a trace header may begin there */
+	skipped += last;
+	memmove(resync_buf, resync_buf+last, lg_w-last);
+	lg_w -= last;
+	start = 0;
     }
+}
 
-    lg_tr = 240+nb_samples*byte_per_sample;
-    if (DEBUG) fprintf(stderr,"%d: lg_tr=%d\n",__LINE__,lg_tr);
+/*
+  Header only reading
 
-    /*  Read in a trace, check its length and write it */
+  When nothing needs the samples ( no output, only -dump_sp or -cov ),
+  the trace headers of a disk file are read alone, by pread at each trace
+  offset.  The reads go by batches of HD_BATCH headers shared by threads,
+  so that several requests are pending on the disk.  The read ahead is
+  disabled as it would bring the samples back.
+  */
 
-    //    fprintf(stderr, "skip_read %d\n", skip_read);
-#if 0
-    // IDB's mess
-        nb=READ(fdin, buf,8);
-        while (1) {
-          SEGY_TR_HD *tr_tmp_hd = (SEGY_TR_HD*)buf;
-          int test_trace=ntohl(tr_tmp_hd->traseqlin);
-          int test_trace2=ntohl(tr_tmp_hd->traseqrel);
-	  if(DEBUG)fprintf(stderr, "traseqlin %d, traseqrel %d\n",test_trace,test_trace2 );
-          if (test_trace == 1 ) goto start_trace;
-          nb=READ(fdin, buf,8);
-        }
+#define HD_BATCH 4096
 
+typedef struct hd_part {
+    int fd;
+    off_t pos;                  /* Offset of the first trace of the batch */
+    size_t stride;
+    int first, nb;
+    char *hd;
+    int *lg;
+} HD_PART;
 
-    start_trace :
-      current_trace++;
-      while( skip_read || ( nb = READ(fdin, buf+8, lg_tr-8 ) ) > 0 ) { 
-#endif
+static int hd_only = 0;
+static void (*check_trace_hd)() = 0;   /* A check_trace which only looks at the header */
+static char *hd_batch;
+static int *hd_lg;
+static int hd_nb = 0, hd_next = 0;
+static off_t hd_pos, hd_batch_pos, hd_size;
 
-      while( skip_read || ( nb = READ(fdin, buf, lg_tr ) ) > 0 ) { 
+static int nb_chunks(off_t nb_traces);
+
+static void *hd_thread(void *arg)
+{
+    HD_PART *part = (HD_PART*)arg;
+    int i;
+    for( i = part->first ; i < part->first + part->nb ; i++ )
+	part->lg[i] = pread(part->fd, part->hd + i*240, 240,
+			    part->pos + (off_t)i*part->stride);
+    return 0;
+}
+
+/* Read nb headers at pos, pos+stride, ... by several threads */
+
+static void pread_headers(int fd, off_t pos, size_t stride, int nb, char *hd, int *lg)
+{
+    int i, nb_part = nb_chunks(nb);
+    HD_PART parts[64];
+    pthread_t threads[64];
+
+    if( nb_part > 64 )
+	nb_part = 64;
+    for( i = 0 ; i < nb_part ; i++ ) {
+	parts[i].fd = fd;
+	parts[i].pos = pos;
+	parts[i].stride = stride;
+	parts[i].first = nb * i / nb_part;
+	parts[i].nb = nb * (i+1) / nb_part - parts[i].first;
+	parts[i].hd = hd;
+	parts[i].lg = lg;
+	pthread_create(&threads[i], 0, hd_thread, &parts[i]);
+    }
+    for( i = 0 ; i < nb_part ; i++ )
+	pthread_join(threads[i], 0);
+}
+
+static int setup_hd_only(FILE *file)
+{
+    struct stat st;
+    if( fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode) )
+	return 0;
+    hd_pos = ftello(file);
+    hd_size = st.st_size;
+    hd_nb = hd_next = 0;
+    if( hd_batch == 0 ) {
+	hd_batch = malloc(HD_BATCH * 240);
+	hd_lg = malloc(HD_BATCH * sizeof(int));
+    }
+#ifdef POSIX_FADV_RANDOM
+    posix_fadvise(fileno(file), hd_pos, 0, POSIX_FADV_RANDOM);
+#endif
+    fprintf(stderr, "Reading the trace headers only\n");
+    return 1;
+}
+
+/* Same result as READ for a trace, but only the header is in buf */
+
+static int read_hd_only(FILE *file, char *buf, size_t lg_tr)
+{
+    int i;
+    off_t off;
+
+    if( hd_next == hd_nb ) {
+	off_t nb_left = (hd_size - hd_pos + lg_tr - 1) / lg_tr;
+
+	if( nb_left <= 0 )
+	    return 0;
+	hd_nb = nb_left < HD_BATCH ? nb_left : HD_BATCH;
+	pread_headers(fileno(file), hd_pos, lg_tr, hd_nb, hd_batch, hd_lg);
+	hd_batch_pos = hd_pos;
+	hd_pos += (off_t)hd_nb * lg_tr;
+	hd_next = 0;
+    }
+
+    i = hd_next++;
+    if( hd_lg[i] <= 0 )
+	return hd_lg[i];
+    memcpy(buf, hd_batch + i*240, hd_lg[i]);
+    if( hd_lg[i] < 240 )
+	return hd_lg[i];
+    off = hd_batch_pos + (off_t)i*lg_tr;
+    return hd_size - off < lg_tr ? hd_size - off : lg_tr;
+}
+
+/*
+  Spatial index of a disk file for -area ( "index file" in -area )
+
+  The points of the traces are bucketed in a grid, stored in a side file
+  which is built by a scan of the headers when it is missing, older than
+  the input or made for another file.  The scan writes the points to a
+  temporary file; they are then counted by cell, which gives the place of
+  each range of cells of at most AREA_CHUNK points in the index.  One more
+  pass over the temporary file scatters the points to their ranges through
+  a small buffer per range, and each range is then sorted by cell in
+  memory, so the memory does not grow with the survey.  With
+  +name inputs, each input has its own index : the name given followed
+  by the number of the input.  Only the traces of the cells crossing the
+  area are then tested, and only the selected traces are read.
+  */
+
+#define AREA_MAGIC "SEGYGRD2"
+#define AREA_CHUNK (1<<21)      /* Points sorted in memory at a time */
+#define AREA_MIN_FLUSH 256      /* Smallest buffer of a range, in points */
+
+typedef struct area_idx_hd {
+    char magic[8];
+    int kind, nx, ny, lg_tr;
+    long long nb_traces;
+    double x0, y0, x1, y1;
+    long long in_ino, in_size;  /* The input indexed */
+} AREA_IDX_HD;
+
+typedef struct area_pt {
+    double x, y;
+    long long trace;
+} AREA_PT;
+
+static char area_index[500];
+static long long *area_list = 0;        /* Selected traces, in file order */
+static long long area_list_nb = 0, area_next = 0;
+static off_t area_base;
+
+static int cmp_trace(const void *a, const void *b)
+{
+    long long u = *(long long*)a, v = *(long long*)b;
+    return u < v ? -1 : u > v;
+}
+
+static int grid_cell(AREA_IDX_HD *hd, double x, double y)
+{
+    int i = hd->x1 > hd->x0 ? (x - hd->x0) / (hd->x1 - hd->x0) * hd->nx : 0;
+    int j = hd->y1 > hd->y0 ? (y - hd->y0) / (hd->y1 - hd->y0) * hd->ny : 0;
+    i = i < 0 ? 0 : i >= hd->nx ? hd->nx-1 : i;
+    j = j < 0 ? 0 : j >= hd->ny ? hd->ny-1 : j;
+    return j * hd->nx + i;
+}
+
+static int build_area_index(int fd, off_t pos, size_t lg_tr, long long nb_traces,
+			    struct stat *st, char *name)
+{
+    AREA_IDX_HD hd;
+    AREA_PT *pt, *sorted, *rbuf, *region;
+    long long i, *start, *next, *rnext;
+    int k, n, c, c0, c1, r, nb_cell, nb_range, lg_rbuf, *range, *rfill, fdi, err = 0;
+    off_t base;
+    char *hds = malloc(HD_BATCH * 240), tmp[520];
+    int *lg = malloc(HD_BATCH * sizeof(int));
+    FILE *f, *ft;
+
+    memset(&hd, 0, sizeof(hd));
+    memcpy(hd.magic, AREA_MAGIC, 8);
+    hd.kind = area_kind;
+    hd.lg_tr = lg_tr;
+    hd.nb_traces = nb_traces;
+    hd.in_ino = st->st_ino;
+    hd.in_size = st->st_size;
+
+    /* The points in file order, to a temporary file */
+    sprintf(tmp, "%s.tmp", name);
+    ft = fopen(tmp, "w+");
+    if( ft == 0 ) {
+	perror(tmp);
+	return -1;
+    }
+    unlink(tmp);
+    pt = malloc(HD_BATCH * sizeof(AREA_PT));
+    for( i = 0 ; i < nb_traces ; i += HD_BATCH ) {
+	n = nb_traces - i < HD_BATCH ? nb_traces - i : HD_BATCH;
+	pread_headers(fd, pos + i*lg_tr, lg_tr, n, hds, lg);
+	for( k = 0 ; k < n ; k++ ) {
+	    AREA_PT *p = &pt[k];
+	    trace_point((SEGY_TR_HD*)(hds + k*240), area_kind, &p->x, &p->y);
+	    p->trace = i+k;
+	    if( i+k == 0 || p->x < hd.x0 ) hd.x0 = p->x;
+	    if( i+k == 0 || p->x > hd.x1 ) hd.x1 = p->x;
+	    if( i+k == 0 || p->y < hd.y0 ) hd.y0 = p->y;
+	    if( i+k == 0 || p->y > hd.y1 ) hd.y1 = p->y;
+	}
+	fwrite(pt, sizeof(AREA_PT), n, ft);
+    }
+    free(hds);
+    free(lg);
+
+    /* About 16 traces per cell */
+    hd.nx = hd.ny = sqrt(nb_traces / 16.0) + 1;
+    if( hd.nx > 1024 )
+	hd.nx = hd.ny = 1024;
+    nb_cell = hd.nx * hd.ny;
+    start = calloc(nb_cell+1, sizeof(long long));
+    next = malloc((nb_cell+1) * sizeof(long long));
+    rewind(ft);
+    while( ( n = fread(pt, sizeof(AREA_PT), HD_BATCH, ft) ) > 0 )
+	for( k = 0 ; k < n ; k++ )
+	    start[grid_cell(&hd, pt[k].x, pt[k].y)+1]++;
+    for( c = 0 ; c < nb_cell ; c++ )
+	start[c+1] += start[c];
+
+    f = fopen(name, "w+");
+    if( f == 0 ) {
+	perror(name);
+	return -1;
+    }
+    fwrite(&hd, sizeof(hd), 1, f);
+    fwrite(start, sizeof(long long), nb_cell+1, f);
+    fflush(f);
+    fdi = fileno(f);
+    base = sizeof(hd) + (off_t)(nb_cell+1) * sizeof(long long);
+
+    /* Ranges of cells of at most AREA_CHUNK points, or of a single cell */
+    range = malloc(nb_cell * sizeof(int));
+    for( c0 = nb_range = 0 ; c0 < nb_cell ; c0 = c1, nb_range++ ) {
+	for( c1 = c0+1 ; c1 < nb_cell && start[c1+1] - start[c0] <= AREA_CHUNK ; c1++ )
+	    ;
+	for( c = c0 ; c < c1 ; c++ )
+	    range[c] = nb_range;
+    }
+
+    /* Each point appended to its range, at its place in the index */
+    lg_rbuf = AREA_CHUNK / nb_range > AREA_MIN_FLUSH ? AREA_CHUNK / nb_range : AREA_MIN_FLUSH;
+    rbuf = malloc((size_t)nb_range * lg_rbuf * sizeof(AREA_PT));
+    rfill = calloc(nb_range, sizeof(int));
+    rnext = malloc(nb_range * sizeof(long long));
+    for( c = 0 ; c < nb_cell ; c++ )
+	if( c == 0 || range[c] != range[c-1] )
+	    rnext[range[c]] = start[c];
+    rewind(ft);
+    while( ( n = fread(pt, sizeof(AREA_PT), HD_BATCH, ft) ) > 0 )
+	for( k = 0 ; k < n ; k++ ) {
+	    r = range[grid_cell(&hd, pt[k].x, pt[k].y)];
+	    rbuf[(size_t)r*lg_rbuf + rfill[r]++] = pt[k];
+	    if( rfill[r] == lg_rbuf ) {
+		size_t lg_w = lg_rbuf * sizeof(AREA_PT);
+		err |= pwrite(fdi, rbuf + (size_t)r*lg_rbuf, lg_w, base + rnext[r]*sizeof(AREA_PT)) != lg_w;
+		rnext[r] += lg_rbuf;
+		rfill[r] = 0;
+	    }
+	}
+    for( r = 0 ; r < nb_range ; r++ ) {
+	size_t lg_w = rfill[r] * sizeof(AREA_PT);
+	err |= pwrite(fdi, rbuf + (size_t)r*lg_rbuf, lg_w, base + rnext[r]*sizeof(AREA_PT)) != lg_w;
+    }
+    free(rbuf);
+    free(rfill);
+    free(rnext);
+    fclose(ft);
+
+    /* Each range sorted by cell, the file order kept in a cell */
+    region = malloc(AREA_CHUNK * sizeof(AREA_PT));
+    sorted = malloc(AREA_CHUNK * sizeof(AREA_PT));
+    for( c0 = 0 ; c0 < nb_cell ; c0 = c1 ) {
+	size_t lg_r;
+	for( c1 = c0+1 ; c1 < nb_cell && range[c1] == range[c0] ; c1++ )
+	    ;
+	if( c1 - c0 == 1 )
+	    continue;
+	lg_r = (start[c1] - start[c0]) * sizeof(AREA_PT);
+	err |= pread(fdi, region, lg_r, base + start[c0]*sizeof(AREA_PT)) != lg_r;
+	memcpy(next + c0, start + c0, (c1 - c0) * sizeof(long long));
+	for( i = 0 ; i < start[c1] - start[c0] ; i++ ) {
+	    c = grid_cell(&hd, region[i].x, region[i].y);
+	    sorted[next[c]++ - start[c0]] = region[i];
+	}
+	err |= pwrite(fdi, sorted, lg_r, base + start[c0]*sizeof(AREA_PT)) != lg_r;
+    }
+    fclose(f);
+    free(pt);
+    free(region);
+    free(sorted);
+    free(range);
+    free(start);
+    free(next);
+    if( err ) {
+	perror(name);
+	unlink(name);
+	return -1;
+    }
+    fprintf(stderr, "Index %s : %lld traces in %d x %d cells\n", name,
+	    nb_traces, hd.nx, hd.ny);
+    return 0;
+}
+
+/* Select the traces of the area through the index, 0 if it cannot be used */
+
+static int setup_area_index(FILE *file, size_t lg_tr)
+{
+    struct stat st, st_idx;
+    AREA_IDX_HD hd;
+    long long nb_traces, nb_max = 0, *start;
+    int i, j, i0, i1, j0, j1, fd = fileno(file);
+    char name[520];
+    FILE *f;
+
+    if( fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) )
+	return 0;
+    area_base = ftello(file);
+    nb_traces = (st.st_size - area_base) / lg_tr;
+    if( multiple_input )
+	sprintf(name, "%s%d", area_index, range);
+    else
+	strcpy(name, area_index);
+
+    for( i = 0 ; i < 2 ; i++ ) {
+	f = stat(name, &st_idx) == 0 && st_idx.st_mtime >= st.st_mtime ?
+	    fopen(name, "r") : 0;
+	if( f && fread(&hd, sizeof(hd), 1, f) == 1 && !memcmp(hd.magic, AREA_MAGIC, 8)
+	    && hd.kind == area_kind && hd.lg_tr == lg_tr && hd.nb_traces == nb_traces
+	    && hd.in_ino == st.st_ino && hd.in_size == st.st_size )
+	    break;
+	if( f )
+	    fclose(f);
+	f = 0;
+	if( i == 0 && build_area_index(fd, area_base, lg_tr, nb_traces, &st, name) != 0 )
+	    return 0;
+    }
+    if( f == 0 )
+	return 0;
+
+    start = malloc((hd.nx*hd.ny+1) * sizeof(long long));
+    fread(start, sizeof(long long), hd.nx*hd.ny+1, f);
+    i0 = grid_cell(&hd, area_x0, area_y0) % hd.nx;
+    j0 = grid_cell(&hd, area_x0, area_y0) / hd.nx;
+    i1 = grid_cell(&hd, area_x1, area_y1) % hd.nx;
+    j1 = grid_cell(&hd, area_x1, area_y1) / hd.nx;
+    /* At most the traces of the cells crossing the area */
+    for( j = j0 ; j <= j1 ; j++ )
+	nb_max += start[j*hd.nx+i1+1] - start[j*hd.nx+i0];
+    area_list = malloc((nb_max+1) * sizeof(long long));
+    area_list_nb = area_next = 0;
+    for( j = j0 ; j <= j1 ; j++ ) {
+	long long first = start[j*hd.nx+i0], nb = start[j*hd.nx+i1+1] - first;
+	AREA_PT *pt = malloc((nb+1) * sizeof(AREA_PT));
+	long long k;
+	fseeko(f, sizeof(hd) + (hd.nx*hd.ny+1)*sizeof(long long) + first*sizeof(AREA_PT), SEEK_SET);
+	nb = fread(pt, sizeof(AREA_PT), nb, f);
+	for( k = 0 ; k < nb ; k++ )
+	    if( point_in_area(pt[k].x, pt[k].y) )
+		area_list[area_list_nb++] = pt[k].trace;
+	free(pt);
+    }
+    fclose(f);
+    free(start);
+    qsort(area_list, area_list_nb, sizeof(long long), cmp_trace);
+    fprintf(stderr, "%lld traces of %lld in the area\n", area_list_nb, nb_traces);
+    return 1;
+}
+
+static void setup_area(char *p)
+{
+    char *tok;
+    int n = 0, lg = strlen(p);
+
+    tok = strtok(p, " \t");
+    if( tok && !strcmp(tok, "src") )
+	area_kind = AREA_SRC;
+    else if( tok && !strcmp(tok, "rcv") )
+	area_kind = AREA_RCV;
+    else if( tok && !strcmp(tok, "mid") )
+	area_kind = AREA_MID;
+    else {
+	fprintf(stderr, "-area : mid, src or rcv expected\n");
+	exit(1);
+    }
+    area_x = malloc(lg * sizeof(double));
+    area_y = malloc(lg * sizeof(double));
+    while( ( tok = strtok(0, " \t") ) ) {
+	if( !strcmp(tok, "index") ) {
+	    tok = strtok(0, " \t");
+	    if( tok )
+		strcpy(area_index, tok);
+	    break;
+	}
+	if( n % 2 == 0 )
+	    area_x[n/2] = atof(tok);
+	else
+	    area_y[n/2] = atof(tok);
+	n++;
+    }
+    area_nb = n / 2;
+    if( area_nb < 2 || n % 2 ) {
+	fprintf(stderr, "-area : two corners or a polygon expected\n");
+	exit(1);
+    }
+    area_x0 = area_x1 = area_x[0];
+    area_y0 = area_y1 = area_y[0];
+    for( n = 1 ; n < area_nb ; n++ ) {
+	if( area_x[n] < area_x0 ) area_x0 = area_x[n];
+	if( area_x[n] > area_x1 ) area_x1 = area_x[n];
+	if( area_y[n] < area_y0 ) area_y0 = area_y[n];
+	if( area_y[n] > area_y1 ) area_y1 = area_y[n];
+    }
+}
+
+/* Read a trace, resynchronizing the input if it does not look like one */
+
+static long long nb_tr_read = 0;        /* Number in the input of the last trace read */
+
+static int read_trace(FILE *file, char *buf, size_t lg_tr, FILE *file_info)
+{
+    int nb;
+    if( area_list ) {
+	/* Only the traces selected through the index */
+	if( area_next >= area_list_nb )
+	    return 0;
+	nb_tr_read = area_list[area_next];
+	fseeko(file, area_base + area_list[area_next++] * lg_tr, SEEK_SET);
+    }
+    nb_tr_read++;
+    if( hd_only )
+	return read_hd_only(file, buf, lg_tr);
+    tape_lg_tr = lg_tr;
+    nb = READ(file, buf, lg_tr);
+    if( !resync || is_tape || is_blocked || nb <= 0 )
+	return nb;
+    if( nb >= 240 && trace_hd_is_plausible((SEGY_TR_HD*)buf) ) {
+	resync_last_seq = ntohl(((SEGY_TR_HD*)buf)->traseqrel);
+	return nb;
+    }
+    return resync_input(file, buf, nb, lg_tr, file_info);
+}
+
+/*
+  Sample processing
+
+  When a stage works on the samples, each trace is decoded in floats,
+  goes through the stages and is encoded in the output format.  The
+  stages may change the number of samples and the sample interval of
+  the output : the binary header and the trace headers are updated.
+  */
+
+#define FIR_HALF_PER_FACTOR 4   /* Half length of the anti-alias filter per unit of decimation */
+
+static int process_samples = 0;
+static float tmin = -1, tmax = -1;      /* Time window in ms */
+static int resample = 1;                /* Decimation factor */
+static int win_first, win_nb;           /* Window in input samples */
+static int nb_samples_out;
+static short sample_interval_out;
+static float *fir = 0, *fir_in = 0;
+static int fir_half;
+
+static void decode_samples(char *p, float *f, int n, int fmt, float weight)
+{
+    int i;
+    switch( fmt ) {
+	case 1: /* floating point ibm */
+	{
+	    int *pi = (int*)p, *fi = (int*)f;
+	    for( i = 0 ; i < n ; i++ )
+		fi[i] = ntohl(pi[i]);
+	    ibm2ieee(fi, fi, n);
+	    break;
+	}
+	case 2: /* integer format */
+	{
+	    int *pi = (int*)p;
+	    for( i = 0 ; i < n ; i++ )
+		f[i] = (int)ntohl(pi[i]);
+	    break;
+	}
+	case 3: /* two-bytes format */
+	{
+	    short *ps = (short*)p;
+	    for( i = 0 ; i < n ; i++ )
+		f[i] = (short)ntohs(ps[i]) * weight;
+	    break;
+	}
+	default: /* floating ieee ( native ) */
+	    memcpy(f, p, n*sizeof(float));
+    }
+}
+
+static void encode_samples(float *f, char *p, int n, int fmt)
+{
+    int i;
+    switch( fmt ) {
+	case 1: /* floating point ibm */
+	{
+	    int *pi = (int*)p;
+	    ieee2ibm((int*)f, pi, n);
+	    for( i = 0 ; i < n ; i++ )
+		pi[i] = htonl(pi[i]);
+	    break;
+	}
+	case 2: /* integer format */
+	{
+	    int *pi = (int*)p;
+	    for( i = 0 ; i < n ; i++ )
+		pi[i] = htonl((int)floor(f[i]+0.5));
+	    break;
+	}
+	case 3: /* two-bytes format */
+	{
+	    short *ps = (short*)p;
+	    for( i = 0 ; i < n ; i++ ) {
+		float v = f[i] > 32767 ? 32767 : f[i] < -32768 ? -32768 : f[i];
+		ps[i] = htons((short)floor(v+0.5));
+	    }
+	    break;
+	}
+	default: /* floating ieee ( native ) */
+	    memcpy(p, f, n*sizeof(float));
+    }
+}
+
+/*
+  Anti-alias filter : windowed sinc ( Hamming ) with a cut at 0.8 times
+  the output Nyquist frequency, normalized to a unit gain at 0 Hz.
+  */
+
+static void setup_fir(int factor)
+{
+    int i;
+    double sum = 0, fc = 0.8 * 0.5 / factor;
+    fir_half = FIR_HALF_PER_FACTOR * factor;
+    fir = malloc((2*fir_half+1+4) * sizeof(float));
+    fir_in = malloc((MAX_SAMPLES + 2*fir_half + 4) * sizeof(float));
+    for( i = -fir_half ; i <= fir_half ; i++ ) {
+	double h = i == 0 ? 2*fc : sin(2*M_PI*fc*i)/(M_PI*i);
+	h *= 0.54 + 0.46*cos(M_PI*i/fir_half);
+	fir[i+fir_half] = h;
+	sum += h;
+    }
+    for( i = 0 ; i < 2*fir_half+1 ; i++ )
+	fir[i] /= sum;
+    /* Zero taps up to a multiple of 4 for the vector loop */
+    for( ; i < 2*fir_half+1+4 ; i++ )
+	fir[i] = 0;
+}
+
+static float dot_product(float *x, float *h, int n)
+{
+    int i = 0;
+    float s = 0;
+#ifdef __SSE__
+    __m128 acc = _mm_setzero_ps();
+    float part[4];
+    for( ; i + 4 <= n ; i += 4 )
+	acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(x+i), _mm_loadu_ps(h+i)));
+    _mm_storeu_ps(part, acc);
+    s = part[0] + part[1] + part[2] + part[3];
+#endif
+    for( ; i < n ; i++ )
+	s += x[i]*h[i];
+    return s;
+}
+
+/* Filter and decimate f[0..n[ in place, return the new number of samples */
+
+static int decimate(float *f, int n, int factor)
+{
+    int i, n_out = (n + factor - 1) / factor;
+    int n_taps = (2*fir_half+1 + 3) & ~3;
+
+    /* Copy the input with fir_half zeros on each side */
+    memset(fir_in, 0, fir_half*sizeof(float));
+    memcpy(fir_in+fir_half, f, n*sizeof(float));
+    memset(fir_in+fir_half+n, 0, (fir_half+4)*sizeof(float));
+    for( i = 0 ; i < n_out ; i++ )
+	f[i] = dot_product(fir_in + i*factor, fir, n_taps);
+    return n_out;
+}
+
+/*
+  AGC : each sample is divided by the RMS amplitude in a window centered on
+  it ( 2*half+1 samples, cut at the ends of the trace ).  The energy of the
+  window is kept by a running sum, the division is done 4 samples at a time.
+  */
+
+static float agc_window = 0;    /* Length of the AGC window in ms */
+static float agc_energy[MAX_SAMPLES];
+
+static void agc(float *f, int n, int half)
+{
+    int i;
+    double sum = 0;
+    int first = 0, last = -1;   /* Window of the running sum */
+
+    for( i = 0 ; i < n ; i++ ) {
+	int lo = i - half < 0 ? 0 : i - half;
+	int hi = i + half >= n ? n - 1 : i + half;
+	while( last < hi ) {
+	    last++;
+	    sum += (double)f[last]*f[last];
+	}
+	while( first < lo ) {
+	    sum -= (double)f[first]*f[first];
+	    first++;
+	}
+	agc_energy[i] = sum > 0 ? sum / (hi - lo + 1) : 0;
+    }
+
+    i = 0;
+#ifdef __SSE__
+    {
+	__m128 zero = _mm_setzero_ps();
+	for( ; i + 4 <= n ; i += 4 ) {
+	    __m128 e = _mm_loadu_ps(agc_energy+i);
+	    __m128 live = _mm_cmpgt_ps(e, zero);
+	    /* Dead windows give 0/0 : masked out */
+	    __m128 v = _mm_div_ps(_mm_loadu_ps(f+i), _mm_sqrt_ps(e));
+	    _mm_storeu_ps(f+i, _mm_and_ps(v, live));
+	}
+    }
+#endif
+    for( ; i < n ; i++ )
+	f[i] = agc_energy[i] > 0 ? f[i] / sqrt(agc_energy[i]) : 0;
+}
+
+/*
+  Frequency filter ( -filter )
+
+  The filter is a zero phase response built from "bandpass f1 f2 f3 f4",
+  "notch f width" and "response file" ( lines frequency amplitude )
+  specifications separated by ';', their responses being multiplied.
+  A trace of n samples is padded to a power of two N and transformed by
+  a complex FFT of length N/2 made of its even and odd samples ( real to
+  complex ).  The plan ( bit reversal, twiddles, specifications, response )
+  and the aligned scratch buffers are built at the first trace and used for
+  all of them; each response file is read in its own specification.
+  The trace headers get the corner frequencies in low_cut, high_cut and
+  notch_freq.
+  */
+
+#define FILTER_BANDPASS 0
+#define FILTER_NOTCH    1
+#define FILTER_RESPONSE 2
+
+typedef struct filter_spec {
+    int kind;
+    float f1, f2, f3, f4;
+    float *rf, *ra;             /* Response file : frequencies, amplitudes */
+    int nr;
+} FILTER_SPEC;
+
+typedef struct fft_plan {
+    int n, m;                   /* Real length, complex length m = n/2 */
+    int nb_samples;             /* Length of the traces */
+    int *rev;                   /* Bit reversal on m */
+    float *cs, *sn;             /* cos and sin(2 pi k/m), k < m/2 */
+    float *wr, *wi;             /* exp(-2i pi k/n), k <= m */
+    float *re, *im;             /* Complex scratch, m */
+    float *xr, *xi;             /* Spectrum, m+1 */
+    float *h;                   /* Response, m+1 */
+    FILTER_SPEC *specs;
+    int nb_specs;
+} FFT_PLAN;
+
+static char *filter_spec = 0;
+static FFT_PLAN *filter_plan = 0;
+static short filter_low = 0, filter_high = 0, filter_notch = 0;
+
+static float *aligned_floats(int n)
+{
+    void *p = 0;
+    if( posix_memalign(&p, 64, (n > 0 ? n : 1)*sizeof(float)) != 0 ) {
+	fprintf(stderr, "No memory for %d floats\n", n);
+	exit(1);
+    }
+    memset(p, 0, n*sizeof(float));
+    return p;
+}
+
+static void fft_complex(FFT_PLAN *p, float *re, float *im, int inverse)
+{
+    int m = p->m, i, j, len;
+    float sign = inverse ? -1 : 1;
+
+    for( i = 0 ; i < m ; i++ ) {
+	j = p->rev[i];
+	if( i < j ) {
+	    float t = re[i]; re[i] = re[j]; re[j] = t;
+	    t = im[i]; im[i] = im[j]; im[j] = t;
+	}
+    }
+    for( len = 2 ; len <= m ; len <<= 1 ) {
+	int half = len/2, step = m/len;
+	for( i = 0 ; i < m ; i += len )
+	    for( j = 0 ; j < half ; j++ ) {
+		/* w = exp(-+2i pi j/len) */
+		float c = p->cs[j*step], s = sign*p->sn[j*step];
+		int a = i+j, b = a+half;
+		float tr = re[b]*c + im[b]*s;
+		float ti = im[b]*c - re[b]*s;
+		re[b] = re[a] - tr;
+		im[b] = im[a] - ti;
+		re[a] += tr;
+		im[a] += ti;
+	    }
+    }
+}
+
+/* Parse one specification, reading its response file */
+
+static void filter_parse(char *spec, FILTER_SPEC *s)
+{
+    float f1, f2;
+    char name[500];
+
+    memset(s, 0, sizeof(*s));
+    if( sscanf(spec, " bandpass %f %f %f %f", &s->f1, &s->f2, &s->f3, &s->f4) == 4 )
+	s->kind = FILTER_BANDPASS;
+    else if( sscanf(spec, " notch %f %f", &s->f1, &s->f2) == 2 )
+	s->kind = FILTER_NOTCH;
+    else if( sscanf(spec, " response %499s", name) == 1 ) {
+	FILE *file = fopen(name, "r");
+	int na = 0;
+	s->kind = FILTER_RESPONSE;
+	if( file == 0 ) {
+	    perror(name);
+	    exit(1);
+	}
+	while( fscanf(file, "%f %f", &f1, &f2) == 2 ) {
+	    if( s->nr == na ) {
+		na = na ? 2*na : 64;
+		s->rf = realloc(s->rf, na*sizeof(float));
+		s->ra = realloc(s->ra, na*sizeof(float));
+	    }
+	    s->rf[s->nr] = f1;
+	    s->ra[s->nr++] = f2;
+	}
+	fclose(file);
+	if( s->nr == 0 ) {
+	    fprintf(stderr, "No response in %s\n", name);
+	    exit(1);
+	}
+    }
+    else {
+	fprintf(stderr, "Unknown filter %s\n", spec);
+	exit(1);
+    }
+}
+
+/* Response of one specification at the frequency f */
+
+static float filter_response(FILTER_SPEC *s, float f)
+{
+    float f1 = s->f1, f2 = s->f2, f3 = s->f3, f4 = s->f4;
+    int k;
+
+    if( s->kind == FILTER_BANDPASS ) {
+	if( f <= f1 || f >= f4 )
+	    return 0;
+	if( f < f2 )
+	    return sin(M_PI/2*(f-f1)/(f2-f1)) * sin(M_PI/2*(f-f1)/(f2-f1));
+	if( f > f3 )
+	    return sin(M_PI/2*(f4-f)/(f4-f3)) * sin(M_PI/2*(f4-f)/(f4-f3));
+	return 1;
+    }
+    if( s->kind == FILTER_NOTCH ) {
+	float d = fabs(f - f1);
+	return d >= f2 ? 1 : sin(M_PI/2*d/f2) * sin(M_PI/2*d/f2);
+    }
+    if( f <= s->rf[0] )
+	return s->ra[0];
+    for( k = 1 ; k < s->nr ; k++ )
+	if( f <= s->rf[k] )
+	    return s->ra[k-1] + (s->ra[k]-s->ra[k-1])*(f-s->rf[k-1])/(s->rf[k]-s->rf[k-1]);
+    return s->ra[s->nr-1];
+}
+
+static FFT_PLAN *fft_plan(int nb_samples, float dt)
+{
+    FFT_PLAN *p = calloc(1, sizeof(FFT_PLAN));
+    int i, bits = 0;
+    char *spec, *copy;
+
+    p->nb_samples = nb_samples;
+    /* Some padding against the wrap around */
+    for( p->n = 4 ; p->n < nb_samples + nb_samples/4 ; p->n <<= 1 )
+	;
+    p->m = p->n / 2;
+    while( (1 << bits) < p->m )
+	bits++;
+
+    p->rev = malloc(p->m * sizeof(int));
+    for( i = 0 ; i < p->m ; i++ ) {
+	int b, r = 0;
+	for( b = 0 ; b < bits ; b++ )
+	    if( i & (1 << b) )
+		r |= 1 << (bits-1-b);
+	p->rev[i] = r;
+    }
+    p->cs = aligned_floats(p->m/2);
+    p->sn = aligned_floats(p->m/2);
+    for( i = 0 ; i < p->m/2 ; i++ ) {
+	p->cs[i] = cos(2*M_PI*i/p->m);
+	p->sn[i] = sin(2*M_PI*i/p->m);
+    }
+    p->wr = aligned_floats(p->m+1);
+    p->wi = aligned_floats(p->m+1);
+    p->h = aligned_floats(p->m+1);
+    for( i = 0 ; i <= p->m ; i++ ) {
+	p->wr[i] = cos(2*M_PI*i/p->n);
+	p->wi[i] = -sin(2*M_PI*i/p->n);
+	p->h[i] = 1;
+    }
+    p->re = aligned_floats(p->m);
+    p->im = aligned_floats(p->m);
+    p->xr = aligned_floats(p->m+1);
+    p->xi = aligned_floats(p->m+1);
+
+    copy = strdup(filter_spec);
+    for( spec = strtok(copy, ";") ; spec ; spec = strtok(0, ";") ) {
+	FILTER_SPEC *s;
+	p->specs = realloc(p->specs, (p->nb_specs+1) * sizeof(FILTER_SPEC));
+	s = &p->specs[p->nb_specs++];
+	filter_parse(spec, s);
+	for( i = 0 ; i <= p->m ; i++ )
+	    p->h[i] *= filter_response(s, i / (p->n * dt));
+    }
+    free(copy);
+    return p;
+}
+
+static void fft_free(FFT_PLAN *p)
+{
+    int i;
+    for( i = 0 ; i < p->nb_specs ; i++ ) {
+	free(p->specs[i].rf);
+	free(p->specs[i].ra);
+    }
+    free(p->specs);
+    free(p->rev);
+    free(p->cs);
+    free(p->sn);
+    free(p->wr);
+    free(p->wi);
+    free(p->h);
+    free(p->re);
+    free(p->im);
+    free(p->xr);
+    free(p->xi);
+    free(p);
+}
+
+static void filter_trace(FFT_PLAN *p, float *f, int n)
+{
+    int k, m = p->m;
+    float *re = p->re, *im = p->im, *xr = p->xr, *xi = p->xi;
+
+    for( k = 0 ; k < m ; k++ ) {
+	re[k] = 2*k < n ? f[2*k] : 0;
+	im[k] = 2*k+1 < n ? f[2*k+1] : 0;
+    }
+    fft_complex(p, re, im, 0);
+
+    /* Spectrum of the real trace, times the response */
+    for( k = 0 ; k <= m ; k++ ) {
+	int a = k % m, b = (m - k) % m;
+	float er = (re[a] + re[b]) / 2, ei = (im[a] - im[b]) / 2;
+	float o_r = (im[a] + im[b]) / 2, o_i = -(re[a] - re[b]) / 2;
+	xr[k] = (er + p->wr[k]*o_r - p->wi[k]*o_i) * p->h[k];
+	xi[k] = (ei + p->wr[k]*o_i + p->wi[k]*o_r) * p->h[k];
+    }
+
+    /* Back to the even and odd samples */
+    for( k = 0 ; k < m ; k++ ) {
+	float er = (xr[k] + xr[m-k]) / 2, ei = (xi[k] - xi[m-k]) / 2;
+	float dr = (xr[k] - xr[m-k]) / 2, di = (xi[k] + xi[m-k]) / 2;
+	float o_r = dr*p->wr[k] + di*p->wi[k], o_i = di*p->wr[k] - dr*p->wi[k];
+	re[k] = er - o_i;
+	im[k] = ei + o_r;
+    }
+    fft_complex(p, re, im, 1);
+    for( k = 0 ; 2*k < n ; k++ ) {
+	f[2*k] = re[k] / m;
+	if( 2*k+1 < n )
+	    f[2*k+1] = im[k] / m;
+    }
+}
+
+/* Corner frequencies for the trace headers */
+
+static void setup_filter(char *arg)
+{
+    float f1, f2, f3, f4;
+    char *spec, *copy;
+
+    filter_spec = strdup(arg);
+    copy = strdup(arg);
+    for( spec = strtok(copy, ";") ; spec ; spec = strtok(0, ";") ) {
+	if( sscanf(spec, " bandpass %f %f %f %f", &f1, &f2, &f3, &f4) == 4 ) {
+	    filter_low = (f1 + f2) / 2 + 0.5;
+	    filter_high = (f3 + f4) / 2 + 0.5;
+	}
+	else if( sscanf(spec, " notch %f %f", &f1, &f2) == 2 )
+	    filter_notch = f1 + 0.5;
+    }
+    free(copy);
+}
+
+/*
+  NMO correction ( -nmo )
+
+  The velocity file has one "cdp time(ms) velocity" triple per line, the
+  functions being given by increasing CDP.  Between two CDPs the velocity
+  is interpolated linearly, outside the nearest function is used.  The
+  slowness table of a CDP ( 1/v^2 for each output time ) is kept while the
+  CDP does not change.  For each trace the input times are computed 4 at a
+  time, then the samples are interpolated ( linear or 8 points sinc ) and
+  the samples stretched more than the limit are muted.
+  */
+
+#define NMO_NTAB 64             /* Fractions of a sample of the sinc table */
+#define NMO_LSINC 8
+
+typedef struct nmo_fn {
+    int cdp;
+    int n;
+    float *t, *v;               /* Times ( s ) and velocities */
+} NMO_FN;
+
+static int nmo = 0, nmo_sinc = 0;
+static float nmo_stretch = 0.5;
+static NMO_FN *nmo_fn = 0;
+static int nmo_nb = 0;
+static int nmo_cdp = 0, nmo_n = 0, nmo_delay = 0, nmo_valid = 0;
+static float nmo_t0[MAX_SAMPLES], nmo_s2[MAX_SAMPLES], nmo_tx[MAX_SAMPLES];
+static float nmo_in[MAX_SAMPLES + 2*NMO_LSINC];
+static float nmo_tab[NMO_NTAB+1][NMO_LSINC];
+
+static void setup_nmo(char *arg)
+{
+    char name[500], how[20];
+    float stretch = -1;
+    FILE *f;
+    int cdp, nb_alloc = 0, i, j;
+    float t, v;
+
+    how[0] = 0;
+    sscanf(arg, "%s %s %f", name, how, &stretch);
+    if( !strcmp(how, "sinc") )
+	nmo_sinc = 1;
+    if( stretch > 0 )
+	nmo_stretch = stretch / 100;
+
+    f = fopen(name, "r");
+    if( f == 0 ) {
+	perror(name);
+	exit(1);
+    }
+    while( fscanf(f, "%d %f %f", &cdp, &t, &v) == 3 ) {
+	NMO_FN *fn;
+	if( nmo_nb == 0 || nmo_fn[nmo_nb-1].cdp != cdp ) {
+	    if( nmo_nb == nb_alloc ) {
+		nb_alloc = nb_alloc ? 2*nb_alloc : 64;
+		nmo_fn = realloc(nmo_fn, nb_alloc*sizeof(NMO_FN));
+	    }
+	    fn = &nmo_fn[nmo_nb++];
+	    fn->cdp = cdp;
+	    fn->n = 0;
+	    fn->t = fn->v = 0;
+	}
+	fn = &nmo_fn[nmo_nb-1];
+	fn->t = realloc(fn->t, (fn->n+1)*sizeof(float));
+	fn->v = realloc(fn->v, (fn->n+1)*sizeof(float));
+	fn->t[fn->n] = t / 1000;
+	fn->v[fn->n] = v;
+	fn->n++;
+    }
+    fclose(f);
+    if( nmo_nb == 0 ) {
+	fprintf(stderr, "No velocity in %s\n", name);
+	exit(1);
+    }
+
+    /* Hamming windowed sinc, each row normalized to a unit sum */
+    for( i = 0 ; i <= NMO_NTAB ; i++ ) {
+	double frac = (double)i / NMO_NTAB, sum = 0;
+	for( j = 0 ; j < NMO_LSINC ; j++ ) {
+	    double x = j - (NMO_LSINC/2 - 1) - frac;
+	    double h = x == 0 ? 1 : sin(M_PI*x)/(M_PI*x);
+	    h *= 0.54 + 0.46*cos(M_PI*x/(NMO_LSINC/2));
+	    nmo_tab[i][j] = h;
+	    sum += h;
+	}
+	for( j = 0 ; j < NMO_LSINC ; j++ )
+	    nmo_tab[i][j] /= sum;
+    }
+    nmo = 1;
+}
+
+/* Velocity of the function fn at the time t */
+
+static float nmo_velocity(NMO_FN *fn, float t)
+{
+    int k;
+    if( t <= fn->t[0] )
+	return fn->v[0];
+    for( k = 1 ; k < fn->n ; k++ )
+	if( t <= fn->t[k] )
+	    return fn->v[k-1] + (fn->v[k]-fn->v[k-1])*(t-fn->t[k-1])/(fn->t[k]-fn->t[k-1]);
+    return fn->v[fn->n-1];
+}
+
+static void nmo_table(int cdp, int n, int delay, float dt)
+{
+    int i, k = 0;
+    float w = 0;
+    NMO_FN *f1, *f2;
+
+    if( nmo_valid && cdp == nmo_cdp && n == nmo_n && delay == nmo_delay )
+	return;
+    while( k < nmo_nb - 1 && nmo_fn[k+1].cdp <= cdp )
+	k++;
+    f1 = f2 = &nmo_fn[k];
+    if( cdp > f1->cdp && k < nmo_nb - 1 ) {
+	f2 = &nmo_fn[k+1];
+	w = (float)(cdp - f1->cdp) / (f2->cdp - f1->cdp);
+    }
+    for( i = 0 ; i < n ; i++ ) {
+	float t0 = delay/1000.0 + i*dt;
+	float v = (1-w)*nmo_velocity(f1, t0) + w*nmo_velocity(f2, t0);
+	nmo_t0[i] = t0;
+	nmo_s2[i] = 1 / (v*v);
+    }
+    nmo_cdp = cdp;
+    nmo_n = n;
+    nmo_delay = delay;
+    nmo_valid = 1;
+}
+
+static void nmo_correct(SEGY_TR_HD *tr_hd, float *f, int n)
+{
+    float dt = sample_interval_out / 1e6;
+    int delay = (short)ntohs(tr_hd->delay);
+    float x = (int)ntohl(tr_hd->srdist);
+    float x2 = x*x, t_first = delay/1000.0;
+    int i = 0;
+
+    if( dt <= 0 )
+	return;
+    nmo_table(ntohl(tr_hd->cdp_ens), n, delay, dt);
+
+    /* Input time of each output sample, in samples from the first one */
+#ifdef __SSE__
+    {
+	__m128 vx2 = _mm_set1_ps(x2), vdt = _mm_set1_ps(1/dt), vfirst = _mm_set1_ps(t_first);
+	for( ; i + 4 <= n ; i += 4 ) {
+	    __m128 t0 = _mm_loadu_ps(nmo_t0+i);
+	    __m128 t = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(t0, t0),
+					      _mm_mul_ps(vx2, _mm_loadu_ps(nmo_s2+i))));
+	    _mm_storeu_ps(nmo_tx+i, _mm_mul_ps(_mm_sub_ps(t, vfirst), vdt));
+	}
+    }
+#endif
+    for( ; i < n ; i++ )
+	nmo_tx[i] = (sqrt(nmo_t0[i]*nmo_t0[i] + x2*nmo_s2[i]) - t_first) / dt;
+
+    /* Input with NMO_LSINC zeros on each side */
+    memset(nmo_in, 0, NMO_LSINC*sizeof(float));
+    memcpy(nmo_in+NMO_LSINC, f, n*sizeof(float));
+    memset(nmo_in+NMO_LSINC+n, 0, NMO_LSINC*sizeof(float));
+
+    for( i = 0 ; i < n ; i++ ) {
+	float p = nmo_tx[i];
+	int k = (int)p;
+	float frac = p - k;
+
+	/* Beyond the trace or stretched too much : muted */
+	if( p < 0 || k >= n - 1
+	    || (nmo_t0[i] > 0 && t_first + p*dt > (1 + nmo_stretch)*nmo_t0[i]) ) {
+	    f[i] = 0;
+	    continue;
+	}
+	if( nmo_sinc ) {
+	    int it = (int)(frac*NMO_NTAB + 0.5);
+	    f[i] = dot_product(nmo_in + NMO_LSINC + k - (NMO_LSINC/2 - 1),
+			       nmo_tab[it], NMO_LSINC);
+	}
+	else
+	    f[i] = nmo_in[NMO_LSINC+k] + frac*(nmo_in[NMO_LSINC+k+1] - nmo_in[NMO_LSINC+k]);
+    }
+}
+
+/*
+  Header expressions ( -set )
+
+  "field = expression; ..." is compiled once in a bytecode for a stack
+  machine.  The machine runs each instruction on a batch of headers before
+  the next one, the stack holding a column of values per level, so that
+  the decoding of the instructions is paid once per batch : -patch, the
+  -where list and the copy loop ( see read_trace_batch() ) give it batches.
+  The fields are read from and written to the big endian headers directly.
+  Expressions use the trace header field names, numbers, + - * / %, the
+  comparisons, && || !, parentheses and the functions abs sqrt hypot atan2
+  min max.
+  */
+
+#define EXPR_BATCH 256
+#define EXPR_STACK 32
+
+enum { OP_CONST, OP_LOAD, OP_STORE, OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD,
+       OP_NEG, OP_LT, OP_LE, OP_GT, OP_GE, OP_EQ, OP_NE, OP_AND, OP_OR, OP_NOT,
+       OP_ABS, OP_SQRT, OP_HYPOT, OP_ATAN2, OP_MIN, OP_MAX };
+
+typedef struct expr_op {
+    int op;
+    double value;               /* OP_CONST */
+    HD_FIELD *field;            /* OP_LOAD, OP_STORE */
+} EXPR_OP;
+
+typedef struct expr_prog {
+    int nb, nb_alloc;
+    int depth, max_depth;       /* Stack depth while compiling */
+    EXPR_OP *ops;
+    char *src, *p;              /* Source and parse position */
+} EXPR_PROG;
+
+static EXPR_PROG *set_prog = 0;
+
+static void expr_error(EXPR_PROG *e, char *msg)
+{
+    fprintf(stderr, "%s at \"%.20s\" in \"%s\"\n", msg, e->p, e->src);
+    exit(1);
+}
+
+static void expr_emit(EXPR_PROG *e, int op, double value, HD_FIELD *field)
+{
+    static signed char effect[] = { 1, 1, -1, -1, -1, -1, -1, -1,
+				    0, -1, -1, -1, -1, -1, -1, -1, -1, 0,
+				    0, 0, -1, -1, -1, -1 };
+    if( e->nb == e->nb_alloc ) {
+	e->nb_alloc = e->nb_alloc ? 2*e->nb_alloc : 32;
+	e->ops = realloc(e->ops, e->nb_alloc*sizeof(EXPR_OP));
+    }
+    e->ops[e->nb].op = op;
+    e->ops[e->nb].value = value;
+    e->ops[e->nb].field = field;
+    e->nb++;
+    e->depth += effect[op];
+    if( e->depth > e->max_depth )
+	e->max_depth = e->depth;
+    if( e->max_depth > EXPR_STACK )
+	expr_error(e, "Expression too complex");
+}
+
+static void expr_blank(EXPR_PROG *e)
+{
+    while( *e->p == ' ' || *e->p == '\t' || *e->p == '\n' )
+	e->p++;
+}
+
+static int expr_accept(EXPR_PROG *e, char *tok)
+{
+    int lg = strlen(tok);
+    expr_blank(e);
+    if( strncmp(e->p, tok, lg) )
+	return 0;
+    /* "<" is not "<=", "=" is not "==" */
+    if( lg == 1 && strchr("<>=!", tok[0]) && e->p[1] == '=' )
+	return 0;
+    e->p += lg;
+    return 1;
+}
+
+static int expr_name(EXPR_PROG *e, char **name)
+{
+    int lg = 0;
+    expr_blank(e);
+    *name = e->p;
+    while( (e->p[lg] >= 'a' && e->p[lg] <= 'z') || (e->p[lg] >= 'A' && e->p[lg] <= 'Z')
+	   || e->p[lg] == '_' || (lg > 0 && e->p[lg] >= '0' && e->p[lg] <= '9') )
+	lg++;
+    e->p += lg;
+    return lg;
+}
+
+static void expr_or(EXPR_PROG *e);
+
+static void expr_primary(EXPR_PROG *e)
+{
+    static struct { char *name; int op, nb_args; } funcs[] = {
+	{ "abs", OP_ABS, 1 }, { "sqrt", OP_SQRT, 1 }, { "hypot", OP_HYPOT, 2 },
+	{ "atan2", OP_ATAN2, 2 }, { "min", OP_MIN, 2 }, { "max", OP_MAX, 2 },
+	{ 0, 0, 0 }
+    };
+    char *name, *end;
+    int lg, i;
+    double v;
+    HD_FIELD *f;
+
+    expr_blank(e);
+    if( expr_accept(e, "(") ) {
+	expr_or(e);
+	if( !expr_accept(e, ")") )
+	    expr_error(e, "Missing )");
+	return;
+    }
+    if( (*e->p >= '0' && *e->p <= '9') || *e->p == '.' ) {
+	v = strtod(e->p, &end);
+	e->p = end;
+	expr_emit(e, OP_CONST, v, 0);
+	return;
+    }
+    lg = expr_name(e, &name);
+    if( lg == 0 )
+	expr_error(e, "Syntax error");
+    if( expr_accept(e, "(") ) {
+	for( i = 0 ; funcs[i].name ; i++ )
+	    if( strlen(funcs[i].name) == lg && !strncmp(funcs[i].name, name, lg) )
+		break;
+	if( funcs[i].name == 0 )
+	    expr_error(e, "Unknown function");
+	expr_or(e);
+	if( funcs[i].nb_args == 2 ) {
+	    if( !expr_accept(e, ",") )
+		expr_error(e, "Missing second argument");
+	    expr_or(e);
+	}
+	if( !expr_accept(e, ")") )
+	    expr_error(e, "Missing )");
+	expr_emit(e, funcs[i].op, 0, 0);
+	return;
+    }
+    if( (f = find_field(name, lg)) == 0 ) {
+	e->p = name;
+	expr_error(e, "Unknown header field");
+    }
+    expr_emit(e, OP_LOAD, 0, f);
+}
+
+static void expr_unary(EXPR_PROG *e)
+{
+    if( expr_accept(e, "-") ) {
+	expr_unary(e);
+	expr_emit(e, OP_NEG, 0, 0);
+    }
+    else if( expr_accept(e, "!") ) {
+	expr_unary(e);
+	expr_emit(e, OP_NOT, 0, 0);
+    }
+    else
+	expr_primary(e);
+}
+
+static void expr_mul(EXPR_PROG *e)
+{
+    expr_unary(e);
+    while( 1 ) {
+	int op;
+	if( expr_accept(e, "*") ) op = OP_MUL;
+	else if( expr_accept(e, "/") ) op = OP_DIV;
+	else if( expr_accept(e, "%") ) op = OP_MOD;
+	else return;
+	expr_unary(e);
+	expr_emit(e, op, 0, 0);
+    }
+}
+
+static void expr_add(EXPR_PROG *e)
+{
+    expr_mul(e);
+    while( 1 ) {
+	int op;
+	if( expr_accept(e, "+") ) op = OP_ADD;
+	else if( expr_accept(e, "-") ) op = OP_SUB;
+	else return;
+	expr_mul(e);
+	expr_emit(e, op, 0, 0);
+    }
+}
+
+static void expr_cmp(EXPR_PROG *e)
+{
+    int op;
+    expr_add(e);
+    if( expr_accept(e, "<=") ) op = OP_LE;
+    else if( expr_accept(e, ">=") ) op = OP_GE;
+    else if( expr_accept(e, "==") ) op = OP_EQ;
+    else if( expr_accept(e, "!=") ) op = OP_NE;
+    else if( expr_accept(e, "<") ) op = OP_LT;
+    else if( expr_accept(e, ">") ) op = OP_GT;
+    else return;
+    expr_add(e);
+    expr_emit(e, op, 0, 0);
+}
+
+static void expr_and(EXPR_PROG *e)
+{
+    expr_cmp(e);
+    while( expr_accept(e, "&&") ) {
+	expr_cmp(e);
+	expr_emit(e, OP_AND, 0, 0);
+    }
+}
+
+static void expr_or(EXPR_PROG *e)
+{
+    expr_and(e);
+    while( expr_accept(e, "||") ) {
+	expr_and(e);
+	expr_emit(e, OP_OR, 0, 0);
+    }
+}
+
+static EXPR_PROG *expr_new(char *src)
+{
+    EXPR_PROG *e = calloc(1, sizeof(EXPR_PROG));
+    e->src = strdup(src);
+    e->p = e->src;
+    return e;
+}
+
+/* Compile "field = expression; ..." */
+
+static EXPR_PROG *compile_set(char *src)
+{
+    EXPR_PROG *e = expr_new(src);
+    do {
+	char *name;
+	int lg;
+	HD_FIELD *f;
+	expr_blank(e);
+	if( *e->p == 0 )
+	    break;
+	lg = expr_name(e, &name);
+	if( (f = find_field(name, lg)) == 0 ) {
+	    e->p = name;
+	    expr_error(e, "Unknown header field");
+	}
+	if( !expr_accept(e, "=") )
+	    expr_error(e, "Missing =");
+	expr_or(e);
+	expr_emit(e, OP_STORE, 0, f);
+    } while( expr_accept(e, ";") );
+    expr_blank(e);
+    if( *e->p )
+	expr_error(e, "Syntax error");
+    return e;
+}
+
+/*
+  Run the program on the nb headers hd[].  The value left on the stack, if
+  any, is put in result ( one per header ).
+  */
+
+static void expr_run(EXPR_PROG *e, char **hd, int nb, double *result)
+{
+    double stack[EXPR_STACK*EXPR_BATCH];
+    int first;
+
+    for( first = 0 ; first < nb ; first += EXPR_BATCH ) {
+	int n = nb - first < EXPR_BATCH ? nb - first : EXPR_BATCH;
+	char **h = hd + first;
+	int k, i, sp = -1;
+
+	/* Level k at stack + k*n : a single header uses the first levels only */
+	for( k = 0 ; k < e->nb ; k++ ) {
+	    EXPR_OP *o = &e->ops[k];
+	    double *a = stack + (sp > 0 ? sp-1 : 0)*n, *b = stack + (sp >= 0 ? sp : 0)*n;
+	    switch( o->op ) {
+		case OP_CONST:
+		    sp++;
+		    for( i = 0 ; i < n ; i++ ) stack[sp*n+i] = o->value;
+		    continue;
+		case OP_LOAD:
+		    sp++;
+		    for( i = 0 ; i < n ; i++ ) stack[sp*n+i] = get_field(h[i], o->field);
+		    continue;
+		case OP_STORE:
+		    for( i = 0 ; i < n ; i++ ) set_field(h[i], o->field, (int)floor(b[i]+0.5));
+		    break;
+		case OP_ADD: for( i = 0 ; i < n ; i++ ) a[i] += b[i]; break;
+		case OP_SUB: for( i = 0 ; i < n ; i++ ) a[i] -= b[i]; break;
+		case OP_MUL: for( i = 0 ; i < n ; i++ ) a[i] *= b[i]; break;
+		case OP_DIV: for( i = 0 ; i < n ; i++ ) a[i] = b[i] != 0 ? a[i] / b[i] : 0; break;
+		case OP_MOD: for( i = 0 ; i < n ; i++ ) a[i] = b[i] != 0 ? fmod(a[i], b[i]) : 0; break;
+		case OP_LT: for( i = 0 ; i < n ; i++ ) a[i] = a[i] < b[i]; break;
+		case OP_LE: for( i = 0 ; i < n ; i++ ) a[i] = a[i] <= b[i]; break;
+		case OP_GT: for( i = 0 ; i < n ; i++ ) a[i] = a[i] > b[i]; break;
+		case OP_GE: for( i = 0 ; i < n ; i++ ) a[i] = a[i] >= b[i]; break;
+		case OP_EQ: for( i = 0 ; i < n ; i++ ) a[i] = a[i] == b[i]; break;
+		case OP_NE: for( i = 0 ; i < n ; i++ ) a[i] = a[i] != b[i]; break;
+		case OP_AND: for( i = 0 ; i < n ; i++ ) a[i] = a[i] != 0 && b[i] != 0; break;
+		case OP_OR: for( i = 0 ; i < n ; i++ ) a[i] = a[i] != 0 || b[i] != 0; break;
+		case OP_HYPOT: for( i = 0 ; i < n ; i++ ) a[i] = hypot(a[i], b[i]); break;
+		case OP_ATAN2: for( i = 0 ; i < n ; i++ ) a[i] = atan2(a[i], b[i]); break;
+		case OP_MIN: for( i = 0 ; i < n ; i++ ) a[i] = a[i] < b[i] ? a[i] : b[i]; break;
+		case OP_MAX: for( i = 0 ; i < n ; i++ ) a[i] = a[i] > b[i] ? a[i] : b[i]; break;
+		/* Unary : the top of the stack is replaced */
+		case OP_NEG: for( i = 0 ; i < n ; i++ ) b[i] = -b[i]; continue;
+		case OP_NOT: for( i = 0 ; i < n ; i++ ) b[i] = b[i] == 0; continue;
+		case OP_ABS: for( i = 0 ; i < n ; i++ ) b[i] = fabs(b[i]); continue;
+		case OP_SQRT: for( i = 0 ; i < n ; i++ ) b[i] = b[i] > 0 ? sqrt(b[i]) : 0; continue;
+	    }
+	    sp--;
+	}
+	if( result && sp >= 0 )
+	    memcpy(result + first, stack + sp*n, n*sizeof(double));
+    }
+}
+
+/*
+  Trace selection ( -where "expression" )
+
+  The expression, with the syntax of -set, is compiled once and sees the
+  headers as read, before -set.  On a disk file the headers are read alone
+  ( only those of the traces given by the -area index when there is one )
+  and evaluated column wise by batches of HD_BATCH, giving a bit mask of
+  the selected traces; the trace loop then reads only these traces, as
+  for -area.  With an index, the expression only filters the traces of the
+  cells kept by -area, it does not prune more cells.  On other inputs each
+  trace is evaluated when read.
+  */
+
+static EXPR_PROG *where_prog = 0;
+static int where_list = 0;              /* area_list holds the selection */
+
+static EXPR_PROG *compile_where(char *src)
+{
+    EXPR_PROG *e = expr_new(src);
+    expr_or(e);
+    expr_blank(e);
+    if( *e->p )
+	expr_error(e, "Syntax error");
+    return e;
+}
+
+/* Select the traces in area_list, 0 if the input is not a disk file */
+
+static int setup_where_list(FILE *file, size_t lg_tr, FILE *file_info)
+{
+    struct stat st;
+    long long i, nb_traces, nb_in, nb_sel = 0;
+    int k, *lg, fd = fileno(file), indexed = area_list != 0;
+    unsigned char *mask;
+    char *hds, **hp;
+    double *r;
+
+    if( fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) )
+	return 0;
+    if( !indexed )
+	area_base = ftello(file);
+    nb_traces = (st.st_size - area_base) / lg_tr;
+    nb_in = indexed ? area_list_nb : nb_traces;
+
+    mask = calloc(nb_in/8 + 1, 1);
+    hds = malloc(HD_BATCH * 240);
+    hp = malloc(HD_BATCH * sizeof(char*));
+    lg = malloc(HD_BATCH * sizeof(int));
+    r = malloc(HD_BATCH * sizeof(double));
+    for( k = 0 ; k < HD_BATCH ; k++ )
+	hp[k] = hds + k*240;
+    for( i = 0 ; i < nb_in ; i += HD_BATCH ) {
+	int n = nb_in - i < HD_BATCH ? nb_in - i : HD_BATCH;
+	if( indexed )
+	    for( k = 0 ; k < n ; k++ )
+		lg[k] = pread(fd, hds + k*240, 240, area_base + area_list[i+k]*lg_tr);
+	else
+	    pread_headers(fd, area_base + i*lg_tr, lg_tr, n, hds, lg);
+	expr_run(where_prog, hp, n, r);
+	for( k = 0 ; k < n ; k++ )
+	    if( r[k] != 0 && lg[k] == 240 )
+		mask[(i+k) >> 3] |= 1 << ((i+k) & 7);
+    }
+
+    /* The selected traces in file order, in place over the index */
+    for( i = 0 ; i < nb_in ; i++ )
+	if( mask[i >> 3] & (1 << (i & 7)) )
+	    nb_sel++;
+    if( !indexed )
+	area_list = malloc((nb_sel+1) * sizeof(long long));
+    for( i = nb_sel = 0 ; i < nb_in ; i++ )
+	if( mask[i >> 3] & (1 << (i & 7)) )
+	    area_list[nb_sel++] = indexed ? area_list[i] : i;
+    area_list_nb = nb_sel;
+    area_next = 0;
+    fprintf(file_info, "%lld traces of %lld selected\n", nb_sel, nb_in);
+
+    free(mask);
+    free(hds);
+    free(hp);
+    free(lg);
+    free(r);
+    return 1;
+}
+
+/*
+  Header steps of the copy loop
+
+  The number of samples is set, then -where, -geometry and -set run on the
+  headers.  The copy loop reads the traces ahead by batches of EXPR_BATCH,
+  so that the steps run column wise on a batch, and takes the kept traces
+  one by one.  Not with the checkpoints, which need the input position of
+  each trace : the steps then run on each trace alone.
+  */
+
+typedef struct tr_batch {
+    char *data;                         /* EXPR_BATCH traces of MAX_SIZE bytes */
+    char *hd[EXPR_BATCH];
+    int lg[EXPR_BATCH];
+    long long nb_read[EXPR_BATCH];      /* nb_tr_read of each trace */
+    double keep[EXPR_BATCH];
+    int nb, next, end, end_lg;
+} TR_BATCH;
+
+static TR_BATCH tr_batch;
+static int tr_batch_on = 0;
+
+/* Set the number of samples of the header, telling the first differences */
+
+static void check_nb_samples(char *buf, int *nb_error)
+{
+    SEGY_TR_HD *tr_hd = (SEGY_TR_HD*)buf;
+    short tr_nb_samples = ntohs(tr_hd->nb_samples);
+
+    if( *nb_error < 5 && tr_nb_samples != nb_samples ) {
+	fprintf(stderr, "Number of samples not correct %d ( expect %d )\n",
+		tr_nb_samples, nb_samples);
+	(*nb_error)++;
+    }
+    tr_hd->nb_samples = htons(nb_samples);
+}
+
+/* -where, -geometry and -set on nb headers; keep[i] is 0 for a trace dropped */
+
+static void header_steps(char **hd, int nb, double *keep)
+{
+    char *kept[EXPR_BATCH];
+    int i, n = 0;
+
+    if( where_prog && !where_list )
+	expr_run(where_prog, hd, nb, keep);
+    else
+	for( i = 0 ; i < nb ; i++ )
+	    keep[i] = 1;
+    for( i = 0 ; i < nb ; i++ )
+	if( keep[i] != 0 )
+	    kept[n++] = hd[i];
+    if( geometry )
+	geometry_run(kept, n);
+    if( set_prog )
+	expr_run(set_prog, kept, n, 0);
+}
+
+/* Same result as read_trace, the header steps being done */
+
+static int read_trace_batch(FILE *file, char *buf, size_t lg_tr, FILE *file_info, int *nb_error)
+{
+    TR_BATCH *b = &tr_batch;
+
+    if( b->data == 0 )
+	b->data = malloc((size_t)EXPR_BATCH * MAX_SIZE);
+    for( ;; ) {
+	while( b->next < b->nb ) {
+	    int i = b->next++, lg = b->lg[i];
+	    if( b->keep[i] == 0 )
+		continue;
+	    /* Only the header is there when reading the headers only */
+	    memcpy(buf, b->hd[i], hd_only && lg > 240 ? 240 : lg);
+	    nb_tr_read = b->nb_read[i];
+	    return lg;
+	}
+	if( b->end )
+	    return b->end_lg;
+	for( b->nb = b->next = 0 ; b->nb < EXPR_BATCH ; b->nb++ ) {
+	    char *p = b->data + (size_t)b->nb * MAX_SIZE;
+	    int lg = read_trace(file, p, lg_tr, file_info);
+	    if( lg <= 0 ) {
+		b->end = 1;
+		b->end_lg = lg;
+		break;
+	    }
+	    check_nb_samples(p, nb_error);
+	    b->hd[b->nb] = p;
+	    b->lg[b->nb] = lg;
+	    b->nb_read[b->nb] = nb_tr_read;
+	}
+	header_steps(b->hd, b->nb, b->keep);
+    }
+}
+
+/*
+  Compute the output window from the input number of samples and sample
+  interval ( micro-seconds ) and update the binary header.
+  */
+
+static void setup_samples(SEGY_HD *hd, int nbs, int dt)
+{
+    int last = nbs - 1;
+    win_first = 0;
+    if( dt > 0 && tmin > 0 )
+	win_first = (int)(tmin*1000/dt + 0.5);
+    if( dt > 0 && tmax >= 0 )
+	last = (int)(tmax*1000/dt + 0.5);
+    if( last > nbs - 1 )
+	last = nbs - 1;
+    if( win_first > last ) {
+	fprintf(stderr, "Empty time window %g-%g ms\n", tmin, tmax);
+	exit(1);
+    }
+    win_nb = last - win_first + 1;
+    nb_samples_out = (win_nb + resample - 1) / resample;
+    if( (long)dt * resample > 32767 ) {
+	fprintf(stderr, "Sample interval %d us too large after resampling\n",
+		dt * resample);
+	exit(1);
+    }
+    sample_interval_out = dt * resample;
+    if( resample > 1 && fir == 0 )
+	setup_fir(resample);
+    hd->nb_samples = htons(nb_samples_out);
+    hd->sampling = htons(sample_interval_out);
+    if( agc_window > 0 )
+	hd->amp_recover = htons(3);
+}
+
+/*
+  Decode the trace in in fb and apply the stages, the header being copied
+  in out.  Return the number of samples in fb.
+  */
+
+static int prepare_trace(char *in, char *out, float weight)
+{
+    SEGY_TR_HD *tr_hd = (SEGY_TR_HD*)out;
+    short out_fmt = output_fmt != -1 ? output_fmt : data_format;
+    int n = nb_samples;
+
+    bcopy(in, out, 240);
+    /* Two-bytes samples stay scaled by the trace weight */
+    if( out_fmt == 3 && data_format == 3 )
+	weight = 1;
+    else if( out_fmt == 3 )
+	tr_hd->tr_weigth = 0;
+    decode_samples(in+240, fb, n, data_format, weight);
+
+    if( win_first > 0 || win_nb < n ) {
+	memmove(fb, fb+win_first, win_nb*sizeof(float));
+	n = win_nb;
+	if( win_first > 0 && sample_interval > 0 )
+	    tr_hd->delay = htons((short)ntohs(tr_hd->delay)
+				 + win_first*sample_interval/1000);
+    }
+    if( resample > 1 )
+	n = decimate(fb, n, resample);
+    if( filter_spec && sample_interval_out > 0 ) {
+	if( filter_plan == 0 || filter_plan->nb_samples != n ) {
+	    if( filter_plan )
+		fft_free(filter_plan);
+	    filter_plan = fft_plan(n, sample_interval_out / 1e6);
+	}
+	filter_trace(filter_plan, fb, n);
+	if( filter_low || filter_high ) {
+	    tr_hd->low_cut = htons(filter_low);
+	    tr_hd->high_cut = htons(filter_high);
+	}
+	if( filter_notch )
+	    tr_hd->notch_freq = htons(filter_notch);
+    }
+    if( nmo )
+	nmo_correct(tr_hd, fb, n);
+    if( agc_window > 0 && sample_interval_out > 0 )
+	agc(fb, n, (int)(agc_window*1000/sample_interval_out/2 + 0.5));
+    return n;
+}
+
+/* Encode the n samples of fb in out.  Return the length of the output trace */
+
+static size_t finish_trace(char *out, int n)
+{
+    SEGY_TR_HD *tr_hd = (SEGY_TR_HD*)out;
+    short out_fmt = output_fmt != -1 ? output_fmt : data_format;
+
+    encode_samples(fb, out+240, n, out_fmt);
+    tr_hd->nb_samples = htons(n);
+    tr_hd->sampling = htons(sample_interval_out);
+    return 240 + n * (out_fmt == 3 ? 2 : 4);
+}
+
+/*
+  Write a processed trace : skip, split and check as for the copied traces.
+  */
+
+static FILE *last_out = 0;      /* Output of the last trace, for the final flush */
+
+static void output_trace(FILE **fdout, char *out, size_t lg)
+{
+    SEGY_TR_HD *tr_hd = (SEGY_TR_HD*)out;
+    if( max_reached )
+	return;
+    if ( skip_tr == 0 ){
+	if ( cdpfirst == -1 ) cdpfirst = ntohl(tr_hd->cdp_ens);
+	cdplast = ntohl(tr_hd->cdp_ens);
+	nb_written_traces++;
+	if( *fdout )
+	    write_and_check(*fdout, out, lg);
+	CHECK_SPLIT(*fdout);
+	if( check_trace )
+	    (*check_trace)(out, lg, &segy_hd);
+    }
+    else
+	skip_tr--;
+    last_out = *fdout;
+
+    if( max_written_traces > 0 &&
+	nb_written_traces >= max_written_traces)
+      max_reached = 1;
+}
+
+/*
+  CDP stack ( -stack )
+
+  The traces are summed by cdp_ens, each sample being divided by the
+  number of live traces having a non zero value there ( the muted zones
+  do not count ).  Dead traces ( trace identification 2 ) are ignored.
+  With a sorted input a CDP is written when the next one begins.  With an
+  unsorted input the CDPs are kept in a table bounded by the memory given,
+  found by a hash on cdp_ens; when it is full the CDP not updated for the
+  longest time is written.  If more traces of it come, it is started again
+  and written a second time, partially : the memory must hold all the
+  CDPs which are open together in the input.
+  The header of a stacked trace is the one of the first trace of the CDP
+  with a zero offset, the source and the receiver at the midpoint.
+  */
+
+typedef struct stack_cdp {
+    int cdp;
+    int fold;                   /* Number of live traces */
+    int hnext;                  /* Next CDP of the hash chain */
+    int older, newer;           /* Least recently used list */
+    char hd[240];
+    float *sum, *fold_s;        /* Sums and live fold per sample */
+} STACK_CDP;
+
+static int stack_mode = 0;
+static int stack_sorted = 1;
+static long stack_mem = 0;      /* Memory budget in bytes */
+static STACK_CDP *stack_tab = 0;
+static float *stack_x = 0;      /* Trace being stacked */
+static int stack_nb = 0, stack_max = 0, stack_n = 0;
+static int *stack_hash = 0;     /* First CDP of each chain, -1 for none */
+static unsigned stack_hash_mask = 0;
+static int stack_old = -1, stack_new = -1;      /* Ends of the LRU list */
+static int stack_partial = 0;   /* CDPs written before the end of the input */
+
+#define STACK_HASH(cdp) (((unsigned)(cdp) * 2654435761u) & stack_hash_mask)
+
+static void stack_add(float *sum, float *fold, float *x, int n)
+{
+    int i = 0;
+#ifdef __SSE__
+    __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0);
+    for( ; i + 4 <= n ; i += 4 ) {
+	__m128 v = _mm_loadu_ps(x+i);
+	__m128 live = _mm_and_ps(_mm_cmpneq_ps(v, zero), one);
+	_mm_storeu_ps(sum+i, _mm_add_ps(_mm_loadu_ps(sum+i), v));
+	_mm_storeu_ps(fold+i, _mm_add_ps(_mm_loadu_ps(fold+i), live));
+    }
+#endif
+    for( ; i < n ; i++ ) {
+	sum[i] += x[i];
+	fold[i] += x[i] != 0;
+    }
+}
+
+static void stack_write(FILE **fdout, STACK_CDP *c)
+{
+    SEGY_TR_HD *tr_hd = (SEGY_TR_HD*)out_buf;
+    int i, xm, ym;
+
+    for( i = 0 ; i < stack_n ; i++ )
+	fb[i] = c->fold_s[i] > 0 ? c->sum[i] / c->fold_s[i] : 0;
+    memcpy(out_buf, c->hd, 240);
+    xm = ((long)(int)ntohl(tr_hd->src_X) + (int)ntohl(tr_hd->grp_X)) / 2;
+    ym = ((long)(int)ntohl(tr_hd->src_Y) + (int)ntohl(tr_hd->grp_Y)) / 2;
+    tr_hd->src_X = tr_hd->grp_X = htonl(xm);
+    tr_hd->src_Y = tr_hd->grp_Y = htonl(ym);
+    tr_hd->srdist = 0;
+    tr_hd->tr_in_cdp = htonl(1);
+    tr_hd->trace_id = htons(1);
+    tr_hd->nbhst = htons(c->fold);
+    output_trace(fdout, out_buf, finish_trace(out_buf, stack_n));
+    c->cdp = -1;
+    c->fold = 0;
+}
+
+static void stack_unlink(int i)
+{
+    STACK_CDP *c = &stack_tab[i];
+    if( c->older >= 0 )
+	stack_tab[c->older].newer = c->newer;
+    else
+	stack_old = c->newer;
+    if( c->newer >= 0 )
+	stack_tab[c->newer].older = c->older;
+    else
+	stack_new = c->older;
+}
+
+static void stack_use(int i)
+{
+    STACK_CDP *c = &stack_tab[i];
+    c->older = stack_new;
+    c->newer = -1;
+    if( stack_new >= 0 )
+	stack_tab[stack_new].newer = i;
+    else
+	stack_old = i;
+    stack_new = i;
+}
+
+static STACK_CDP *stack_get(FILE **fdout, int cdp)
+{
+    int i, *p;
+    STACK_CDP *c;
+
+    for( i = stack_hash[STACK_HASH(cdp)] ; i >= 0 ; i = stack_tab[i].hnext )
+	if( stack_tab[i].cdp == cdp ) {
+	    stack_unlink(i);
+	    stack_use(i);
+	    return &stack_tab[i];
+	}
+    if( stack_nb < stack_max ) {
+	i = stack_nb++;
+	c = &stack_tab[i];
+	c->sum = malloc(stack_n * sizeof(float));
+	c->fold_s = malloc(stack_n * sizeof(float));
+    }
+    else {
+	/* The least recently used CDP leaves the table */
+	i = stack_old;
+	c = &stack_tab[i];
+	for( p = &stack_hash[STACK_HASH(c->cdp)] ; *p != i ; p = &stack_tab[*p].hnext )
+	    ;
+	*p = c->hnext;
+	stack_unlink(i);
+	if( !stack_sorted )
+	    stack_partial++;
+	stack_write(fdout, c);
+    }
+    c->cdp = cdp;
+    c->fold = 0;
+    memset(c->sum, 0, stack_n * sizeof(float));
+    memset(c->fold_s, 0, stack_n * sizeof(float));
+    c->hnext = stack_hash[STACK_HASH(cdp)];
+    stack_hash[STACK_HASH(cdp)] = i;
+    stack_use(i);
+    return c;
+}
+
+/*
+  out holds the header and fb the n processed samples of the trace.  Both
+  are saved first : writing a CDP goes through out_buf and fb.
+  */
+
+static void stack_trace(FILE **fdout, char *out, int n)
+{
+    SEGY_TR_HD *tr_hd = (SEGY_TR_HD*)out;
+    STACK_CDP *c;
+    char hd[240];
+
+    if( stack_tab == 0 ) {
+	stack_n = n;
+	stack_max = stack_sorted ? 1 : stack_mem / (2*n*sizeof(float) + sizeof(STACK_CDP));
+	if( stack_max < 1 )
+	    stack_max = 1;
+	stack_tab = calloc(stack_max, sizeof(STACK_CDP));
+	stack_x = malloc(stack_n * sizeof(float));
+	for( stack_hash_mask = 1 ; stack_hash_mask < 2*stack_max ; stack_hash_mask *= 2 )
+	    ;
+	stack_hash = malloc(stack_hash_mask * sizeof(int));
+	memset(stack_hash, 0xff, stack_hash_mask * sizeof(int));
+	stack_hash_mask--;
+    }
+    last_out = *fdout;
+    if( (short)ntohs(tr_hd->trace_id) == 2 )
+	return;
+    if( n > stack_n )
+	n = stack_n;
+    memcpy(hd, out, 240);
+    memcpy(stack_x, fb, n * sizeof(float));
+
+    c = stack_get(fdout, ntohl(((SEGY_TR_HD*)hd)->cdp_ens));
+    if( c->fold == 0 )
+	memcpy(c->hd, hd, 240);
+    c->fold++;
+    stack_add(c->sum, c->fold_s, stack_x, n);
+}
+
+static int stack_cmp(const void *a, const void *b)
+{
+    const STACK_CDP *ca = a, *cb = b;
+    return ca->cdp < cb->cdp ? -1 : ca->cdp > cb->cdp;
+}
+
+/* Write the CDPs still in the table by increasing number */
+
+static void stack_flush()
+{
+    int i;
+    FILE *fdout = last_out;
+    qsort(stack_tab, stack_nb, sizeof(STACK_CDP), stack_cmp);
+    for( i = 0 ; i < stack_nb ; i++ )
+	if( stack_tab[i].fold > 0 )
+	    stack_write(&fdout, &stack_tab[i]);
+    if( stack_partial )
+	fprintf(stderr, "%d CDPs written before the end of the input to free memory : those with\n"
+		"traces after that were written again, partially ( give more memory )\n",
+		stack_partial);
+}
+
+
+/*
+  Checkpoints ( -ckpt "file [n]", -resume )
+
+  Every n traces read, the output is flushed to the disk and the state
+  of the copy is saved in file : offsets in the input and in the output,
+  number of the input for +prefix inputs, current split output and the
+  counters.  With -resume, the output is checked up to the saved offset,
+  cut there, and the copy goes on from the saved input offset.
+  Only disk files are concerned, and not the outputs written beside the
+  copy ( -cov, -dump_sp, -crc, ... ), whose state is not saved.
+  */
+
+#define CKPT_MAGIC "SEGYCKP1"
+
+typedef struct ckpt {
+    char magic[8];
+    int range, tape_number;
+    long long in_off, out_off;
+    int nb_tr, nb_written_traces, skip_tr, nb_split_to_write;
+    int cdpfirst, cdplast;
+    int lg_last;                /* Length of the last trace written */
+    short nb_samples, byte_per_sample;
+    char dev_name[510];
+} CKPT;
+
+static char ckpt_name[500];
+static int ckpt_every = 10000, ckpt_count = 0, ckpt_on = 0;
+static int resume_pending = 0;
+static CKPT ckpt;
+
+/* Outputs written beside the copy : a checkpoint does not save them */
+static char *ckpt_side[] = { "-cov", "-dump_sp", "-crc", "-bricks", "-stats",
+			     "-pyramid", "-cube", 0 };
+
+static void write_checkpoint(FILE *fdin, FILE *fdout, int tape_number, int nb)
+{
+    CKPT ck;
+    char tmp[520];
+    FILE *f;
+
+    memset(&ck, 0, sizeof(ck));
+    memcpy(ck.magic, CKPT_MAGIC, 8);
+    ck.range = range;
+    ck.tape_number = tape_number;
+    ck.in_off = ftello(fdin) - nb;
+    if( fflush(fdout) != 0 || fdatasync(fileno(fdout)) != 0 ) {
+	perror("checkpoint");
+	return;
+    }
+    ck.out_off = ftello(fdout);
+    ck.nb_tr = nb_tr;
+    ck.nb_written_traces = nb_written_traces;
+    ck.skip_tr = skip_tr;
+    ck.nb_split_to_write = nb_split_to_write;
+    ck.cdpfirst = cdpfirst;
+    ck.cdplast = cdplast;
+    ck.lg_last = lg_last_trace;
+    ck.nb_samples = nb_samples;
+    ck.byte_per_sample = byte_per_sample;
+    strcpy(ck.dev_name, dev_name);
+
+    /* A new file renamed, so that a crash leaves the previous one */
+    sprintf(tmp, "%s.tmp", ckpt_name);
+    f = fopen(tmp, "w");
+    if( f == 0 || fwrite(&ck, sizeof(ck), 1, f) != 1 || fflush(f) != 0
+	|| fsync(fileno(f)) != 0 ) {
+	perror(tmp);
+	if( f )
+	    fclose(f);
+	return;
+    }
+    fclose(f);
+    rename(tmp, ckpt_name);
+}
+
+static void read_checkpoint()
+{
+    FILE *f = fopen(ckpt_name, "r");
+    if( f == 0 || fread(&ckpt, sizeof(ckpt), 1, f) != 1
+	|| memcmp(ckpt.magic, CKPT_MAGIC, 8) ) {
+	fprintf(stderr, "-resume : no checkpoint in %s\n", ckpt_name);
+	exit(1);
+    }
+    fclose(f);
+    resume_pending = 1;
+}
+
+/* Open the output of the checkpoint, check its end and cut it there */
+
+static FILE *resume_output(char *name)
+{
+    FILE *file;
+    struct stat st;
+    SEGY_TR_HD hd;
+
+    strcpy(name, ckpt.dev_name);
+    file = fopen(name, "r+");
+    if( file == 0 || fstat(fileno(file), &st) != 0 ) {
+	perror(name);
+	exit(1);
+    }
+    if( st.st_size < ckpt.out_off ) {
+	fprintf(stderr, "-resume : %s has %lld bytes, %lld expected\n", name,
+		(long long)st.st_size, ckpt.out_off);
+	exit(1);
+    }
+    if( ckpt.lg_last > 0 && ckpt.nb_tr > 0 ) {
+	/* The last trace before the checkpoint must be there */
+	if( pread(fileno(file), &hd, 240, ckpt.out_off - ckpt.lg_last) != 240
+	    || ntohl(hd.traseqrel) != ckpt.nb_tr ) {
+	    fprintf(stderr, "-resume : %s does not end with trace %d at the checkpoint\n",
+		    name, ckpt.nb_tr);
+	    exit(1);
+	}
+    }
+    if( ftruncate(fileno(file), ckpt.out_off) != 0 ) {
+	perror(name);
+	exit(1);
+    }
+    fseeko(file, ckpt.out_off, SEEK_SET);
+    fprintf(stderr, "Resuming %s at %lld bytes\n", name, ckpt.out_off);
+    return file;
+}
+
+/* Called by read_a_tape() when the trace loop begins */
+
+static void resume_input(FILE *fdin)
+{
+    if( fseeko(fdin, ckpt.in_off, SEEK_SET) != 0 ) {
+	perror("-resume");
+	exit(1);
+    }
+    nb_tr = ckpt.nb_tr;
+    nb_written_traces = ckpt.nb_written_traces;
+    skip_tr = ckpt.skip_tr;
+    if( split_output > 0 )
+	nb_split_to_write = ckpt.nb_split_to_write;
+    cdpfirst = ckpt.cdpfirst;
+    cdplast = ckpt.cdplast;
+    lg_last_trace = ckpt.lg_last;
+    resume_pending = 0;
+}
+
+/*
+  Duplicated traces ( -dedupe "drop or report [field ...]" )
+
+  Two independent 64 bits hashes of the samples and of the given header
+  fields are kept for each trace in an open addressing table ( linear
+  probing, doubled at 70 % full ), about 23 bytes per trace.  A trace is
+  a duplicate when both hashes are already there : with 128 bits, a false
+  match needs about 2^64 traces.  It is dropped, or only reported with
+  its number in its input.
+  */
+
+#define DEDUPE_MAX_FIELDS 16
+#define DEDUPE_FIRST_SIZE (1<<20)
+
+static int dedupe_mode = 0;             /* 1 drop, 2 report */
+static HD_FIELD *dedupe_fields[DEDUPE_MAX_FIELDS];
+static int dedupe_nb_fields = 0;
+static unsigned long long *dedupe_tab = 0;
+static size_t dedupe_size = 0, dedupe_count = 0;
+static long long dedupe_nb = 0;
+
+/* 8 bytes at a time, murmur like */
+
+static unsigned long long hash64(char *p, size_t lg, unsigned long long h)
+{
+    unsigned long long k;
+
+    h ^= lg * 0x9e3779b97f4a7c15ULL;
+    for( ; lg >= 8 ; p += 8, lg -= 8 ) {
+	memcpy(&k, p, 8);
+	k *= 0x87c37b91114253d5ULL;
+	k = (k << 31) | (k >> 33);
+	h ^= k * 0x4cf5ad432745937fULL;
+	h = ((h << 27) | (h >> 37)) * 5 + 0x52dce729;
+    }
+    if( lg > 0 ) {
+	k = 0;
+	memcpy(&k, p, lg);
+	h ^= k * 0x87c37b91114253d5ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* 0 if the pair h1, h2 is already there */
+
+static int dedupe_insert(unsigned long long h1, unsigned long long h2)
+{
+    size_t i, mask = dedupe_size - 1;
+
+    for( i = h1 & mask ; dedupe_tab[2*i] ; i = (i+1) & mask )
+	if( dedupe_tab[2*i] == h1 && dedupe_tab[2*i+1] == h2 )
+	    return 0;
+    dedupe_tab[2*i] = h1;
+    dedupe_tab[2*i+1] = h2;
+    dedupe_count++;
+    return 1;
+}
+
+static void dedupe_grow()
+{
+    unsigned long long *old = dedupe_tab;
+    size_t i, n = dedupe_size;
+
+    dedupe_size = n ? 2*n : DEDUPE_FIRST_SIZE;
+    dedupe_tab = calloc(2*dedupe_size, sizeof(unsigned long long));
+    if( dedupe_tab == 0 ) {
+	fprintf(stderr, "-dedupe : out of memory at %ld traces\n", (long)dedupe_count);
+	exit(1);
+    }
+    dedupe_count = 0;
+    for( i = 0 ; i < n ; i++ )
+	if( old[2*i] )
+	    dedupe_insert(old[2*i], old[2*i+1]);
+    free(old);
+}
+
+/* 1 if the trace is a duplicate to drop */
+
+static int trace_is_dup(char *buf, size_t lg, int tape_number)
+{
+    unsigned long long h1, h2;
+    int i, v;
+
+    h1 = hash64(buf+240, lg-240, 0);
+    h2 = hash64(buf+240, lg-240, 0x243f6a8885a308d3ULL);
+    for( i = 0 ; i < dedupe_nb_fields ; i++ ) {
+	v = get_field(buf, dedupe_fields[i]);
+	h1 = hash64((char*)&v, sizeof(v), h1);
+	h2 = hash64((char*)&v, sizeof(v), h2);
+    }
+    if( h1 == 0 )
+	h1 = 1;         /* 0 marks the free slots */
+    if( dedupe_count*10 >= dedupe_size*7 )
+	dedupe_grow();
+    if( dedupe_insert(h1, h2) )
+	return 0;
+    dedupe_nb++;
+    if( dedupe_mode == 2 )
+	fprintf(stdout, "trace %lld of input %d is a duplicate\n", nb_tr_read, tape_number);
+    return dedupe_mode == 1;
+}
+
+static void setup_dedupe(char *buf)
+{
+    char *p = strtok(buf, " \t");
+
+    if( p && !strcmp(p, "drop") )
+	dedupe_mode = 1;
+    else if( p && !strcmp(p, "report") )
+	dedupe_mode = 2;
+    else {
+	fprintf(stderr, "-dedupe : drop or report expected\n");
+	exit(1);
+    }
+    while( (p = strtok(0, " \t")) != 0 ) {
+	if( dedupe_nb_fields == DEDUPE_MAX_FIELDS
+	    || (dedupe_fields[dedupe_nb_fields] = find_field(p, strlen(p))) == 0 ) {
+	    fprintf(stderr, "-dedupe : bad field %s\n", p);
+	    exit(1);
+	}
+	dedupe_nb_fields++;
+    }
+}
+
+int read_a_tape(fdin, fdout, file_info, tape_number, file_dump_sp)
+FILE *fdin, *fdout;
+FILE *file_info;   /* Dump informations/errors on this files */
+int tape_number;
+FILE *file_dump_sp; /* Dump trace header info on this file */
+{
+    size_t lg_tr_out,lg_tr;
+    int nb, lg_read, nb_samples_error = 0;
+    int skip_read = 0;
+    short nbs_in, dt_in;
+
+    /*  Read the EBCDIC Header */
+    
+    lg_read = is_tape ? MAX_SIZE : 3200;
+    su_state = su_pending = 0;
+    tape_lg_tr = 0;
+    tape_rec_pos = tape_rec_lg = 0;
+    nb = READ(fdin, buf, 3200);
+    if( nb == 0 )
+	return -1;
+
+    if( nb != 3200 ) {
+        if( error_hd ) {
+	    fprintf(file_info, "EBCDIC Header not of size 3200\n");
+	    fprintf(file_info, " ebcdic header %d \n\n", nb);
+	    hex_dmp(ebcdic_hd, 160, file_info);
+	}
+        if( nb == - 1) {
+          perror("cp_segy");
+        }
+    }
+    else
+	memcpy(ebcdic_hd, buf, 3200);
+
+    /* If an external ebcdic exists, read it now */
+
+    if( ext_ebcdic_file[0] != 0 ) {
+	int l;
+	FILE *f = fopen(ext_ebcdic_file, "r");
+	l = fread(ebcdic_hd, 1, 3200, f);
+	fclose(f);
+	if( l != 3200 ) {
+	    fprintf(stderr, "EBCDIC File %s has not correct length ?\n", ext_ebcdic_file);
+	    exit(1);
+	}
+    }
+	
+
+    /*  Read the binary header */
+    
+    if( nb == 400 ) {
+        fprintf(stderr, " Previous header was 400, Try to use it as binary header\n");
+        if( tape_number == 1 )
+            write_header(fdout, ebcdic_hd, (size_t) 3200);
+    }
+    else if( nb == 3200 ) 
+        nb = READ(fdin, buf, 400);
+
+    if( nb != 400 ) {
+        if( nb == -1 )
+                perror("Binary header");
+        else if( error_hd ) {
+	    fprintf(file_info,
+		    " Binary Header not  of size 400 ( actually %d )\n",
+                    nb);
+	    hex_dmp(buf, 400, file_info);
+        }
+	skip_read = 1;
+    }
+    else {
+	memcpy(&segy_hd, buf, 400);
+        if( dump_hd )
+            dump_segy_hd(&segy_hd, file_info);
+    }
+
+    /* Write both headers */
+    data_format = ntohs(segy_hd.data_form);
+    if( output_fmt != -1 )
+      segy_hd.data_form = htons(output_fmt);    
+    if (DEBUG) fprintf(stderr,"%d: Output_format=%d\n",__LINE__,output_fmt);
+    nbs_in = ntohs(segy_hd.nb_samples);
+    dt_in = ntohs(segy_hd.sampling);
+    if( process_samples )
+	setup_samples(&segy_hd, nbs_in, dt_in);
+    if( stack_mode ) {
+	segy_hd.trace_sort = htons(2);
+	segy_hd.nb_tra_rec = htons(1);
+    }
+    if( route_field )
+	  fdout = route_list;
+    else if( multiple_file )
+	  fdout = next_file(ntohl(segy_hd.line_number));
+    if( fdout != 0 && no_headers == 0 && tape_number == 1 && !resume_pending )
+	write_header(fdout, ebcdic_hd, (size_t) 3200);
+    if( fdout != 0 && no_headers == 0 && tape_number == 1 && !resume_pending )
+	write_header(fdout, (char *) &segy_hd, (size_t) 400);
+
+    
+    /* If no copy, exit now */
+
+    if( fdout == 0 && check_trace == 0 && file_dump_sp == 0 && !dedupe_mode )
+        return 0;
+    
+    /*  Compute trace length */
+    
+    if( tape_number == 1 ) {
+	  nb_samples = nbs_in;
+	  sample_interval = dt_in;
+        if (DEBUG) fprintf(stderr,"%d: nb_samples=%d\n",__LINE__,nb_samples);
+	/*        data_format = segy_hd.data_form; */
+	fprintf( stderr, " data_format : %d\n", data_format );
+        byte_per_sample = 4;
+        if( data_format == 3 ) byte_per_sample = 2;
+        if( output_fmt != -1 ) {
+            lg_tr_out = 240 + nb_samples * 2;
+            if( output_fmt != 3 )
+                lg_tr_out += nb_samples * 2;
+            segy_hd.data_form = htons(output_fmt);
+        }
+    }
+    else {
+        short nbs, dtf;
+	nbs = nbs_in;
+        if(DEBUG) fprintf(stderr,"%d: nbs=%d\n",__LINE__,nbs);
+        dtf = ntohs(segy_hd.data_form);
+        if(DEBUG)fprintf(stderr,"%d: dtf=%d\n",__LINE__,dtf);
+        if( nbs != nb_samples ) 
+            fprintf(file_info,
+"Error for tape %d : number of samples not corresponding %d ( expected %d )\n",
+                    tape_number, nbs, nb_samples);
+        if( dtf != data_format )
+            fprintf(file_info,
+"Error for tape %d : data format not corresponding %d ( expected %d )\n", 
+                    tape_number, nbs, nb_samples);
+    }
+
+    lg_tr = 240+nb_samples*byte_per_sample;
+    if (DEBUG) fprintf(stderr,"%d: lg_tr=%d\n",__LINE__,lg_tr);
+
+    /* Only the headers are needed : do not read the samples */
+
+    free(area_list);
+    area_list = 0;
+    if( area_index[0] && !is_tape && !is_blocked && !resync && !skip_read && !su_in )
+	setup_area_index(fdin, lg_tr);
+    where_list = where_prog && !is_tape && !is_blocked && !resync && !skip_read && !su_in
+	&& setup_where_list(fdin, lg_tr, file_info);
+
+    ckpt_on = ckpt_name[0] && fdout && fdout != stdout && fdin != stdin && !output_is_tape
+	&& !route_field && !multiple_file && !stack_mode && !is_tape && !is_blocked
+	&& !resync && !area_list && !skip_read && !su_in && !su_out && !dedupe_mode
+	&& !compressed_in;
+    if( ckpt_name[0] && !ckpt_on )
+	fprintf(stderr, "No checkpoint with these input, output or options\n");
+    if( resume_pending && ckpt_on )
+	resume_input(fdin);
+    tr_batch_on = ( where_prog && !where_list || geometry || set_prog ) && !ckpt_on;
+    tr_batch.nb = tr_batch.next = tr_batch.end = 0;
+
+    hd_only = !area_list && !dedupe_mode && fdout == 0 && !process_samples && !stack_mode && check_trace == check_trace_hd
+	&& !is_tape && !is_blocked && !resync && !skip_read && !su_in && setup_hd_only(fdin);
+
+    /*  Read in a trace, check its length and write it */
+
+    nb_tr_read = skip_read;     /* The trace already read */
+
+    //    fprintf(stderr, "skip_read %d\n", skip_read);
+
+      while( skip_read || ( nb = tr_batch_on ? read_trace_batch(fdin, buf, lg_tr, file_info, &nb_samples_error)
+			    : read_trace(fdin, buf, lg_tr, file_info) ) > 0 ) { 
         SEGY_TR_HD *tr_hd = (SEGY_TR_HD*)buf;
-        short tr_nb_samples = ntohs(tr_hd->nb_samples);
+	int batched = tr_batch_on && !skip_read;        /* Header steps done */
+
+		int w = -(ntohs(tr_hd->tr_weigth));
+	float weight = pow(2.0, (double)w);
+
+	if( ckpt_on && ++ckpt_count >= ckpt_every ) {
+	    /* Before this trace */
+	    write_checkpoint(fdin, fdout, tape_number, nb);
+	    ckpt_count = 0;
+	}
+	skip_read = 0;
+	if(DEBUG)fprintf(stderr, "Number of samples %d\n", ntohs(tr_hd->nb_samples));
+
+	/* In any case, set the trace number of samples to the header,
+	   then -where, -geometry and -set */
+	if( !batched ) {
+	    char *hd = buf;
+	    double keep;
+	    check_nb_samples(buf, &nb_samples_error);
+	    header_steps(&hd, 1, &keep);
+	    if( keep == 0 )
+		continue;
+	}
+
+        /* Dump sp informations if needed */
+        
+        if( file_dump_sp ) {
+	    union { float v; int i; } res;
+            int sp1, esp, ntr, ncdp;
+	    int n_field,
+	      n_tr ,
+	      n_esp ,
+	      n_cdp ,
+	      n_st ,
+	      n_off ,
+	      n_xs ,
+	      n_ys , 
+	      n_xg , 
+	      n_yg,
+	      n_stnu ,
+	      n_stnuso ,
+	      n_stnure, 
+	      n_line, 
+	      n_spnu;
+	    float  n_wb,
+	      n_line2,
+	      n_spnu2,
+	      n_xm,
+	      n_ym,
+	      n_xs2,
+	      n_ys2,
+	      n_xg2,
+	      n_yg2;
+
+	    n_field = ntohl(tr_hd->field_rec);
+	    n_tr = ntohl(tr_hd->tracnb_fld);
+	    n_esp = ntohl(tr_hd->esp);
+	    n_cdp = ntohl(tr_hd->cdp_ens);
+	    n_st = ntohs(tr_hd->nbhst);
+	    n_off = ntohl(tr_hd->srdist);
+	    n_xs = ntohl(tr_hd->src_X);
+	    n_ys = ntohl(tr_hd->src_Y);
+	    n_xg = ntohl(tr_hd->grp_X);
+	    n_yg = ntohl(tr_hd->grp_Y);
+	    n_stnu = ntohl(tr_hd->statnu_mid);
+	    n_stnuso = ntohl(tr_hd->statnu_so);
+	    n_stnure = ntohl(tr_hd->statnu_rec);
+	    n_line = ntohs(tr_hd->line_nu);
+	    n_spnu = ntohl(tr_hd->sp_nu);
+	    n_wb = ntohl(tr_hd->wat_bot_mid);
+	    n_line2 = ntohl(tr_hd->line_nu2);
+	    n_spnu2 = ntohl(tr_hd->sp_nu2);
+	    n_xm = ntohl(tr_hd->X_mid);
+	    n_ym = ntohl(tr_hd->Y_mid);
+	    /*  n_xs2 = ntohl(tr_hd->X_s); */
+	    n_ys2 = ntohl(tr_hd->Y_s);
+	    n_xg2 = ntohl(tr_hd->X_g);
+	  n_yg2 = ntohl(tr_hd->Y_g);
+	    
+            fprintf(file_dump_sp, "%d %d %d %d %d %d %d %d %d %d %d %d %d %d %d  \n", 
+		    n_field,
+		    n_tr ,
+		    n_esp ,
+		    n_cdp ,
+		    n_st ,
+		    n_off ,
+		    n_xs ,
+		    n_ys , 
+		    n_xg , 
+		    n_yg ,
+                    n_stnu ,
+		    n_stnuso ,
+		    n_stnure, 
+		    n_line, 
+		    n_spnu );
+/* 	      	    n_wb, */
+/* 		    n_line2, */
+/* 		    n_spnu2, */
+/* 		    n_xm, */
+/* 		    n_ym, */
+/* 		    n_xs2, */
+/* 		    n_ys2, */
+/* 		    n_xg2, */
+/* 		    n_yg2  */
+/* 		    );  */
+        }
+        
+        /* If the read trace is too short, pad it with 0 */
+
+        if( nb < lg_tr ) {
+            int i;
+            for( i = nb ; i < lg_tr ; i++ )
+                buf[i] = 0;
+        }
+
+	/* Check if the trace is in the wanted area */
+
+	if( !trace_is_in_area(tr_hd) )
+	    continue;
+
+	if( dedupe_mode && trace_is_dup(buf, lg_tr, tape_number) )
+	    continue;
+
+	if( process_samples ) {
+	    int n = prepare_trace(buf, out_buf, weight);
+	    if( stack_mode )
+		stack_trace(&fdout, out_buf, n);
+	    else
+		output_trace(&fdout, out_buf, finish_trace(out_buf, n));
+	    if( max_reached )
+		break;
+	}
+	else if( fdout != 0 || check_trace != 0 ) {
+            if( output_fmt == -1 ||
+		output_fmt == data_format ) {
+
+		if ( skip_tr == 0 ){
+		  if ( cdpfirst == -1 ) cdpfirst = ntohl(tr_hd->cdp_ens);
+		  cdplast = ntohl(tr_hd->cdp_ens);
+		  nb_written_traces++;
+		  if( fdout )
+		    write_and_check(fdout, buf, (size_t) lg_tr);
+		  CHECK_SPLIT(fdout);
+		  if( check_trace )
+		    (*check_trace)(buf, lg_tr, &segy_hd);
+		}
+		else
+		  skip_tr--;
+	    }
+            else {  /* output_fmt != data_format */
+                bcopy(buf, out_buf, 240);
+                switch(output_fmt) {
+                    case 1: /* output floating ibm */
+                    {
+                        switch(data_format) {
+                            case 2: /* integer format */
+                            {
+                                int i, *p = (int*)(buf+240);
+                                for( i = 0 ; i < nb_samples ; i++ )
+								  fb[i] = ntohl(p[i]);
+                                break;
+                            }
+                            case 3: /* two-bytes format */
+                            {
+                                short *p = (short*)(buf+240);
+                                int i;
+				                for( i = 0 ; i < nb_samples ; i++ ) {
+				                   int vv = (short)ntohs(p[i]);
+				                   fb[i] = ((float)(vv))*weight;
+				                }
+				                break;
+                            }
+			                case 5: /* ieee format */
+			                {
+				                float *p = (float*)(buf+240);
+				                int i;
+                                for( i = 0 ; i < nb_samples ; i++ )
+                                    fb[i] = p[i];
+                                break;
+                            }
+                        }
+			
+                        /*  convert fb in ibm format */
+
+			            ieee2ibm( fb, out_buf+240, nb_samples);
+			            break;
+                    }
+                    case 2: /* output data integer */
+                    {
+                        switch(data_format) {
+                            case 3: /*  two-bytes integer  */
+                            {
+                                short *p = (short*)(buf+240);
+                                int i, *pp = (int*)(out_buf+240);
+                                for( i = 0 ; i < nb_samples ; i++ )
+                                    pp[i] = p[i];
+                            }
+                        }
+			            break;
+                    }
+		            case 5: /* output floating ieee ( native ) */
+		            {
+			            switch(data_format) {
+			                case 1: /* floating point ibm */
+			                {
+				                /* convert ibm to ieee  */
+				
+				                ibm2ieee(buf+240, out_buf+240, nb_samples);
+				                break;
+			                }				
+                            case 2: /* integer format */
+                            {
+                                int i, *p = (int*)(buf+240);
+				                float *pf = (float*)(out_buf+240);
+                                for( i = 0 ; i < nb_samples ; i++ )
+                                    pf[i] = p[i];
+                                break;
+                            }
+                            case 3: /* two-bytes format */
+                            {
+                                short *p = (short*)(buf+240);
+                                int i;
+				                float *pf = (float*)(out_buf+240);
+                                for( i = 0 ; i < nb_samples ; i++ )
+                                    pf[i] = p[i];
+                                break;
+                            }
+                        }
+		            }
+                }
+		if( fdout )
+		  if ( skip_tr == 0 ){
+		    write_and_check(fdout, out_buf, (size_t) lg_tr_out);
+		    nb_written_traces++;
+		    CHECK_SPLIT(fdout);
+		    if( check_trace )
+		      (*check_trace)(out_buf, lg_tr_out, &segy_hd);
+		  }
+		  else
+		    skip_tr --;
+            }
+
+	    /* The outputs are closed by main() */
+	    if( max_written_traces > 0 &&
+		nb_written_traces >= max_written_traces) {
+	      max_reached = 1;
+	      break;
+	    }
+        }
+
+    }
+
+    if( nb < 0 ) {
+        perror("Reading Tape");
+    }
+    segy_hd.data_form = htons(data_format);
+    segy_hd.nb_samples = htons(nbs_in);
+    segy_hd.sampling = htons(dt_in);
+
+    return max_reached ? -1 : nb;
+}
+
+#define SED_STRING \
+" |\
+sed 's/\\(.*\\)-o[ ]*\\([^ :]*\\):\\([^ ]*\\)\\(.*\\)/\\1 -o - \\4 | \
+ rsh \\2 cp_segy -i - -o \\3/\n\
+s/\\(.*\\)-i[ ]*\\([^ :]*\\):\\([^ ]*\\)\\(.*\\)/rsh \\2 $CP_SEGY -i \\3 -o - | \
+\\1 -i - \\4/'"
+
+void exec_remote(argc, argv)
+int     argc;
+char    *argv[];
+{
+    char *str;
+    FILE *file;
+    int i;
+    strcpy(buf, "echo cp_segy ");
+    str = buf+strlen(buf);
+
+    for( i = 1 ; i < argc ; i++ ) {
+        char *ptr = argv[i];
+        while( *ptr )
+            *str++ = *ptr++;
+        *str++ = ' ';
+    }
+
+    strcpy(str, SED_STRING);
+    file = popen(buf, "r");
+    i = fread(buf, 1, 1000, file);
+    pclose(file);
+    buf[i] = 0;
+    fprintf(stderr, "Going to execute \"%s\"\n", buf);
+    execl("/bin/sh", "/bin/sh", "-c", buf, 0);
+}
+
+
+/*
+  Fan-out of the traces to several consumers
+
+  With one consumer ( -cube, -bricks, -pyramid, -cov or -stats ) check_trace is
+  called by the reader as before.  When several are given, each one runs
+  on its own thread : the reader copies the traces into batches taken
+  from a pool of TEE_NB_BATCH, and gives each full batch to all the
+  consumers, which read it in place.  A batch comes back to the pool when
+  the last consumer is done with it, so a slow consumer holds the reader
+  back instead of letting the memory grow.  Each trace is copied once into
+  the batch; the output file and -dump_sp stay on the reader thread.
+  */
+
+#define TEE_TRACES      64      /* Traces per batch */
+#define TEE_NB_BATCH    8       /* Batches in the pool */
+#define TEE_MAX         8       /* Consumers */
+
+typedef struct tee_batch {
+    char *data;                 /* TEE_TRACES traces of MAX_SIZE bytes */
+    int lg[TEE_TRACES];
+    int nb, refs;
+    SEGY_HD hd;
+} TEE_BATCH;
+
+typedef struct tee_consumer {
+    void (*fn)();
+    pthread_t thread;
+    int queue[TEE_NB_BATCH];    /* Batches to read */
+    int first, nb;
+} TEE_CONSUMER;
+
+static TEE_BATCH tee_pool[TEE_NB_BATCH];
+static TEE_CONSUMER tee_cons[TEE_MAX];
+static int tee_nb = 0, tee_cur = -1, tee_end = 0, tee_started = 0;
+static pthread_mutex_t tee_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tee_cond = PTHREAD_COND_INITIALIZER;
+
+static void *tee_thread(void *arg)
+{
+    TEE_CONSUMER *c = (TEE_CONSUMER*)arg;
+
+    for( ;; ) {
+	TEE_BATCH *b;
+	int i;
+
+	pthread_mutex_lock(&tee_lock);
+	while( c->nb == 0 && !tee_end )
+	    pthread_cond_wait(&tee_cond, &tee_lock);
+	if( c->nb == 0 ) {
+	    pthread_mutex_unlock(&tee_lock);
+	    return 0;
+	}
+	b = &tee_pool[c->queue[c->first]];
+	pthread_mutex_unlock(&tee_lock);
+
+	for( i = 0 ; i < b->nb ; i++ )
+	    (*c->fn)(b->data + (size_t)i*MAX_SIZE, b->lg[i], &b->hd);
+
+	pthread_mutex_lock(&tee_lock);
+	c->first = (c->first+1) % TEE_NB_BATCH;
+	c->nb--;
+	if( --b->refs == 0 )
+	    pthread_cond_broadcast(&tee_cond);
+	pthread_mutex_unlock(&tee_lock);
+    }
+}
+
+static void tee_publish()
+{
+    int i;
+    pthread_mutex_lock(&tee_lock);
+    tee_pool[tee_cur].refs = tee_nb;
+    for( i = 0 ; i < tee_nb ; i++ ) {
+	TEE_CONSUMER *c = &tee_cons[i];
+	c->queue[(c->first + c->nb++) % TEE_NB_BATCH] = tee_cur;
+    }
+    pthread_cond_broadcast(&tee_cond);
+    pthread_mutex_unlock(&tee_lock);
+    tee_cur = -1;
+}
+
+static void tee_trace(buf, lg, segy_hd)
+char *buf;
+int lg;
+SEGY_HD *segy_hd;
+{
+    TEE_BATCH *b;
+
+    if( !tee_started ) {
+	int i;
+	for( i = 0 ; i < TEE_NB_BATCH ; i++ )
+	    tee_pool[i].data = malloc((size_t)TEE_TRACES * MAX_SIZE);
+	for( i = 0 ; i < tee_nb ; i++ )
+	    pthread_create(&tee_cons[i].thread, 0, tee_thread, &tee_cons[i]);
+	tee_started = 1;
+    }
+    if( tee_cur < 0 ) {
+	/* Wait for a free batch */
+	int i;
+	pthread_mutex_lock(&tee_lock);
+	for( ;; ) {
+	    for( i = 0 ; i < TEE_NB_BATCH && tee_pool[i].refs ; i++ )
+		;
+	    if( i < TEE_NB_BATCH )
+		break;
+	    pthread_cond_wait(&tee_cond, &tee_lock);
+	}
+	pthread_mutex_unlock(&tee_lock);
+	tee_cur = i;
+	tee_pool[i].nb = 0;
+	/* Not free any more for the next search */
+	tee_pool[i].refs = -1;
+    }
+    b = &tee_pool[tee_cur];
+    memcpy(b->data + (size_t)b->nb*MAX_SIZE, buf, lg);
+    b->lg[b->nb++] = lg;
+    if( b->nb == TEE_TRACES ) {
+	b->hd = *segy_hd;
+	tee_publish();
+    }
+}
+
+/* Give the last batch and wait for the consumers */
+
+static void tee_finish()
+{
+    int i;
+    if( !tee_started )
+	return;
+    if( tee_cur >= 0 ) {
+	tee_pool[tee_cur].hd = segy_hd;
+	tee_publish();
+    }
+    pthread_mutex_lock(&tee_lock);
+    tee_end = 1;
+    pthread_cond_broadcast(&tee_cond);
+    pthread_mutex_unlock(&tee_lock);
+    for( i = 0 ; i < tee_nb ; i++ )
+	pthread_join(tee_cons[i].thread, 0);
+    tee_started = 0;
+}
+
+/* Add a consumer of the traces */
+
+static void add_check(void (*fn)())
+{
+    if( check_trace == 0 ) {
+	check_trace = fn;
+	return;
+    }
+    if( check_trace != tee_trace ) {
+	tee_cons[tee_nb++].fn = check_trace;
+	check_trace = tee_trace;
+	atexit(tee_finish);
+    }
+    if( tee_nb >= TEE_MAX ) {
+	fprintf(stderr, "Too many trace consumers ( %d at most )\n", TEE_MAX);
+	exit(1);
+    }
+    tee_cons[tee_nb++].fn = fn;
+}
+
+/*
+  Amplitude statistics ( -stats file )
+  */
+
+static FILE *stats_file = 0;
+static long long stats_nb = 0, stats_dead = 0;
+static double stats_min = 0, stats_max = 0, stats_sum2 = 0, stats_nb_samples = 0;
+static float stats_fb[MAX_SAMPLES];
+
+static void stats_trace(buf, lg, segy_hd)
+char *buf;
+int lg;
+SEGY_HD *segy_hd;
+{
+    SEGY_TR_HD *tr_hd = (SEGY_TR_HD*)buf;
+    int fmt = ntohs(segy_hd->data_form);
+    int i, live = 0, n = (lg-240) / sample_size[fmt > 0 && fmt <= 5 ? fmt-1 : 0];
+    float weight = pow(2.0, (double)-(short)ntohs(tr_hd->tr_weigth));
+
+    decode_samples(buf+240, stats_fb, n, fmt, weight);
+    for( i = 0 ; i < n ; i++ ) {
+	double v = stats_fb[i];
+	if( v != 0 )
+	    live = 1;
+	if( stats_nb_samples == 0 || v < stats_min )
+	    stats_min = v;
+	if( stats_nb_samples == 0 || v > stats_max )
+	    stats_max = v;
+	stats_sum2 += v*v;
+	stats_nb_samples++;
+    }
+    stats_nb++;
+    if( !live )
+	stats_dead++;
+}
+
+static void setup_stats(char *name)
+{
+    stats_file = fopen(name, "w");
+    if( stats_file == 0 ) {
+	perror(name);
+	return;
+    }
+    add_check(stats_trace);
+}
+
+static void close_stats()
+{
+    fprintf(stats_file, "traces %lld\ndead %lld\nmin %g\nmax %g\nrms %g\n",
+	    stats_nb, stats_dead, stats_min, stats_max,
+	    stats_nb_samples ? sqrt(stats_sum2 / stats_nb_samples) : 0.0);
+    fclose(stats_file);
+}
+
+static float cube_dim[3][3];
+static FILE *cube_out = 0;
+
+#define grid(x,s) ((int)((x)/(s)+0.5))
+
+static void cube_write(buf, lg, segy_hd)
+char *buf;
+int lg;
+SEGY_HD *segy_hd;
+{
+    SEGY_TR_HD *tr_hd = (SEGY_TR_HD*)buf;
+    int nb_traces = grid(cube_dim[1][1]-cube_dim[0][1], cube_dim[2][1])+1;
+    int nb_samp = grid(cube_dim[1][2]-cube_dim[0][2], cube_dim[2][2])+1;
+    unsigned long pos;
+    int sample_size = 4;
+    int line_number = ntohl(tr_hd->grp_X); /* field_rec; segy_hd->line_number;*/
+    int tr_number = ntohl(tr_hd->grp_Y); /* tracnb_fld; tr_hd->cdp_ens */
+    int beg_trace = grid(cube_dim[0][2], cube_dim[2][2]);
+
+    if( nb_samp > ntohs(tr_hd->nb_samples) )
+	  nb_samp = ntohs(tr_hd->nb_samples);
+
+    if( line_number < cube_dim[0][0]
+       || line_number > cube_dim[1][0] )
+	return;
+
+    if( tr_number < cube_dim[0][1]
+       || tr_number > cube_dim[1][1] )
+	return;
+
+    if( ntohs(segy_hd->data_form) == 3 )
+	sample_size = 2;
+    
+    pos = grid(line_number-cube_dim[0][0], cube_dim[2][0]);
+    pos *= nb_traces;
+    pos += grid(tr_number-cube_dim[0][1], cube_dim[2][1]);
+    pos *= nb_samp;
+    pos *= sample_size;
+    fseek(cube_out, pos, SEEK_SET);
+    fwrite(buf+240+sample_size*beg_trace, sample_size,
+	   nb_samp, cube_out);
+}
+    
+static void setup_cube(buf)
+char *buf;
+{
+    char name[100];
+    int nb = sscanf(buf, "%s %f %f %f %f %f %f %f %f %f", name,
+		    &cube_dim[0][0], &cube_dim[1][0], &cube_dim[2][0], 
+		    &cube_dim[0][1], &cube_dim[1][1], &cube_dim[2][1], 
+		    &cube_dim[0][2], &cube_dim[1][2], &cube_dim[2][2]);
+
+    cube_out = fopen(name, "a+");
+    add_check(cube_write);
+}
+
+/*
+  Bricked volume ( -bricks )
+
+  The volume described as for -cube is cut in bricks of BRICK_SIZE^3
+  float samples ( native ), the samples being the fastest axis in a brick
+  then the traces then the lines.  The file is made of a header, the index
+  of the bricks ( file offset of each brick, 0 for a brick never written )
+  and the bricks.  A reader only touches the bricks which intersect the
+  request, and in each brick only the lines of the request.
+  */
+
+#define BRICK_SIZE 64
+#define BRICK_MAGIC "SEGYBRK1"
+#define BRICK_ALIGN 4096
+
+typedef struct brick_hd {
+    char magic[8];
+    int brick;                  /* Edge of a brick in samples */
+    int n[3];                   /* Size of the volume : lines, traces, samples */
+    int nb[3];                  /* Number of bricks along each axis */
+    float first[3], step[3];    /* Lines and traces keys, first sample */
+    int sample_interval;        /* In micro-seconds */
+    long long data_pos;         /* Offset of the first brick */
+    char unass[192];
+} BRICK_HD;
+
+typedef struct brick_vol {
+    int fd;
+    BRICK_HD hd;
+    long long *index;
+    size_t lg_brick;
+} BRICK_VOL;
+
+static BRICK_VOL brick_out;
+static float brick_fb[MAX_SAMPLES];    /* brick_write() may run on its own thread */
+static char *brick_written = 0;
+
+#define BRICK_NB(v) ((long)(v)->hd.nb[0]*(v)->hd.nb[1]*(v)->hd.nb[2])
+#define BRICK_ID(v,b0,b1,b2) (((long)(b0)*(v)->hd.nb[1]+(b1))*(v)->hd.nb[2]+(b2))
+
+static void brick_write(buf, lg, segy_hd)
+char *buf;
+int lg;
+SEGY_HD *segy_hd;
+{
+    SEGY_TR_HD *tr_hd = (SEGY_TR_HD*)buf;
+    BRICK_VOL *v = &brick_out;
+    int B = v->hd.brick;
+    int line_number = ntohl(tr_hd->grp_X); /* Same keys as cube_write() */
+    int tr_number = ntohl(tr_hd->grp_Y);
+    int beg_trace = grid(cube_dim[0][2], cube_dim[2][2]);
+    int nbs = (short)ntohs(tr_hd->nb_samples);
+    int i, j, b2, nb_samp = v->hd.n[2];
+    float weight = pow(2.0, (double)-(short)ntohs(tr_hd->tr_weigth));
+
+    if( line_number < cube_dim[0][0] || line_number > cube_dim[1][0] )
+	return;
+    if( tr_number < cube_dim[0][1] || tr_number > cube_dim[1][1] )
+	return;
+    if( beg_trace + nb_samp > nbs )
+	nb_samp = nbs - beg_trace;
+    if( nb_samp <= 0 )
+	return;
+
+    decode_samples(buf+240, brick_fb, nbs, ntohs(segy_hd->data_form), weight);
+    i = grid(line_number-cube_dim[0][0], cube_dim[2][0]);
+    j = grid(tr_number-cube_dim[0][1], cube_dim[2][1]);
+
+    for( b2 = 0 ; b2*B < nb_samp ; b2++ ) {
+	long id = BRICK_ID(v, i/B, j/B, b2);
+	off_t pos = v->index[id] + ((off_t)(i%B)*B + j%B)*B*sizeof(float);
+	int n = nb_samp - b2*B < B ? nb_samp - b2*B : B;
+	if( pwrite(v->fd, brick_fb+beg_trace+b2*B, n*sizeof(float), pos) != n*sizeof(float) )
+	    perror("bricks");
+	brick_written[id] = 1;
+    }
+}
+
+static void setup_bricks(buf)
+char *buf;
+{
+    char name[100];
+    BRICK_VOL *v = &brick_out;
+    long i, nb;
+    int k;
+
+    sscanf(buf, "%s %f %f %f %f %f %f %f %f %f", name,
+	   &cube_dim[0][0], &cube_dim[1][0], &cube_dim[2][0],
+	   &cube_dim[0][1], &cube_dim[1][1], &cube_dim[2][1],
+	   &cube_dim[0][2], &cube_dim[1][2], &cube_dim[2][2]);
+
+    memset(&v->hd, 0, sizeof(BRICK_HD));
+    memcpy(v->hd.magic, BRICK_MAGIC, 8);
+    v->hd.brick = BRICK_SIZE;
+    for( k = 0 ; k < 3 ; k++ ) {
+	v->hd.n[k] = grid(cube_dim[1][k]-cube_dim[0][k], cube_dim[2][k])+1;
+	v->hd.nb[k] = (v->hd.n[k] + BRICK_SIZE - 1) / BRICK_SIZE;
+	v->hd.first[k] = cube_dim[0][k];
+	v->hd.step[k] = cube_dim[2][k];
+    }
+    v->lg_brick = (size_t)BRICK_SIZE*BRICK_SIZE*BRICK_SIZE*sizeof(float);
+
+    nb = BRICK_NB(v);
+    v->hd.data_pos = sizeof(BRICK_HD) + nb*sizeof(long long);
+    v->hd.data_pos = (v->hd.data_pos + BRICK_ALIGN - 1) / BRICK_ALIGN * BRICK_ALIGN;
+    v->index = malloc(nb*sizeof(long long));
+    brick_written = calloc(nb, 1);
+    for( i = 0 ; i < nb ; i++ )
+	v->index[i] = v->hd.data_pos + i*(long long)v->lg_brick;
+
+    v->fd = open(name, O_RDWR|O_CREAT|O_TRUNC, 0666);
+    if( v->fd < 0 ) {
+	perror(name);
+	exit(1);
+    }
+    /* The bricks never written stay holes of the file */
+    if( ftruncate(v->fd, v->hd.data_pos + nb*(off_t)v->lg_brick) != 0 )
+	perror(name);
+    add_check(brick_write);
+}
+
+/* Write the header and the index, the empty bricks being marked 0 */
+
+static void close_bricks()
+{
+    BRICK_VOL *v = &brick_out;
+    long i, nb = BRICK_NB(v);
+    v->hd.sample_interval = process_samples ? sample_interval_out : sample_interval;
+    for( i = 0 ; i < nb ; i++ )
+	if( !brick_written[i] )
+	    v->index[i] = 0;
+    pwrite(v->fd, &v->hd, sizeof(BRICK_HD), 0);
+    pwrite(v->fd, v->index, nb*sizeof(long long), sizeof(BRICK_HD));
+    close(v->fd);
+}
+
+/*
+  Readers.  Sample ranges are in volume indices, lo included, hi excluded.
+  */
+
+static BRICK_VOL *brick_open(char *name)
+{
+    BRICK_VOL *v = calloc(1, sizeof(BRICK_VOL));
+    long nb;
+
+    v->fd = open(name, O_RDONLY);
+    if( v->fd < 0 || pread(v->fd, &v->hd, sizeof(BRICK_HD), 0) != sizeof(BRICK_HD)
+	|| memcmp(v->hd.magic, BRICK_MAGIC, 8) ) {
+	fprintf(stderr, "%s is not a bricked volume\n", name);
+	free(v);
+	return 0;
+    }
+    nb = BRICK_NB(v);
+    v->lg_brick = (size_t)v->hd.brick*v->hd.brick*v->hd.brick*sizeof(float);
+    v->index = malloc(nb*sizeof(long long));
+    pread(v->fd, v->index, nb*sizeof(long long), sizeof(BRICK_HD));
+    return v;
+}
+
+static void brick_close(BRICK_VOL *v)
+{
+    close(v->fd);
+    free(v->index);
+    free(v);
+}
+
+/* Read the box lo-hi in out, out[i][j][k] with k ( samples ) the fastest */
+
+static int brick_read_box(BRICK_VOL *v, int *lo, int *hi, float *out)
+{
+    int B = v->hd.brick;
+    int k, b0, b1, b2, bl[3], bh[3], sz[3];
+    float *tmp = malloc(v->lg_brick);
+
+    for( k = 0 ; k < 3 ; k++ ) {
+	if( lo[k] < 0 || hi[k] > v->hd.n[k] || lo[k] >= hi[k] ) {
+	    free(tmp);
+	    return -1;
+	}
+	bl[k] = lo[k] / B;
+	bh[k] = (hi[k] - 1) / B;
+	sz[k] = hi[k] - lo[k];
+    }
+
+    for( b0 = bl[0] ; b0 <= bh[0] ; b0++ )
+	for( b1 = bl[1] ; b1 <= bh[1] ; b1++ )
+	    for( b2 = bl[2] ; b2 <= bh[2] ; b2++ ) {
+		long long pos = v->index[BRICK_ID(v, b0, b1, b2)];
+		/* Part of the box in this brick, in brick coordinates */
+		int a0 = lo[0] > b0*B ? lo[0] - b0*B : 0;
+		int a1 = hi[0] < (b0+1)*B ? hi[0] - b0*B : B;
+		int c0 = lo[1] > b1*B ? lo[1] - b1*B : 0;
+		int c1 = hi[1] < (b1+1)*B ? hi[1] - b1*B : B;
+		int d0 = lo[2] > b2*B ? lo[2] - b2*B : 0;
+		int d1 = hi[2] < (b2+1)*B ? hi[2] - b2*B : B;
+		int a, c;
+		size_t lg = (size_t)(a1-a0)*B*B*sizeof(float);
+
+		if( pos == 0 )
+		    memset(tmp, 0, lg);
+		else if( pread(v->fd, tmp, lg, pos + (off_t)a0*B*B*sizeof(float)) != lg ) {
+		    free(tmp);
+		    return -1;
+		}
+		for( a = a0 ; a < a1 ; a++ )
+		    for( c = c0 ; c < c1 ; c++ ) {
+			int i = b0*B + a - lo[0], j = b1*B + c - lo[1];
+			memcpy(out + ((size_t)i*sz[1] + j)*sz[2] + b2*B + d0 - lo[2],
+			       tmp + ((size_t)(a-a0)*B + c)*B + d0,
+			       (d1-d0)*sizeof(float));
+		    }
+	    }
+    free(tmp);
+    return 0;
+}
+
+/* out[trace][sample] */
+static int brick_read_inline(BRICK_VOL *v, int il, float *out)
+{
+    int lo[3], hi[3];
+    lo[0] = il; hi[0] = il+1;
+    lo[1] = 0;  hi[1] = v->hd.n[1];
+    lo[2] = 0;  hi[2] = v->hd.n[2];
+    return brick_read_box(v, lo, hi, out);
+}
+
+/* out[line][sample] */
+static int brick_read_crossline(BRICK_VOL *v, int xl, float *out)
+{
+    int lo[3], hi[3];
+    lo[0] = 0;  hi[0] = v->hd.n[0];
+    lo[1] = xl; hi[1] = xl+1;
+    lo[2] = 0;  hi[2] = v->hd.n[2];
+    return brick_read_box(v, lo, hi, out);
+}
+
+/* out[line][trace] */
+static int brick_read_time_slice(BRICK_VOL *v, int is, float *out)
+{
+    int lo[3], hi[3];
+    lo[0] = 0;  hi[0] = v->hd.n[0];
+    lo[1] = 0;  hi[1] = v->hd.n[1];
+    lo[2] = is; hi[2] = is+1;
+    return brick_read_box(v, lo, hi, out);
+}
+
+/*
+  -brick_extract "volume what output" where what is
+  inline i, crossline i, time i or box i0 i1 j0 j1 k0 k1 ( hi excluded ),
+  anything else getting the usage.  The samples are written in native
+  floats.
+  */
+
+static int brick_extract(char *arg, char *prog)
+{
+    char name[500], what[20], out_name[500];
+    int lo[3], hi[3], idx, st, bad, axis = -1;
+    size_t nb;
+    float *out;
+    FILE *f;
+    BRICK_VOL *v;
+
+    if( sscanf(arg, "%499s %19s", name, what) != 2 )
+	what[0] = 0;
+    if( !strcmp(what, "inline") )
+	axis = 0;
+    else if( !strcmp(what, "crossline") )
+	axis = 1;
+    else if( !strcmp(what, "time") )
+	axis = 2;
+    if( !strcmp(what, "box") )
+	bad = sscanf(arg, "%*s %*s %d %d %d %d %d %d %499s", &lo[0], &hi[0],
+		     &lo[1], &hi[1], &lo[2], &hi[2], out_name) != 7;
+    else
+	bad = axis < 0 || sscanf(arg, "%*s %*s %d %499s", &idx, out_name) != 2;
+    if( bad ) {
+	fprintf(stderr, "Bad -brick_extract %s\n", arg);
+	fprintf(stderr, USAGE, prog);
+	return 1;
+    }
+    if( (v = brick_open(name)) == 0 )
+	return 1;
+    if( axis >= 0 ) {
+	int k;
+	for( k = 0 ; k < 3 ; k++ ) {
+	    lo[k] = 0;
+	    hi[k] = v->hd.n[k];
+	}
+	lo[axis] = idx;
+	hi[axis] = idx+1;
+    }
+
+    nb = (size_t)(hi[0]-lo[0])*(hi[1]-lo[1])*(hi[2]-lo[2]);
+    out = malloc(nb*sizeof(float));
+    if( !strcmp(what, "inline") )
+	st = brick_read_inline(v, lo[0], out);
+    else if( !strcmp(what, "crossline") )
+	st = brick_read_crossline(v, lo[1], out);
+    else if( !strcmp(what, "time") )
+	st = brick_read_time_slice(v, lo[2], out);
+    else
+	st = brick_read_box(v, lo, hi, out);
+    if( st != 0 )
+	fprintf(stderr, "Request out of the volume ( %d %d %d )\n",
+		v->hd.n[0], v->hd.n[1], v->hd.n[2]);
+    else if( (f = fopen(out_name, "w")) == 0 ) {
+	perror(out_name);
+	st = 1;
+    }
+    else {
+	fwrite(out, sizeof(float), nb, f);
+	fclose(f);
+    }
+    free(out);
+    brick_close(v);
+    return st != 0;
+}
+
+/*
+  Preview pyramid ( -pyramid "file [levels] [box or rms]" )
+
+  All the traces, in their order, make one section.  Level l ( 1 to
+  levels ) decimates it by 2^l along the traces and the samples, each value
+  being the mean ( box ) or the rms of the 2^l x 2^l input samples; a level
+  is built from the one below as the traces go by, so the input is read
+  once.  Each level is cut in tiles of PYR_TILE x PYR_TILE native floats,
+  samples fastest, written as soon as a column of tiles is full.  The
+  header and the index follow the tiles : for each level, the offset of
+  each tile, tile columns ( traces ) then tiles along the samples.
+  */
+
+#define PYR_TILE 256
+#define PYR_MAX_LEVELS 12
+#define PYR_MAGIC "SEGYPYR1"
+
+typedef struct pyr_hd {
+    char magic[8];
+    int tile;                   /* Edge of a tile in samples */
+    int nb_levels;
+    int rms;                    /* 0 for box, 1 for rms */
+    int nb_traces, nb_samples;  /* Full resolution */
+    int sample_interval;        /* In micro-seconds */
+    int n[PYR_MAX_LEVELS][2];   /* Traces and samples of each level */
+    int nb_tiles[PYR_MAX_LEVELS][2];
+    long long index_pos;        /* Offset of the index of the first level */
+    char unass[120];
+} PYR_HD;
+
+typedef struct pyr_level {
+    int ns;                     /* Samples of the level */
+    int nb_in;                  /* Traces of the level below in acc */
+    float *acc, *out;
+    int nb_col;                 /* Traces in the current column of tiles */
+    float *col;                 /* [sample tile][trace][sample] */
+    long long *index;
+    int nb_index;
+} PYR_LEVEL;
+
+static FILE *pyr_out = 0;
+static int pyr_wanted = 6;
+static PYR_HD pyr_hd;
+static PYR_LEVEL pyr_levels[PYR_MAX_LEVELS+1];  /* 1 to nb_levels */
+static float pyr_fb[MAX_SAMPLES];       /* pyr_trace() may run on its own thread */
+
+static void pyr_flush(int l)
+{
+    PYR_LEVEL *p = &pyr_levels[l];
+    int k, nb = pyr_hd.nb_tiles[l-1][1];
+    long long pos = ftello(pyr_out);
+    size_t lg = (size_t)PYR_TILE*PYR_TILE;
+
+    if( p->nb_col == 0 )
+	return;
+    if( fwrite(p->col, lg*sizeof(float), nb, pyr_out) != nb )
+	perror("pyramid");
+    p->index = realloc(p->index, (p->nb_index + nb)*sizeof(long long));
+    for( k = 0 ; k < nb ; k++ )
+	p->index[p->nb_index++] = pos + k*lg*sizeof(float);
+    pyr_hd.nb_tiles[l-1][0]++;
+    memset(p->col, 0, nb*lg*sizeof(float));
+    p->nb_col = 0;
+}
+
+static void pyr_push(int l, float *in);
+
+/* Reduce the traces in acc to one trace of the level */
+
+static void pyr_emit(int l)
+{
+    PYR_LEVEL *p = &pyr_levels[l];
+    int i, k, T = PYR_TILE, ns = p->ns;
+    float scale = 0.5 / p->nb_in;
+    float *acc = p->acc, *out = p->out;
+
+    for( i = 0 ; i < ns ; i++ )
+	out[i] = (acc[2*i] + acc[2*i+1]) * scale;
+    p->nb_in = 0;
+    if( l < pyr_hd.nb_levels )
+	pyr_push(l+1, out);
+    if( pyr_hd.rms )
+	for( i = 0 ; i < ns ; i++ )
+	    out[i] = sqrt(out[i]);
+    for( k = 0 ; k*T < ns ; k++ )
+	memcpy(p->col + ((size_t)k*T + p->nb_col)*T, out + k*T,
+	       (ns - k*T < T ? ns - k*T : T)*sizeof(float));
+    pyr_hd.n[l-1][0]++;
+    if( ++p->nb_col == T )
+	pyr_flush(l);
+}
+
+/* Add a trace of level l-1 ( mean squares for rms ) to level l */
+
+static void pyr_push(int l, float *in)
+{
+    PYR_LEVEL *p = &pyr_levels[l];
+    int i, n = 2*p->ns;
+    float *acc = p->acc;
+
+    if( p->nb_in++ == 0 )
+	memcpy(acc, in, n*sizeof(float));
+    else
+	for( i = 0 ; i < n ; i++ )
+	    acc[i] += in[i];
+    if( p->nb_in == 2 )
+	pyr_emit(l);
+}
+
+/* The levels are sized on the first trace */
+
+static void pyr_init(int ns)
+{
+    int l, T = PYR_TILE;
+
+    pyr_hd.nb_samples = ns;
+    for( l = 1 ; l <= pyr_wanted && l <= PYR_MAX_LEVELS && (ns >> l) > 0 ; l++ ) {
+	PYR_LEVEL *p = &pyr_levels[l];
+	p->ns = ns >> l;
+	pyr_hd.n[l-1][1] = p->ns;
+	pyr_hd.nb_tiles[l-1][1] = (p->ns + T - 1) / T;
+	p->acc = malloc(2*p->ns*sizeof(float));
+	p->out = malloc(p->ns*sizeof(float));
+	p->col = calloc((size_t)pyr_hd.nb_tiles[l-1][1]*T*T, sizeof(float));
+    }
+    pyr_hd.nb_levels = l-1;
+}
+
+static void pyr_trace(buf, lg, segy_hd)
+char *buf;
+int lg;
+SEGY_HD *segy_hd;
+{
+    SEGY_TR_HD *tr_hd = (SEGY_TR_HD*)buf;
+    int fmt = ntohs(segy_hd->data_form);
+    int i, n = (lg-240) / sample_size[fmt > 0 && fmt <= 5 ? fmt-1 : 0];
+    float weight = pow(2.0, (double)-(short)ntohs(tr_hd->tr_weigth));
+
+    if( n > MAX_SAMPLES )
+	n = MAX_SAMPLES;
+    if( pyr_hd.nb_traces++ == 0 )
+	pyr_init(n);
+    if( pyr_hd.nb_levels == 0 )
+	return;
+    if( n > pyr_hd.nb_samples )
+	n = pyr_hd.nb_samples;
+    decode_samples(buf+240, pyr_fb, n, fmt, weight);
+    for( i = n ; i < pyr_hd.nb_samples ; i++ )
+	pyr_fb[i] = 0;
+    if( pyr_hd.rms )
+	for( i = 0 ; i < n ; i++ )
+	    pyr_fb[i] *= pyr_fb[i];
+    pyr_push(1, pyr_fb);
+}
+
+static void setup_pyramid(char *buf)
+{
+    char *name = strtok(buf, " \t"), *p, *end;
+    long nb;
+
+    memset(&pyr_hd, 0, sizeof(PYR_HD));
+    memcpy(pyr_hd.magic, PYR_MAGIC, 8);
+    pyr_hd.tile = PYR_TILE;
+    if( name == 0 ) {
+	fprintf(stderr, "-pyramid : no file\n");
+	exit(1);
+    }
+    /* The number of levels and the mode, in any order */
+    while( (p = strtok(0, " \t")) != 0 ) {
+	nb = strtol(p, &end, 10);
+	if( end != p && *end == 0 && nb > 0 )
+	    pyr_wanted = nb;
+	else if( !strcmp(p, "rms") || !strcmp(p, "box") )
+	    pyr_hd.rms = p[0] == 'r';
+	else {
+	    fprintf(stderr, "-pyramid : %s is not a number of levels, box or rms\n", p);
+	    exit(1);
+	}
+    }
+
+    pyr_out = fopen(name, "w");
+    if( pyr_out == 0 ) {
+	perror(name);
+	exit(1);
+    }
+    /* The header is rewritten at the end */
+    fwrite(&pyr_hd, sizeof(PYR_HD), 1, pyr_out);
+    add_check(pyr_trace);
+}
+
+static void close_pyramid()
+{
+    int l;
+
+    /* The last odd traces, each level feeding the next one */
+    for( l = 1 ; l <= pyr_hd.nb_levels ; l++ )
+	if( pyr_levels[l].nb_in )
+	    pyr_emit(l);
+    for( l = 1 ; l <= pyr_hd.nb_levels ; l++ )
+	pyr_flush(l);
+
+    pyr_hd.index_pos = ftello(pyr_out);
+    for( l = 1 ; l <= pyr_hd.nb_levels ; l++ )
+	fwrite(pyr_levels[l].index, sizeof(long long), pyr_levels[l].nb_index, pyr_out);
+    pyr_hd.sample_interval = process_samples ? sample_interval_out : sample_interval;
+    fseek(pyr_out, 0, SEEK_SET);
+    fwrite(&pyr_hd, sizeof(PYR_HD), 1, pyr_out);
+    fclose(pyr_out);
+}
+
+/*
+  Coverage 
+  */
+
+static float get_value_from_header(char *p, int offset, int sz)
+{
+    p += offset;
+    if( sz == 2 ) {
+	short i;
+	memcpy(&i, p, 2);
+	return (float)i;
+    }
+    else if( sz == 4 ) {
+	int i;
+	memcpy(&i, p, 4);
+	return (float)i;
+    }
+    return 0.0;
+}
+
+static struct _cov {
+    int v[14];
+    FILE *file;
+} cov;
+
+static void write_coverage(buf, lg, segy_hd)
+char *buf;
+int lg;
+SEGY_HD *segy_hd;
+{
+    float b[7];
+    int i;
+    for( i = 0 ; i < 7 ; i++ )
+	b[i] = get_value_from_header(buf, cov.v[2*i], cov.v[2*i+1]);
+
+    fwrite(b, sizeof(float), 7, cov.file);
+}
+
+static void parse_coverage(char *p)
+{
+    int i;
+    SEGY_TR_HD *tr = 0;
+#define OFF(v) ((char*)&tr->v)-(char*)tr
+
+    char *file_name = strtok(p, " ");
+    cov.file = fopen(file_name, "w");
+    if( cov.file == 0 ) {
+	perror("fopen");
+	return;
+    }
+
+    cov.v[0] = OFF(src_X);
+    cov.v[1] = sizeof(tr->src_X);
+    cov.v[2] = OFF(src_Y);
+    cov.v[3] = sizeof(tr->src_Y);
+    cov.v[4] = OFF(grp_X);
+    cov.v[5] = sizeof(tr->grp_X);
+    cov.v[6] = OFF(grp_Y);
+    cov.v[7] = sizeof(tr->grp_Y);
+
+    for( i = 0 ; i < 14 ; i++ ) {
+	char *num = strtok(0, " ");
+	if( num == 0 )
+	    break;
+	cov.v[i] = atoi(num);
+    }
+	     
+    add_check(write_coverage);
+    check_trace_hd = write_coverage;
+    for( i = 0 ; i < 7 ; i++ )
+	if( cov.v[2*i] + cov.v[2*i+1] > 240 )
+	    check_trace_hd = 0;
+}
+
+/*
+  Compressed inputs ( gzip or zstd, known by their magic number )
+
+  The file is read through its decompressor, which runs in its own process
+  while the traces are processed : pigz when installed ( its inflate has
+  threads for the reading, the writing and the check ), else gzip, and
+  zstd.  The decompressor is run without a shell, on the file already
+  opened, and the pipe is enlarged so that it keeps ahead of the trace
+  loop.  A zstd file of several frames ( zstd -T0 --block-size, pzstd or
+  files put end to end ) is decompressed in parallel : its frame and block
+  headers are walked to cut it at frame boundaries in chunks of about
+  DECOMP_CHUNK bytes, each chunk is fed to its own zstd by one of -threads
+  workers and the outputs are given in order by a writer thread, through a
+  socket, at most two chunks per worker ahead of the trace loop.  A gzip
+  file, or a zstd file of one frame, has no such boundaries and keeps one
+  decompressor.  The exit status of the decompressors is checked when the
+  input is closed, only if it was read to its end : closing it before
+  ( -dump, -max_traces ... ) kills them.  Such an input cannot be seeked :
+  the -area index, the -where list, the header only reads and the
+  checkpoints are not used, and the disk only modes refuse it.
+  */
+
+#define DECOMP_PIPE_SIZE (1<<20)
+#if defined(__linux__) && !defined(F_SETPIPE_SZ)
+#define F_SETPIPE_SZ 1031
+#endif
+
+#define DECOMP_GZIP 1
+#define DECOMP_ZSTD 2
+
+#define DECOMP_CHUNK (4<<20)            /* Compressed bytes of a chunk */
+#define DECOMP_BLOCK (1<<16)            /* Feeding and reading unit */
+
+typedef struct dz_chunk {
+    off_t pos, lg;                      /* Its frames in the file */
+    char *out;                          /* Its decompressed bytes */
+    size_t nb_out;
+    int done, failed;
+} DZ_CHUNK;
+
+typedef struct dz_par {
+    int fd;                             /* The compressed file */
+    int sock;                           /* Writer end of the input */
+    DZ_CHUNK *chunk;
+    int nb_chunk;
+    int next;                           /* Next chunk to decompress */
+    int written;                        /* Chunks given to the trace loop */
+    int window;                         /* Chunks decompressed ahead */
+    volatile int stop;
+    int failed;
+    int nb_worker;
+    pthread_t *worker, writer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} DZ_PAR;
+
+typedef struct decomp {
+    FILE *file;                         /* Output of the decompressor */
+    pid_t pid;
+    DZ_PAR *par;                        /* Or of the parallel zstd */
+    char name[600];
+} DECOMP;
+
+static DECOMP decomp_in[2];             /* Current and next input */
+static int decomp_failed = 0;
+
+static int nb_chunks(off_t nb_traces);
+
+/* Kind of compression of a file, from its first bytes */
+
+static int compressed_magic(int fd)
+{
+    unsigned char magic[4];
+    int nb = pread(fd, magic, 4, 0);
+    if( nb >= 2 && magic[0] == 0x1f && magic[1] == 0x8b )
+	return DECOMP_GZIP;
+    if( nb == 4 && magic[0] == 0x28 && magic[1] == 0xb5
+	&& magic[2] == 0x2f && magic[3] == 0xfd )
+	return DECOMP_ZSTD;
+    return 0;
+}
+
+/*
+  Offsets of the chunks of a zstd file, cut at the first frame after
+  each DECOMP_CHUNK bytes; the skippable frames stay in their chunk.
+  Returns the number of chunks, 0 if the frames do not walk to the end
+  of the file ( zstd then says why ).
+  */
+
+static int zstd_chunks(int fd, off_t size, off_t **chunks)
+{
+    static int dict_lg[] = { 0, 1, 2, 4 };
+    unsigned char h[8];
+    off_t pos = 0, *c = 0;
+    int nb = 0;
+
+    while( pos < size ) {
+	unsigned long magic;
+	int fhd;
+	if( pread(fd, h, 8, pos) != 8 )
+	    break;
+	magic = h[0] | h[1] << 8 | (unsigned long)h[2] << 16 | (unsigned long)h[3] << 24;
+	if( (magic & 0xfffffff0) == 0x184d2a50 ) {
+	    pos += 8 + (h[4] | h[5] << 8 | (off_t)h[6] << 16 | (off_t)h[7] << 24);
+	    continue;
+	}
+	if( magic != 0xfd2fb528 )
+	    break;
+	if( nb == 0 || pos - c[nb-1] >= DECOMP_CHUNK ) {
+	    c = realloc(c, (nb+1)*sizeof(off_t));
+	    c[nb++] = pos;
+	}
+	/* Frame header : descriptor, window, dictionary id, content size */
+	fhd = h[4];
+	pos += 5 + !(fhd & 0x20) + dict_lg[fhd & 3]
+	    + ( fhd >> 6 == 0 ? (fhd & 0x20) != 0 : 1 << (fhd >> 6) );
+	for( ;; ) {
+	    long bh;
+	    if( pread(fd, h, 3, pos) != 3 )
+		break;
+	    bh = h[0] | h[1] << 8 | (long)h[2] << 16;
+	    if( (bh >> 1 & 3) == 3 )
+		break;
+	    /* A RLE block holds one byte */
+	    pos += 3 + ( (bh >> 1 & 3) == 1 ? 1 : bh >> 3 );
+	    if( bh & 1 )
+		break;
+	}
+	if( !(h[0] & 1) || (h[0] >> 1 & 3) == 3 )
+	    break;
+	if( fhd & 4 )
+	    pos += 4;           /* Checksum */
+    }
+    if( pos != size ) {
+	free(c);
+	return 0;
+    }
+    *chunks = c;
+    return nb;
+}
+
+/* Decompress one chunk with its own zstd, returns 0 if all went well */
+
+static int dz_run(DZ_PAR *z, DZ_CHUNK *c)
+{
+    static char *prog[] = { "zstd", "-dcq", 0 };
+    int in[2], out[2], status, nb, failed = 0;
+    char *ib;
+    size_t beg = 0, end = 0, size = 0;
+    off_t done = 0;
+    pid_t pid;
+
+    /* Sockets : no SIGPIPE if zstd goes away, and close on exec so that
+       the zstd of the other workers do not keep them open */
+    if( socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, in) != 0 )
+	return 1;
+    if( socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, out) != 0 ) {
+	close(in[0]);
+	close(in[1]);
+	return 1;
+    }
+    if( (pid = fork()) == 0 ) {
+	dup2(in[1], 0);
+	dup2(out[1], 1);
+	execvp(prog[0], prog);
+	_exit(127);
+    }
+    close(in[1]);
+    close(out[1]);
+    ib = malloc(DECOMP_BLOCK);
+    if( pid < 0 )
+	failed = 1;
+    while( !failed && !z->stop ) {
+	struct pollfd p[2];
+	p[0].fd = in[0];
+	p[0].events = POLLOUT;
+	p[1].fd = out[0];
+	p[1].events = POLLIN;
+	p[0].revents = p[1].revents = 0;
+	if( poll(p, 2, 100) < 0 && errno != EINTR )
+	    failed = 1;
+	else if( p[0].revents ) {
+	    if( beg == end ) {
+		nb = pread(z->fd, ib, c->lg - done < DECOMP_BLOCK ? c->lg - done : DECOMP_BLOCK,
+			   c->pos + done);
+		if( nb <= 0 )
+		    failed = 1;
+		else {
+		    done += nb;
+		    beg = 0;
+		    end = nb;
+		}
+	    }
+	    nb = failed ? -1 : send(in[0], ib + beg, end - beg, MSG_NOSIGNAL | MSG_DONTWAIT);
+	    if( nb > 0 )
+		beg += nb;
+	    if( (nb < 0 && errno != EAGAIN) || (beg == end && done == c->lg) ) {
+		/* All given, or zstd is gone and tells why by its status */
+		close(in[0]);
+		in[0] = -1;
+	    }
+	}
+	if( !failed && p[1].revents ) {
+	    if( c->nb_out + DECOMP_BLOCK > size )
+		c->out = realloc(c->out, size = 2*size + DECOMP_BLOCK);
+	    nb = read(out[0], c->out + c->nb_out, size - c->nb_out);
+	    if( nb == 0 )
+		break;
+	    if( nb < 0 && errno != EINTR )
+		failed = 1;
+	    if( nb > 0 )
+		c->nb_out += nb;
+	}
+    }
+    if( in[0] >= 0 )
+	close(in[0]);
+    close(out[0]);
+    free(ib);
+    if( pid > 0 ) {
+	if( failed || z->stop )
+	    kill(pid, SIGKILL);
+	if( waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+	    failed = 1;
+    }
+    return failed || done != c->lg;
+}
+
+static void *dz_worker(void *arg)
+{
+    DZ_PAR *z = (DZ_PAR*)arg;
+
+    pthread_mutex_lock(&z->lock);
+    while( !z->stop && z->next < z->nb_chunk ) {
+	DZ_CHUNK *c;
+	int failed;
+	if( z->next >= z->written + z->window ) {
+	    pthread_cond_wait(&z->cond, &z->lock);
+	    continue;
+	}
+	c = &z->chunk[z->next++];
+	pthread_mutex_unlock(&z->lock);
+	failed = dz_run(z, c);
+	pthread_mutex_lock(&z->lock);
+	c->failed = failed;
+	c->done = 1;
+	pthread_cond_broadcast(&z->cond);
+    }
+    pthread_mutex_unlock(&z->lock);
+    return 0;
+}
+
+/* Give the chunks in order, up to the first which failed */
+
+static void *dz_writer(void *arg)
+{
+    DZ_PAR *z = (DZ_PAR*)arg;
+    int k;
+
+    for( k = 0 ; k < z->nb_chunk && !z->stop ; k++ ) {
+	DZ_CHUNK *c = &z->chunk[k];
+	size_t pos = 0;
+	pthread_mutex_lock(&z->lock);
+	while( !c->done && !z->stop )
+	    pthread_cond_wait(&z->cond, &z->lock);
+	pthread_mutex_unlock(&z->lock);
+	if( z->stop )
+	    break;
+	while( pos < c->nb_out ) {
+	    int nb = send(z->sock, c->out + pos, c->nb_out - pos, MSG_NOSIGNAL);
+	    if( nb < 0 && errno == EINTR )
+		continue;
+	    if( nb <= 0 )
+		break;
+	    pos += nb;
+	}
+	free(c->out);
+	c->out = 0;
+	pthread_mutex_lock(&z->lock);
+	z->written = k+1;
+	if( c->failed )
+	    z->failed = 1;
+	/* A failed chunk, or the trace loop closed the input */
+	if( c->failed || pos < c->nb_out )
+	    z->stop = 1;
+	pthread_cond_broadcast(&z->cond);
+	pthread_mutex_unlock(&z->lock);
+    }
+    close(z->sock);
+    return 0;
+}
+
+/* The parallel zstd for a file of several chunks, 0 if not worth it */
+
+static FILE *open_zstd_par(FILE *file, DECOMP *d)
+{
+    struct stat st;
+    off_t *chunks;
+    int i, nb, sv[2];
+    DZ_PAR *z;
+
+    if( fstat(fileno(file), &st) != 0 )
+	return 0;
+    nb = zstd_chunks(fileno(file), st.st_size, &chunks);
+    if( nb < 2 || nb_chunks(nb) < 2 ) {
+	if( nb > 0 )
+	    free(chunks);
+	return 0;
+    }
+    if( socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0 ) {
+	free(chunks);
+	return 0;
+    }
+    z = calloc(1, sizeof(DZ_PAR));
+    z->fd = dup(fileno(file));
+    z->sock = sv[1];
+    z->nb_chunk = nb;
+    z->chunk = calloc(nb, sizeof(DZ_CHUNK));
+    for( i = 0 ; i < nb ; i++ ) {
+	z->chunk[i].pos = chunks[i];
+	z->chunk[i].lg = ( i+1 < nb ? chunks[i+1] : st.st_size ) - chunks[i];
+    }
+    free(chunks);
+    z->nb_worker = nb_chunks(nb);
+    z->window = 2*z->nb_worker;
+    z->worker = malloc(z->nb_worker*sizeof(pthread_t));
+    pthread_mutex_init(&z->lock, 0);
+    pthread_cond_init(&z->cond, 0);
+    for( i = 0 ; i < z->nb_worker ; i++ )
+	pthread_create(&z->worker[i], 0, dz_worker, z);
+    pthread_create(&z->writer, 0, dz_writer, z);
+    d->par = z;
+    d->pid = 0;
+    return fdopen(sv[0], "r");
+}
+
+/* Stop the parallel zstd, returns 1 if a chunk failed */
+
+static int close_zstd_par(DZ_PAR *z)
+{
+    int i, failed;
+
+    pthread_mutex_lock(&z->lock);
+    z->stop = 1;
+    pthread_cond_broadcast(&z->cond);
+    pthread_mutex_unlock(&z->lock);
+    pthread_join(z->writer, 0);
+    for( i = 0 ; i < z->nb_worker ; i++ )
+	pthread_join(z->worker[i], 0);
+    for( i = 0 ; i < z->nb_chunk ; i++ )
+	free(z->chunk[i].out);
+    failed = z->failed;
+    close(z->fd);
+    pthread_mutex_destroy(&z->lock);
+    pthread_cond_destroy(&z->cond);
+    free(z->worker);
+    free(z->chunk);
+    free(z);
+    return failed;
+}
+
+static FILE *open_input(char *name)
+{
+    static char *gz[][3] = { { "pigz", "-dc", 0 }, { "gzip", "-dc", 0 } };
+    static char *zst[][3] = { { "zstd", "-dcq", 0 } };
+    struct stat st;
+    FILE *file = fopen(name, "r");
+    DECOMP *d;
+    int kind, p[2];
+
+    compressed_in = 0;
+    if( file == 0 || fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode) )
+	return file;
+    kind = compressed_magic(fileno(file));
+    if( kind == 0 )
+	return file;
+    d = &decomp_in[decomp_in[0].file != 0];
+    d->par = 0;
+    strncpy(d->name, name, sizeof(d->name)-1);
+    compressed_in = 1;
+    if( kind == DECOMP_ZSTD && (d->file = open_zstd_par(file, d)) != 0 ) {
+	fclose(file);
+	return d->file;
+    }
+    if( pipe(p) != 0 || ( d->pid = fork() ) < 0 ) {
+	perror(name);
+	exit(1);
+    }
+    if( d->pid == 0 ) {
+	char *(*prog)[3] = kind == DECOMP_GZIP ? gz : zst;
+	int i, nb = kind == DECOMP_GZIP ? 2 : 1;
+	dup2(fileno(file), 0);
+	dup2(p[1], 1);
+	close(p[0]);
+	close(p[1]);
+	for( i = 0 ; i < nb ; i++ )
+	    execvp(prog[i][0], prog[i]);
+	fprintf(stderr, "%s : cannot run %s\n", name, prog[nb-1][0]);
+	_exit(127);
+    }
+    close(p[1]);
+    fclose(file);
+#ifdef F_SETPIPE_SZ
+    fcntl(p[0], F_SETPIPE_SZ, DECOMP_PIPE_SIZE);
+#endif
+    d->file = fdopen(p[0], "r");
+    return d->file;
+}
+
+/* The disk only modes ( -check, -verify, -diff, -patch ) pread the file */
+
+static int is_compressed(int fd, char *name, char *mode)
+{
+    if( compressed_magic(fd) == 0 )
+	return 0;
+    fprintf(stderr, "%s cannot read the compressed file %s\n", mode, name);
+    return 1;
+}
+
+/* Nothing left to read : the decompressor closed its end */
+
+static int input_at_end(FILE *file)
+{
+    char c;
+    if( feof(file) )
+	return 1;
+    fcntl(fileno(file), F_SETFL, fcntl(fileno(file), F_GETFL) | O_NONBLOCK);
+    return read(fileno(file), &c, 1) == 0;
+}
+
+/*
+  A decompressor which did not end well makes the copy fail, if the input
+  was read to its end : before, it gets SIGPIPE or a write error when the
+  input is closed
+  */
 
-		int w = -(ntohs(tr_hd->tr_weigth));
-	float weight = pow(2.0, (double)w);
+static void close_input(FILE *file)
+{
+    int i, status, end, failed;
+    for( i = 0 ; i < 2 ; i++ )
+	if( decomp_in[i].file == file ) {
+	    decomp_in[i].file = 0;
+	    end = input_at_end(file);
+	    fclose(file);
+	    if( decomp_in[i].par )
+		failed = close_zstd_par(decomp_in[i].par);
+	    else
+		failed = waitpid(decomp_in[i].pid, &status, 0) != decomp_in[i].pid
+		    || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+	    decomp_in[i].par = 0;
+	    if( end && failed ) {
+		fprintf(stderr, "%s : decompression failed\n", decomp_in[i].name);
+		decomp_failed = 1;
+	    }
+	    return;
+	}
+    fclose(file);
+}
 
-	skip_read = 0;
-	if(DEBUG)fprintf(stderr, "Number of samples %d\n", tr_nb_samples);
+FILE *open_multiple_input()
+{
+    FILE *file;
+    char buffer[600];
+    range++;
+    sprintf(buffer, "%s%d", multiple_input, range);
+    file = open_input(buffer);
+    return file;
+}
 
-        if( nb_samples_error < 5 && tr_nb_samples != nb_samples ) {
-            fprintf(stderr, "Number of samples not correct %d ( expect %d )\n",
-                    tr_nb_samples, nb_samples);
-            nb_samples_error++;
-        }
+/*
+  Parallel validation ( -check )
 
-	/* In any case, set the trace number of samples to the header */
-		tr_hd->nb_samples = htons(nb_samples);
+  The traces of a disk file all have the length lg_tr, so the file is cut
+  in trace aligned chunks, one per thread.  Each thread preads its chunk
+  by large blocks and counts the errors; the partial reports are then
+  merged in file order, the sequence numbers being checked across the
+  chunk boundaries.
+  */
 
-        /* Dump sp informations if needed */
-        
-        if( file_dump_sp ) {
-	    union { float v; int i; } res;
-            int sp1, esp, ntr, ncdp;
-	    int n_field,
-	      n_tr ,
-	      n_esp ,
-	      n_cdp ,
-	      n_st ,
-	      n_off ,
-	      n_xs ,
-	      n_ys , 
-	      n_xg , 
-	      n_yg,
-	      n_stnu ,
-	      n_stnuso ,
-	      n_stnure, 
-	      n_line, 
-	      n_spnu;
-	    float  n_wb,
-	      n_line2,
-	      n_spnu2,
-	      n_xm,
-	      n_ym,
-	      n_xs2,
-	      n_ys2,
-	      n_xg2,
-	      n_yg2;
+#define CHK_NB_SAMPLES  0
+#define CHK_SAMPLING    1
+#define CHK_SEQ_REEL    2
+#define CHK_SEQ_LINE    3
+#define CHK_TRACE_ID    4
+#define CHK_SCALER      5
+#define CHK_SHORT_READ  6
+#define CHK_NB          7
+
+#define CHK_MAX_EXAMPLES 10
+#define CHK_BLOCK_SIZE  (8<<20)
+
+static char *chk_names[CHK_NB] = {
+    "number of samples not equal to binary header",
+    "sample interval not equal to binary header",
+    "trace sequence number in reel not increasing",
+    "trace sequence number in line not increasing",
+    "trace identification code not plausible",
+    "coordinate or elevation scaler not plausible",
+    "read error or short read"
+};
+
+static int nb_threads = 0;
+
+typedef struct chk_part {
+    int fd;
+    size_t lg_tr;
+    off_t first, nb;            /* Trace range of the chunk */
+    short nb_samples, sampling;
+    long long count[CHK_NB];
+    int nb_example[CHK_NB];
+    long long ex_trace[CHK_NB][CHK_MAX_EXAMPLES];
+    int ex_value[CHK_NB][CHK_MAX_EXAMPLES];
+    int seq_rel_first, seq_rel_last;
+    int seq_lin_first, seq_lin_last;
+} CHK_PART;
+
+static void chk_error(CHK_PART *part, int type, long long trace, int value)
+{
+    int n = part->nb_example[type];
+    part->count[type]++;
+    if( n < CHK_MAX_EXAMPLES ) {
+	part->ex_trace[type][n] = trace;
+	part->ex_value[type][n] = value;
+	part->nb_example[type]++;
+    }
+}
 
-	    n_field = ntohl(tr_hd->field_rec);
-	    n_tr = ntohl(tr_hd->tracnb_fld);
-	    n_esp = ntohl(tr_hd->esp);
-	    n_cdp = ntohl(tr_hd->cdp_ens);
-	    n_st = ntohs(tr_hd->nbhst);
-	    n_off = ntohl(tr_hd->srdist);
-	    n_xs = ntohl(tr_hd->src_X);
-	    n_ys = ntohl(tr_hd->src_Y);
-	    n_xg = ntohl(tr_hd->grp_X);
-	    n_yg = ntohl(tr_hd->grp_Y);
-	    n_stnu = ntohl(tr_hd->statnu_mid);
-	    n_stnuso = ntohl(tr_hd->statnu_so);
-	    n_stnure = ntohl(tr_hd->statnu_rec);
-	    n_line = ntohs(tr_hd->line_nu);
-	    n_spnu = ntohl(tr_hd->sp_nu);
-	    n_wb = ntohl(tr_hd->wat_bot_mid);
-	    n_line2 = ntohl(tr_hd->line_nu2);
-	    n_spnu2 = ntohl(tr_hd->sp_nu2);
-	    n_xm = ntohl(tr_hd->X_mid);
-	    n_ym = ntohl(tr_hd->Y_mid);
-	    /*  n_xs2 = ntohl(tr_hd->X_s); */
-	    n_ys2 = ntohl(tr_hd->Y_s);
-	    n_xg2 = ntohl(tr_hd->X_g);
-	  n_yg2 = ntohl(tr_hd->Y_g);
-	    
-            fprintf(file_dump_sp, "%d %d %d %d %d %d %d %d %d %d %d %d %d %d %d  \n", 
-		    n_field,
-		    n_tr ,
-		    n_esp ,
-		    n_cdp ,
-		    n_st ,
-		    n_off ,
-		    n_xs ,
-		    n_ys , 
-		    n_xg , 
-		    n_yg ,
-                    n_stnu ,
-		    n_stnuso ,
-		    n_stnure, 
-		    n_line, 
-		    n_spnu );
-/* 	      	    n_wb, */
-/* 		    n_line2, */
-/* 		    n_spnu2, */
-/* 		    n_xm, */
-/* 		    n_ym, */
-/* 		    n_xs2, */
-/* 		    n_ys2, */
-/* 		    n_xg2, */
-/* 		    n_yg2  */
-/* 		    );  */
-        }
-        
-        /* If the read trace is too short, pad it with 0 */
+static int scaler_is_plausible(int v)
+{
+    if( v < 0 )
+	v = -v;
+    return v == 0 || v == 1 || v == 10 || v == 100 || v == 1000 || v == 10000;
+}
 
-        if( nb < lg_tr ) {
-            int i;
-            for( i = nb ; i < lg_tr ; i++ )
-                buf[i] = 0;
-        }
+static void *chk_thread(void *arg)
+{
+    CHK_PART *part = (CHK_PART*)arg;
+    size_t nb_block = CHK_BLOCK_SIZE / part->lg_tr;
+    char *block;
+    off_t tr = 0;
+    int prev_rel = 0, prev_lin = 0;
+
+    if( nb_block == 0 )
+	nb_block = 1;
+    block = malloc(nb_block * part->lg_tr);
+    if( block == 0 ) {
+	chk_error(part, CHK_SHORT_READ, part->first, 0);
+	return 0;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(part->fd, (off_t)3600 + part->first*part->lg_tr,
+		  part->nb*part->lg_tr, POSIX_FADV_SEQUENTIAL);
+#endif
 
-	/* Check if the trace is in the wanted area */
+    while( tr < part->nb ) {
+	size_t i, nb_tr_block = part->nb - tr < nb_block ? part->nb - tr : nb_block;
+	size_t lg = nb_tr_block * part->lg_tr;
+	off_t pos = (off_t)3600 + (part->first + tr) * part->lg_tr;
+	ssize_t nb = pread(part->fd, block, lg, pos);
+
+	if( nb != lg ) {
+	    chk_error(part, CHK_SHORT_READ, part->first + tr, (int)nb);
+	    if( nb <= 0 )
+		break;
+	    nb_tr_block = nb / part->lg_tr;
+	}
 
-	if( !trace_is_in_area(tr_hd) )
-	    continue;
+	for( i = 0 ; i < nb_tr_block ; i++ ) {
+	    SEGY_TR_HD *tr_hd = (SEGY_TR_HD*)(block + i*part->lg_tr);
+	    long long index = part->first + tr + i + 1;
+	    int seq_rel = ntohl(tr_hd->traseqrel);
+	    int seq_lin = ntohl(tr_hd->traseqlin);
+	    short v;
+
+	    if( (v = ntohs(tr_hd->nb_samples)) != part->nb_samples )
+		chk_error(part, CHK_NB_SAMPLES, index, v);
+	    if( part->sampling != 0
+		&& (v = ntohs(tr_hd->sampling)) != part->sampling )
+		chk_error(part, CHK_SAMPLING, index, v);
+	    if( (v = ntohs(tr_hd->trace_id)) < -1 || v > 9 )
+		chk_error(part, CHK_TRACE_ID, index, v);
+	    if( !scaler_is_plausible(v = ntohs(tr_hd->scaler_cor)) ||
+		!scaler_is_plausible(v = ntohs(tr_hd->scaler_dep)) )
+		chk_error(part, CHK_SCALER, index, v);
+
+	    if( tr + i == 0 ) {
+		part->seq_rel_first = seq_rel;
+		part->seq_lin_first = seq_lin;
+	    }
+	    else {
+		if( seq_rel <= prev_rel )
+		    chk_error(part, CHK_SEQ_REEL, index, seq_rel);
+		/* A new line restarts at 1 */
+		if( seq_lin <= prev_lin && seq_lin != 1 )
+		    chk_error(part, CHK_SEQ_LINE, index, seq_lin);
+	    }
+	    prev_rel = seq_rel;
+	    prev_lin = seq_lin;
+	}
+	tr += nb_tr_block;
+	if( nb != lg )
+	    break;
+    }
+    part->seq_rel_last = prev_rel;
+    part->seq_lin_last = prev_lin;
+    free(block);
+    return 0;
+}
 
-        if( fdout != 0 || check_trace != 0 ) {
-            if( output_fmt == -1 ||
-		output_fmt == data_format ) {
+/* Merge the report of part into total, the parts being given in file order */
 
-		if ( skip_tr == 0 ){
-		  if ( cdpfirst == -1 ) cdpfirst = ntohl(tr_hd->cdp_ens);
-		  cdplast = ntohl(tr_hd->cdp_ens);
-		  nb_written_traces++;
-		  write_and_check(fdout, buf, (size_t) lg_tr);
-		  CHECK_SPLIT(fdout);
-		  if( check_trace )
-		    (*check_trace)(buf, lg_tr, &segy_hd);
-		}
-		else
-		  skip_tr--;
+static void chk_merge(CHK_PART *total, CHK_PART *part)
+{
+    int i, j;
+    for( i = 0 ; i < CHK_NB ; i++ ) {
+	total->count[i] += part->count[i];
+	for( j = 0 ; j < part->nb_example[i] ; j++ )
+	    if( total->nb_example[i] < CHK_MAX_EXAMPLES ) {
+		int n = total->nb_example[i]++;
+		total->ex_trace[i][n] = part->ex_trace[i][j];
+		total->ex_value[i][n] = part->ex_value[i][j];
 	    }
-            else {  /* output_fmt != data_format */
-                bcopy(buf, out_buf, 240);
-                switch(output_fmt) {
-                    case 1: /* output floating ibm */
-                    {
-                        switch(data_format) {
-                            case 2: /* integer format */
-                            {
-                                int i, *p = (int*)(buf+240);
-                                for( i = 0 ; i < nb_samples ; i++ )
-								  fb[i] = ntohl(p[i]);
-                                break;
-                            }
-                            case 3: /* two-bytes format */
-                            {
-                                short *p = (short*)(buf+240);
-                                int i;
-				                for( i = 0 ; i < nb_samples ; i++ ) {
-				                   int vv = (short)ntohs(p[i]);
-				                   fb[i] = ((float)(vv))*weight;
-				                }
-				                break;
-                            }
-			                case 5: /* ieee format */
-			                {
-				                float *p = (float*)(buf+240);
-				                int i;
-                                for( i = 0 ; i < nb_samples ; i++ )
-                                    fb[i] = p[i];
-                                break;
-                            }
-                        }
-			
-                        /*  convert fb in ibm format */
+    }
+}
 
-			            ieee2ibm( fb, out_buf+240, nb_samples);
-			            break;
-                    }
-                    case 2: /* output data integer */
-                    {
-                        switch(data_format) {
-                            case 3: /*  two-bytes integer  */
-                            {
-                                short *p = (short*)(buf+240);
-                                int i, *pp = (int*)(out_buf+240);
-                                for( i = 0 ; i < nb_samples ; i++ )
-                                    pp[i] = p[i];
-                            }
-                        }
-			            break;
-                    }
-		            case 5: /* output floating ieee ( native ) */
-		            {
-			            switch(data_format) {
-			                case 1: /* floating point ibm */
-			                {
-				                /* convert ibm to ieee  */
-				
-				                ibm2ieee(buf+240, out_buf+240, nb_samples);
-				                break;
-			                }				
-                            case 2: /* integer format */
-                            {
-                                int i, *p = (int*)(buf+240);
-				                float *pf = (float*)(out_buf+240);
-                                for( i = 0 ; i < nb_samples ; i++ )
-                                    pf[i] = p[i];
-                                break;
-                            }
-                            case 3: /* two-bytes format */
-                            {
-                                short *p = (short*)(buf+240);
-                                int i;
-				                float *pf = (float*)(out_buf+240);
-                                for( i = 0 ; i < nb_samples ; i++ )
-                                    pf[i] = p[i];
-                                break;
-                            }
-                        }
-		            }
-                }
-		if( fdout )
-		  if ( skip_tr == 0 ){
-		    write_and_check(fdout, out_buf, (size_t) lg_tr_out);
-		    nb_written_traces++;
-		    CHECK_SPLIT(fdout);
-		    if( check_trace )
-		      (*check_trace)(out_buf, lg_tr_out, &segy_hd);
-		  }
-		  else
-		    skip_tr --;
-            }
+/* Number of chunks of a parallel scan */
 
-	    if( max_written_traces > 0 &&
-		nb_written_traces >= max_written_traces)
-	      exit(1);
-	    /*		return -1; */
-        }
+static int nb_chunks(off_t nb_traces)
+{
+    int nb = nb_threads;
+    if( nb <= 0 )
+	nb = sysconf(_SC_NPROCESSORS_ONLN);
+    if( nb <= 0 )
+	nb = 1;
+    if( nb > nb_traces )
+	nb = nb_traces > 0 ? nb_traces : 1;
+    return nb;
+}
 
-#if 0
-	// IDB's mess
-	try_count=0;
-	if ( nb=READ(fdin, buf,8) > 0 ){
-	  while (1) {
-	    SEGY_TR_HD *tr_tmp_hd = (SEGY_TR_HD*)buf;
-	    int test_trace=ntohl(tr_tmp_hd->traseqlin);   
-	    int test_trace2=ntohl(tr_tmp_hd->traseqrel);
-	    if(DEBUG)fprintf(stderr, "%d: traseqlin %d, traseqrel %d\n",__LINE__, test_trace,test_trace2 );
-	    if (test_trace > 0 && test_trace < 100 && test_trace2 == current_trace && try_count > 410 ) goto continue_trace;
-	    if ( nb=READ(fdin, buf,8) <= 0) goto finished;
-	    try_count++;
-	  }
-	}
-	else 
-	  goto finished;
-    continue_trace:
-	current_trace++;	
-#endif
+static int check_file(char *name, FILE *file_info)
+{
+    int fd, i, nb_part;
+    struct stat st;
+    off_t nb_traces, tail;
+    CHK_PART *parts, total;
+    pthread_t *threads;
+    short data_fmt, bps;
+    long long nb_errors = 0;
+
+    fd = open(name, O_RDONLY);
+    if( fd < 0 || fstat(fd, &st) != 0 ) {
+	perror(name);
+	return -1;
+    }
+    if( !S_ISREG(st.st_mode) ) {
+	fprintf(stderr, "-check needs a disk file, %s is not\n", name);
+	return -1;
+    }
+    if( is_compressed(fd, name, "-check") )
+	return -1;
+    if( pread(fd, &segy_hd, 400, (off_t)3200) != 400 ) {
+	fprintf(file_info, "Binary Header not of size 400\n");
+	return -1;
+    }
+    if( dump_hd )
+	dump_segy_hd(&segy_hd, file_info);
+
+    memset(&total, 0, sizeof(total));
+    total.nb_samples = ntohs(segy_hd.nb_samples);
+    total.sampling = ntohs(segy_hd.sampling);
+    data_fmt = ntohs(segy_hd.data_form);
+    bps = data_fmt == 3 ? 2 : 4;
+    total.lg_tr = 240 + total.nb_samples * bps;
+    nb_traces = (st.st_size - 3600) / total.lg_tr;
+    tail = (st.st_size - 3600) % total.lg_tr;
+
+    /* nb_part <= nb_traces : no chunk is empty but with no trace at all */
+    nb_part = nb_chunks(nb_traces);
+
+    parts = calloc(nb_part, sizeof(CHK_PART));
+    threads = calloc(nb_part, sizeof(pthread_t));
+    for( i = 0 ; i < nb_part ; i++ ) {
+	parts[i].fd = fd;
+	parts[i].lg_tr = total.lg_tr;
+	parts[i].nb_samples = total.nb_samples;
+	parts[i].sampling = total.sampling;
+	parts[i].first = nb_traces * i / nb_part;
+	parts[i].nb = nb_traces * (i+1) / nb_part - parts[i].first;
+	pthread_create(&threads[i], 0, chk_thread, &parts[i]);
     }
 
-    if( nb < 0 ) {
-        perror("Reading Tape");
+    for( i = 0 ; i < nb_part ; i++ ) {
+	pthread_join(threads[i], 0);
+	/* Sequence numbers across the boundary with the previous chunk */
+	if( i > 0 && parts[i].nb > 0 && parts[i-1].nb > 0 ) {
+	    if( parts[i].seq_rel_first <= parts[i-1].seq_rel_last )
+		chk_error(&parts[i-1], CHK_SEQ_REEL, parts[i].first + 1,
+			  parts[i].seq_rel_first);
+	    if( parts[i].seq_lin_first <= parts[i-1].seq_lin_last
+		&& parts[i].seq_lin_first != 1 )
+		chk_error(&parts[i-1], CHK_SEQ_LINE, parts[i].first + 1,
+			  parts[i].seq_lin_first);
+	}
+	if( i > 0 )
+	    chk_merge(&total, &parts[i-1]);
+    }
+    chk_merge(&total, &parts[nb_part-1]);
+
+    fprintf(file_info, "File %s : %lld traces of %d bytes ( %d samples, format %d ), %d threads\n",
+	    name, (long long)nb_traces, (int)total.lg_tr, total.nb_samples,
+	    data_fmt, nb_part);
+    if( tail != 0 ) {
+	fprintf(file_info, "Trace length error : %d trailing bytes after the last trace\n",
+		(int)tail);
+	nb_errors++;
+    }
+    for( i = 0 ; i < CHK_NB ; i++ ) {
+	int j;
+	if( total.count[i] == 0 )
+	    continue;
+	nb_errors += total.count[i];
+	fprintf(file_info, "%lld traces : %s\n", total.count[i], chk_names[i]);
+	for( j = 0 ; j < total.nb_example[i] ; j++ )
+	    fprintf(file_info, "    trace %lld : %d\n", total.ex_trace[i][j],
+		    total.ex_value[i][j]);
     }
-    finished:
-    segy_hd.data_form = htons(data_format);
+    fprintf(file_info, "Total number of errors %lld\n", nb_errors);
 
-    return nb;
+    free(parts);
+    free(threads);
+    close(fd);
+    return nb_errors != 0;
 }
 
-#define SED_STRING \
-" |\
-sed 's/\\(.*\\)-o[ ]*\\([^ :]*\\):\\([^ ]*\\)\\(.*\\)/\\1 -o - \\4 | \
- rsh \\2 cp_segy -i - -o \\3/\n\
-s/\\(.*\\)-i[ ]*\\([^ :]*\\):\\([^ ]*\\)\\(.*\\)/rsh \\2 $CP_SEGY -i \\3 -o - | \
-\\1 -i - \\4/'"
+/*
+  Verification of a file against its checksum sidecar ( -verify ), by
+  trace aligned chunks as for -check.
+  */
 
-void exec_remote(argc, argv)
-int     argc;
-char    *argv[];
-{
-    char *str;
-    FILE *file;
-    int i;
-    strcpy(buf, "echo cp_segy ");
-    str = buf+strlen(buf);
+typedef struct vfy_part {
+    int fd, fd_crc;
+    size_t lg_tr;
+    off_t first, nb;
+    long long nb_bad;
+    int nb_example;
+    long long example[CHK_MAX_EXAMPLES];
+} VFY_PART;
 
-    for( i = 1 ; i < argc ; i++ ) {
-        char *ptr = argv[i];
-        while( *ptr )
-            *str++ = *ptr++;
-        *str++ = ' ';
+static void *vfy_thread(void *arg)
+{
+    VFY_PART *part = (VFY_PART*)arg;
+    size_t nb_block = CHK_BLOCK_SIZE / part->lg_tr;
+    char *block;
+    unsigned *crc;
+    off_t tr = 0;
+
+    if( nb_block == 0 )
+	nb_block = 1;
+    block = malloc(nb_block * part->lg_tr);
+    crc = malloc(nb_block * sizeof(unsigned));
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(part->fd, (off_t)3600 + part->first*part->lg_tr,
+		  part->nb*part->lg_tr, POSIX_FADV_SEQUENTIAL);
+#endif
+    while( tr < part->nb ) {
+	size_t i, n = part->nb - tr < nb_block ? part->nb - tr : nb_block;
+	off_t first = part->first + tr;
+	ssize_t lg = pread(part->fd, block, n * part->lg_tr, (off_t)3600 + first*part->lg_tr);
+	ssize_t lg_crc = pread(part->fd_crc, crc, n * sizeof(unsigned),
+			       sizeof(CRC_HD) + first*sizeof(unsigned));
+	for( i = 0 ; i < n ; i++ ) {
+	    int ok = (i+1)*part->lg_tr <= lg && (i+1)*sizeof(unsigned) <= lg_crc
+		&& crc32c(0, block + i*part->lg_tr, part->lg_tr) == crc[i];
+	    if( !ok ) {
+		if( part->nb_example < CHK_MAX_EXAMPLES )
+		    part->example[part->nb_example++] = first + i + 1;
+		part->nb_bad++;
+	    }
+	}
+	tr += n;
     }
-
-    strcpy(str, SED_STRING);
-    file = popen(buf, "r");
-    i = fread(buf, 1, 1000, file);
-    pclose(file);
-    buf[i] = 0;
-    fprintf(stderr, "Going to execute \"%s\"\n", buf);
-    execl("/bin/sh", "/bin/sh", "-c", buf, 0);
+    free(block);
+    free(crc);
+    return 0;
 }
 
+static int verify_file(char *name, char *crc_name, FILE *file_info)
+{
+    int fd, fd_crc, i, j, nb_part, nb_shown = 0;
+    struct stat st;
+    CRC_HD hd;
+    char headers[3600];
+    off_t nb_traces, per_part;
+    VFY_PART *parts;
+    pthread_t *threads;
+    long long nb_bad = 0;
+
+    fd = open(name, O_RDONLY);
+    fd_crc = open(crc_name, O_RDONLY);
+    if( fd < 0 || fd_crc < 0 || fstat(fd, &st) != 0 ) {
+	perror(fd < 0 ? name : crc_name);
+	return -1;
+    }
+    if( is_compressed(fd, name, "-verify") )
+	return -1;
+    if( pread(fd_crc, &hd, sizeof(hd), 0) != sizeof(hd) || memcmp(hd.magic, CRC_MAGIC, 8) ) {
+	fprintf(stderr, "%s is not a checksum file\n", crc_name);
+	return -1;
+    }
+    /* Header left as set up when the copy did not end */
+    if( hd.lg_tr < 240 || hd.lg_tr > MAX_SIZE || hd.nb_traces < 0 ) {
+	fprintf(stderr, "%s was not closed : trace length %u, %lld traces\n",
+		crc_name, hd.lg_tr, hd.nb_traces);
+	return -1;
+    }
 
-static float cube_dim[3][3];
-static FILE *cube_out = 0;
+    if( pread(fd, headers, 3600, 0) != 3600
+	|| crc32c(crc32c(0, headers, 3200), headers+3200, 400) != hd.hd_crc ) {
+	fprintf(file_info, "Tape headers differ\n");
+	nb_bad++;
+    }
+    nb_traces = hd.lg_tr ? (st.st_size - 3600) / hd.lg_tr : 0;
+    if( nb_traces != hd.nb_traces || st.st_size != 3600 + hd.nb_traces*hd.lg_tr ) {
+	fprintf(file_info, "File has %lld bytes, expected %lld ( %lld traces of %d bytes )\n",
+		(long long)st.st_size, 3600 + hd.nb_traces*hd.lg_tr, hd.nb_traces, hd.lg_tr);
+	nb_bad++;
+	if( nb_traces > hd.nb_traces )
+	    nb_traces = hd.nb_traces;
+    }
 
-#define grid(x,s) ((int)((x)/(s)+0.5))
+    nb_part = nb_chunks(nb_traces);
+    per_part = (nb_traces + nb_part - 1) / nb_part;
+    parts = calloc(nb_part, sizeof(VFY_PART));
+    threads = calloc(nb_part, sizeof(pthread_t));
+    for( i = 0 ; i < nb_part ; i++ ) {
+	parts[i].fd = fd;
+	parts[i].fd_crc = fd_crc;
+	parts[i].lg_tr = hd.lg_tr;
+	parts[i].first = i * per_part;
+	parts[i].nb = nb_traces - parts[i].first < per_part ?
+	    nb_traces - parts[i].first : per_part;
+	if( parts[i].nb < 0 )
+	    parts[i].nb = 0;
+	pthread_create(&threads[i], 0, vfy_thread, &parts[i]);
+    }
+    for( i = 0 ; i < nb_part ; i++ ) {
+	pthread_join(threads[i], 0);
+	nb_bad += parts[i].nb_bad;
+	for( j = 0 ; j < parts[i].nb_example && nb_shown < CHK_MAX_EXAMPLES ; j++, nb_shown++ )
+	    fprintf(file_info, "Trace %lld differs\n", parts[i].example[j]);
+    }
+    fprintf(file_info, "%s : %lld traces verified, %lld errors\n", name,
+	    (long long)nb_traces, nb_bad);
+
+    free(parts);
+    free(threads);
+    close(fd);
+    close(fd_crc);
+    return nb_bad != 0;
+}
 
-static void cube_write(buf, lg, segy_hd)
-char *buf;
-int lg;
-SEGY_HD *segy_hd;
+/*
+  Comparison of the input with another file ( -diff ), by trace aligned
+  chunks as for -check.  Identical traces are skipped after a memcmp; for
+  the others the header fields which differ are counted by name and the
+  samples of both traces are decoded and compared, a trace differing when
+  an error is above the tolerance.  The relative error is the error over
+  the peak amplitude of the trace of the input.
+  */
+
+typedef struct diff_part {
+    int fd1, fd2;
+    int fmt1, fmt2;
+    size_t lg1, lg2;
+    off_t first, nb;
+    double tol;
+    long long nb_diff, nb_hd, nb_samp;
+    long long *field_count;     /* One per tr_fields */
+    double max_abs, max_rel;
+    int max_example, nb_example;
+    long long *ex_trace;
+    int *ex_what;               /* 1 header, 2 samples */
+    double *ex_err;
+} DIFF_PART;
+
+static void *diff_thread(void *arg)
 {
-    SEGY_TR_HD *tr_hd = (SEGY_TR_HD*)buf;
-    int nb_traces = grid(cube_dim[1][1]-cube_dim[0][1], cube_dim[2][1])+1;
-    int nb_samp = grid(cube_dim[1][2]-cube_dim[0][2], cube_dim[2][2])+1;
-    unsigned long pos;
-    int sample_size = 4;
-    int line_number = ntohl(tr_hd->grp_X); /* field_rec; segy_hd->line_number;*/
-    int tr_number = ntohl(tr_hd->grp_Y); /* tracnb_fld; tr_hd->cdp_ens */
-    int beg_trace = grid(cube_dim[0][2], cube_dim[2][2]);
+    DIFF_PART *part = (DIFF_PART*)arg;
+    size_t lg = part->lg1 > part->lg2 ? part->lg1 : part->lg2;
+    size_t nb_block = CHK_BLOCK_SIZE / lg;
+    int ns1 = (part->lg1-240) / sample_size[part->fmt1-1];
+    int ns2 = (part->lg2-240) / sample_size[part->fmt2-1];
+    int ns = ns1 < ns2 ? ns1 : ns2;
+    char *block1, *block2;
+    float *f1, *f2;
+    off_t tr = 0;
+
+    if( nb_block == 0 )
+	nb_block = 1;
+    block1 = malloc(nb_block * part->lg1);
+    block2 = malloc(nb_block * part->lg2);
+    f1 = malloc(ns * sizeof(float) + 1);
+    f2 = malloc(ns * sizeof(float) + 1);
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(part->fd1, (off_t)3600 + part->first*part->lg1,
+		  part->nb*part->lg1, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(part->fd2, (off_t)3600 + part->first*part->lg2,
+		  part->nb*part->lg2, POSIX_FADV_SEQUENTIAL);
+#endif
+    while( tr < part->nb ) {
+	size_t i, n = part->nb - tr < nb_block ? part->nb - tr : nb_block;
+	off_t first = part->first + tr;
+	ssize_t lg1 = pread(part->fd1, block1, n * part->lg1, (off_t)3600 + first*part->lg1);
+	ssize_t lg2 = pread(part->fd2, block2, n * part->lg2, (off_t)3600 + first*part->lg2);
+
+	for( i = 0 ; i < n && (i+1)*part->lg1 <= lg1 && (i+1)*part->lg2 <= lg2 ; i++ ) {
+	    char *a = block1 + i*part->lg1, *b = block2 + i*part->lg2;
+	    SEGY_TR_HD *h1 = (SEGY_TR_HD*)a, *h2 = (SEGY_TR_HD*)b;
+	    HD_FIELD *f;
+	    double err = 0, peak = 0;
+	    int j, what = 0;
+
+	    if( part->lg1 == part->lg2 && part->fmt1 == part->fmt2
+		&& !memcmp(a, b, part->lg1) )
+		continue;
+	    if( memcmp(a, b, 240) ) {
+		for( f = tr_fields ; f->name ; f++ )
+		    if( bcmp(a + f->offset, b + f->offset, f->size) )
+			part->field_count[f - tr_fields]++;
+		what |= 1;
+	    }
+	    decode_samples(a+240, f1, ns, part->fmt1,
+			   pow(2.0, (double)-(short)ntohs(h1->tr_weigth)));
+	    decode_samples(b+240, f2, ns, part->fmt2,
+			   pow(2.0, (double)-(short)ntohs(h2->tr_weigth)));
+	    for( j = 0 ; j < ns ; j++ ) {
+		double d = fabs(f1[j] - f2[j]), p = fabs(f1[j]);
+		err = d > err ? d : err;
+		peak = p > peak ? p : peak;
+	    }
+	    if( err > part->max_abs )
+		part->max_abs = err;
+	    if( peak > 0 && err / peak > part->max_rel )
+		part->max_rel = err / peak;
+	    if( err > part->tol || ns1 != ns2 )
+		what |= 2;
+	    if( what == 0 )
+		continue;
+	    part->nb_diff++;
+	    if( what & 1 )
+		part->nb_hd++;
+	    if( what & 2 )
+		part->nb_samp++;
+	    if( part->nb_example < part->max_example ) {
+		part->ex_trace[part->nb_example] = first + i + 1;
+		part->ex_what[part->nb_example] = what;
+		part->ex_err[part->nb_example++] = err;
+	    }
+	}
+	tr += n;
+    }
+    free(block1);
+    free(block2);
+    free(f1);
+    free(f2);
+    return 0;
+}
 
-    if( nb_samp > ntohs(tr_hd->nb_samples) )
-	  nb_samp = ntohs(tr_hd->nb_samples);
+#define DIFF_HD(part) \
+	if( DIFF(&bh1, &bh2, part) ) { \
+	    fprintf(file_info, "Binary header : %s differs\n", #part); \
+	    nb_bad++; \
+	}
 
-    if( line_number < cube_dim[0][0]
-       || line_number > cube_dim[1][0] )
-	return;
+static int diff_files(char *name, char *arg, FILE *file_info)
+{
+    int fd1, fd2, i, j, k, nb_part, nb_fields, nb_shown = 0, max_example = CHK_MAX_EXAMPLES;
+    char name2[500], text1[3200], text2[3200];
+    SEGY_HD bh1, bh2;
+    struct stat st1, st2;
+    double tol = 0, max_abs = 0, max_rel = 0;
+    size_t lg1, lg2;
+    off_t nb1, nb2, nb_traces, per_part;
+    DIFF_PART *parts;
+    pthread_t *threads;
+    long long nb_bad = 0, nb_hd = 0, nb_samp = 0, *field_count;
+
+    sscanf(arg, "%499s %lf %d", name2, &tol, &max_example);
+    fd1 = open(name, O_RDONLY);
+    fd2 = open(name2, O_RDONLY);
+    if( fd1 < 0 || fd2 < 0 || fstat(fd1, &st1) != 0 || fstat(fd2, &st2) != 0 ) {
+	perror(fd1 < 0 ? name : name2);
+	return -1;
+    }
+    if( is_compressed(fd1, name, "-diff") || is_compressed(fd2, name2, "-diff") )
+	return -1;
+    if( pread(fd1, text1, 3200, 0) != 3200 || pread(fd1, &bh1, 400, 3200) != 400
+	|| pread(fd2, text2, 3200, 0) != 3200 || pread(fd2, &bh2, 400, 3200) != 400 ) {
+	fprintf(stderr, "-diff : no tape headers\n");
+	return -1;
+    }
+    if( memcmp(text1, text2, 3200) ) {
+	fprintf(file_info, "Text headers differ\n");
+	nb_bad++;
+    }
+    /* All the 400 bytes, field by field */
+    if( memcmp(&bh1, &bh2, 400) ) {
+	DIFF_HD(job_number);
+	DIFF_HD(line_number);
+	DIFF_HD(reel_number);
+	DIFF_HD(nb_tra_rec);
+	DIFF_HD(nb_aux_rec);
+	DIFF_HD(sampling);
+	DIFF_HD(sampl_fld);
+	DIFF_HD(nb_samples);
+	DIFF_HD(nb_samp_fld);
+	DIFF_HD(data_form);
+	DIFF_HD(cdp_fold);
+	DIFF_HD(trace_sort);
+	DIFF_HD(vert_sum);
+	DIFF_HD(swp_start);
+	DIFF_HD(swp_end);
+	DIFF_HD(swp_length);
+	DIFF_HD(swp_type);
+	DIFF_HD(swp_channel);
+	DIFF_HD(swp_tap_st);
+	DIFF_HD(swp_tap_ed);
+	DIFF_HD(taper_type);
+	DIFF_HD(correlated);
+	DIFF_HD(bin_gain);
+	DIFF_HD(amp_recover);
+	DIFF_HD(meas_sys);
+	DIFF_HD(polarity);
+	DIFF_HD(vib_pol);
+	DIFF_HD(unass);
+    }
 
-    if( tr_number < cube_dim[0][1]
-       || tr_number > cube_dim[1][1] )
-	return;
+    for( i = 0 ; i < 2 ; i++ ) {
+	int fmt = ntohs(i ? bh2.data_form : bh1.data_form);
+	if( fmt < 1 || fmt > 5 ) {
+	    fprintf(stderr, "-diff : %s : format %d not handled\n", i ? name2 : name, fmt);
+	    return -1;
+	}
+    }
+    lg1 = 240 + (short)ntohs(bh1.nb_samples) * sample_size[ntohs(bh1.data_form)-1];
+    lg2 = 240 + (short)ntohs(bh2.nb_samples) * sample_size[ntohs(bh2.data_form)-1];
+    nb1 = (st1.st_size - 3600) / lg1;
+    nb2 = (st2.st_size - 3600) / lg2;
+    nb_traces = nb1 < nb2 ? nb1 : nb2;
+    if( nb1 != nb2 ) {
+	fprintf(file_info, "%s has %lld traces, %s has %lld\n", name, (long long)nb1,
+		name2, (long long)nb2);
+	nb_bad++;
+    }
 
-    if( ntohs(segy_hd->data_form) == 3 )
-	sample_size = 2;
-    
-    pos = grid(line_number-cube_dim[0][0], cube_dim[2][0]);
-    pos *= nb_traces;
-    pos += grid(tr_number-cube_dim[0][1], cube_dim[2][1]);
-    pos *= nb_samp;
-    pos *= sample_size;
-    fseek(cube_out, pos, SEEK_SET);
-    fwrite(buf+sizeof(SEGY_TR_HD)+sample_size*beg_trace, sample_size,
-	   nb_samp, cube_out);
-}
-    
-static void setup_cube(buf)
-char *buf;
-{
-    char name[100];
-    int nb = sscanf(buf, "%s %f %f %f %f %f %f %f %f %f", name,
-		    &cube_dim[0][0], &cube_dim[1][0], &cube_dim[2][0], 
-		    &cube_dim[0][1], &cube_dim[1][1], &cube_dim[2][1], 
-		    &cube_dim[0][2], &cube_dim[1][2], &cube_dim[2][2]);
+    for( nb_fields = 0 ; tr_fields[nb_fields].name ; nb_fields++ )
+	;
+    field_count = calloc(nb_fields, sizeof(long long));
+    nb_part = nb_chunks(nb_traces);
+    per_part = (nb_traces + nb_part - 1) / nb_part;
+    parts = calloc(nb_part, sizeof(DIFF_PART));
+    threads = calloc(nb_part, sizeof(pthread_t));
+    for( i = 0 ; i < nb_part ; i++ ) {
+	DIFF_PART *p = &parts[i];
+	p->fd1 = fd1;
+	p->fd2 = fd2;
+	p->fmt1 = ntohs(bh1.data_form);
+	p->fmt2 = ntohs(bh2.data_form);
+	p->lg1 = lg1;
+	p->lg2 = lg2;
+	p->tol = tol;
+	p->first = i * per_part;
+	p->nb = nb_traces - p->first < per_part ? nb_traces - p->first : per_part;
+	if( p->nb < 0 )
+	    p->nb = 0;
+	p->field_count = calloc(nb_fields, sizeof(long long));
+	p->max_example = max_example;
+	p->ex_trace = malloc((max_example+1) * sizeof(long long));
+	p->ex_what = malloc((max_example+1) * sizeof(int));
+	p->ex_err = malloc((max_example+1) * sizeof(double));
+	pthread_create(&threads[i], 0, diff_thread, p);
+    }
 
-    cube_out = fopen(name, "a+");
-    check_trace = cube_write;
+    /* The parts in their order give the first differing traces */
+    for( i = 0 ; i < nb_part ; i++ ) {
+	DIFF_PART *p = &parts[i];
+	pthread_join(threads[i], 0);
+	for( j = 0 ; j < p->nb_example && nb_shown < max_example ; j++, nb_shown++ )
+	    fprintf(file_info, "Trace %lld differs :%s%s, max error %g\n", p->ex_trace[j],
+		    p->ex_what[j] & 1 ? " header" : "", p->ex_what[j] & 2 ? " samples" : "",
+		    p->ex_err[j]);
+	nb_bad += p->nb_diff;
+	nb_hd += p->nb_hd;
+	nb_samp += p->nb_samp;
+	for( k = 0 ; k < nb_fields ; k++ )
+	    field_count[k] += p->field_count[k];
+	if( p->max_abs > max_abs )
+	    max_abs = p->max_abs;
+	if( p->max_rel > max_rel )
+	    max_rel = p->max_rel;
+	free(p->field_count);
+	free(p->ex_trace);
+	free(p->ex_what);
+	free(p->ex_err);
+    }
+    for( k = 0 ; k < nb_fields ; k++ )
+	if( field_count[k] )
+	    fprintf(file_info, "%s differs in %lld traces\n", tr_fields[k].name, field_count[k]);
+    fprintf(file_info, "%s and %s : %lld traces compared, %lld headers and %lld traces "
+	    "of samples differ, max error %g, max relative error %g\n", name, name2,
+	    (long long)nb_traces, nb_hd, nb_samp, max_abs, max_rel);
+
+    free(field_count);
+    free(parts);
+    free(threads);
+    close(fd1);
+    close(fd2);
+    return nb_bad != 0;
 }
 
 /*
-  Coverage 
+  In place patch of the trace headers ( -patch journal with -geometry
+  and / or -set )
+
+  The headers are read alone by batches, -geometry and the -set
+  expressions run on the batch and only the headers which changed are
+  written back, by threads, at their offsets.  Before a batch is written, its offsets and new
+  headers are saved in the journal and synced, then the journal header
+  with the number of the next trace to read and the CRC32C of the batch,
+  synced too : a crash in between leaves the previous journal header.
+  Once the file is synced the journal is emptied to that number, synced
+  before the next batch goes over the previous one in the journal.  After a
+  crash, the same command checks the batch against its CRC, replays it
+  ( the writes are the same whatever was done ) and goes on from the next
+  trace, so no expression is applied twice.  The journal is removed at
+  the end.
   */
 
-static float get_value_from_header(char *p, int offset, int sz)
+#define PATCH_MAGIC "SEGYPAT1"
+
+typedef struct patch_hd {
+    char magic[8];
+    long long next;             /* First trace not done */
+    int nb;                     /* Headers of the batch in the journal */
+    int lg_tr;
+    unsigned crc;               /* CRC32C of the offsets and headers */
+    int dummy;
+} PATCH_HD;
+
+typedef struct patch_part {
+    int fd;
+    char *hd;
+    long long *off;
+    int first, nb, nb_err;
+} PATCH_PART;
+
+static void *patch_thread(void *arg)
 {
-    p += offset;
-    if( sz == 2 ) {
-	short i;
-	memcpy(&i, p, 2);
-	return (float)i;
-    }
-    else if( sz == 4 ) {
-	int i;
-	memcpy(&i, p, 4);
-	return (float)i;
-    }
-    return 0.0;
+    PATCH_PART *part = (PATCH_PART*)arg;
+    int i;
+    for( i = part->first ; i < part->first + part->nb ; i++ )
+	if( pwrite(part->fd, part->hd + i*240, 240, part->off[i]) != 240 )
+	    part->nb_err++;
+    return 0;
 }
 
-static struct _cov {
-    int v[14];
-    FILE *file;
-} cov;
+/* Write the headers of the batch, by several threads */
 
-static void write_coverage(buf, lg, segy_hd)
-char *buf;
-int lg;
-SEGY_HD *segy_hd;
+static int patch_write(int fd, char *hd, long long *off, int nb)
 {
-    float b[7];
-    int i;
-    for( i = 0 ; i < 7 ; i++ )
-	b[i] = get_value_from_header(buf, cov.v[2*i], cov.v[2*i+1]);
-
-    fwrite(b, sizeof(float), 7, cov.file);
+    int i, nb_part = nb_chunks(nb), nb_err = 0;
+    PATCH_PART parts[64];
+    pthread_t threads[64];
+
+    if( nb_part > 64 )
+	nb_part = 64;
+    for( i = 0 ; i < nb_part ; i++ ) {
+	parts[i].fd = fd;
+	parts[i].hd = hd;
+	parts[i].off = off;
+	parts[i].first = nb * i / nb_part;
+	parts[i].nb = nb * (i+1) / nb_part - parts[i].first;
+	parts[i].nb_err = 0;
+	pthread_create(&threads[i], 0, patch_thread, &parts[i]);
+    }
+    for( i = 0 ; i < nb_part ; i++ ) {
+	pthread_join(threads[i], 0);
+	nb_err += parts[i].nb_err;
+    }
+    return nb_err == 0 && fdatasync(fd) == 0 ? 0 : -1;
 }
 
-static void parse_coverage(char *p)
+static unsigned patch_crc(PATCH_HD *ph, char *hd, long long *off)
 {
-    int i;
-    SEGY_TR_HD *tr = 0;
-#define OFF(v) ((char*)&tr->v)-(char*)tr
+    return crc32c(crc32c(0, (char*)off, ph->nb*sizeof(long long)), hd, ph->nb*240);
+}
 
-    char *file_name = strtok(p, " ");
-    cov.file = fopen(file_name, "w");
-    if( cov.file == 0 ) {
-	perror("fopen");
-	return;
+/* The batch first, its header last, each one synced */
+
+static int patch_journal(int fj, PATCH_HD *ph, char *hd, long long *off)
+{
+    ph->crc = patch_crc(ph, hd, off);
+    if( pwrite(fj, off, ph->nb*sizeof(long long), sizeof(*ph)) != ph->nb*sizeof(long long)
+	|| pwrite(fj, hd, ph->nb*240, sizeof(*ph) + ph->nb*sizeof(long long)) != ph->nb*240
+	|| fdatasync(fj) != 0
+	|| pwrite(fj, ph, sizeof(*ph), 0) != sizeof(*ph)
+	|| fdatasync(fj) != 0 ) {
+	perror("journal");
+	return -1;
     }
+    return 0;
+}
 
-    cov.v[0] = OFF(src_X);
-    cov.v[1] = sizeof(tr->src_X);
-    cov.v[2] = OFF(src_Y);
-    cov.v[3] = sizeof(tr->src_Y);
-    cov.v[4] = OFF(grp_X);
-    cov.v[5] = sizeof(tr->grp_X);
-    cov.v[6] = OFF(grp_Y);
-    cov.v[7] = sizeof(tr->grp_Y);
+static int patch_file(char *name, char *journal, FILE *file_info)
+{
+    int fd, fj, i, fmt, *lg;
+    SEGY_HD bh;
+    PATCH_HD ph;
+    struct stat st;
+    size_t lg_tr;
+    long long nb_traces, nb_changed = 0, *off;
+    char *old, *hd, **hp;
 
-    for( i = 0 ; i < 14 ; i++ ) {
-	char *num = strtok(0, " ");
-	if( num == 0 )
-	    break;
-	cov.v[i] = atoi(num);
+    fd = open(name, O_RDWR);
+    if( fd < 0 || fstat(fd, &st) != 0 || pread(fd, &bh, 400, 3200) != 400 ) {
+	perror(name);
+	return -1;
+    }
+    if( is_compressed(fd, name, "-patch") )
+	return -1;
+    fmt = ntohs(bh.data_form);
+    lg_tr = 240 + (short)ntohs(bh.nb_samples) * (fmt == 3 ? 2 : 4);
+    nb_traces = (st.st_size - 3600) / lg_tr;
+
+    old = malloc(HD_BATCH * 240);
+    hd = malloc(HD_BATCH * 240);
+    hp = malloc(HD_BATCH * sizeof(char*));
+    off = malloc(HD_BATCH * sizeof(long long));
+    lg = malloc(HD_BATCH * sizeof(int));
+
+    /* An existing journal : replay its batch and go on after it */
+    fj = open(journal, O_RDWR | O_CREAT, 0644);
+    if( fj < 0 ) {
+	perror(journal);
+	return -1;
+    }
+    if( pread(fj, &ph, sizeof(ph), 0) == sizeof(ph) && !memcmp(ph.magic, PATCH_MAGIC, 8) ) {
+	if( ph.lg_tr != lg_tr || ph.nb < 0 || ph.nb > HD_BATCH ) {
+	    fprintf(stderr, "%s is not a journal of %s\n", journal, name);
+	    return -1;
+	}
+	if( ph.nb > 0 ) {
+	    if( pread(fj, off, ph.nb*sizeof(long long), sizeof(ph)) != ph.nb*sizeof(long long)
+		|| pread(fj, hd, ph.nb*240, sizeof(ph) + ph.nb*sizeof(long long)) != ph.nb*240
+		|| patch_crc(&ph, hd, off) != ph.crc ) {
+		fprintf(stderr, "%s : the batch of the journal is damaged, nothing replayed\n",
+			journal);
+		return -1;
+	    }
+	    if( patch_write(fd, hd, off, ph.nb) != 0 ) {
+		perror(name);
+		return -1;
+	    }
+	}
+	fprintf(file_info, "Journal replayed, %d headers, going on at trace %lld\n",
+		ph.nb, ph.next+1);
+    }
+    else {
+	memset(&ph, 0, sizeof(ph));
+	memcpy(ph.magic, PATCH_MAGIC, 8);
+	ph.lg_tr = lg_tr;
     }
-	     
-    check_trace = write_coverage;
-}
 
-static char *multiple_input = 0;
-static int range = 0;
+    while( ph.next < nb_traces ) {
+	int n = nb_traces - ph.next < HD_BATCH ? nb_traces - ph.next : HD_BATCH;
+	int nb = 0;
+
+	pread_headers(fd, 3600 + ph.next*lg_tr, lg_tr, n, old, lg);
+	memcpy(hd, old, n*240);
+	for( i = 0 ; i < n ; i++ )
+	    hp[i] = hd + i*240;
+	if( geometry )
+	    geometry_run(hp, n);
+	if( set_prog )
+	    expr_run(set_prog, hp, n, 0);
+
+	/* Keep the changed headers only */
+	for( i = 0 ; i < n ; i++ )
+	    if( lg[i] == 240 && memcmp(old + i*240, hd + i*240, 240) ) {
+		memmove(hd + nb*240, hd + i*240, 240);
+		off[nb++] = 3600 + (ph.next+i)*lg_tr;
+	    }
+	ph.next += n;
+	ph.nb = nb;
+	if( nb == 0 )
+	    continue;
+	if( patch_journal(fj, &ph, hd, off) != 0 )
+	    return -1;
+	if( patch_write(fd, hd, off, nb) != 0 ) {
+	    perror(name);
+	    return -1;
+	}
+	ph.nb = 0;
+	if( pwrite(fj, &ph, sizeof(ph), 0) != sizeof(ph) || fdatasync(fj) != 0 ) {
+	    perror(journal);
+	    return -1;
+	}
+	nb_changed += nb;
+    }
 
-FILE *open_multiple_input()
-{
-    FILE *file;
-    char buffer[600];
-    range++;
-    sprintf(buffer, "%s%d", multiple_input, range);
-    file = fopen(buffer, "r");
-    return file;
+    close(fj);
+    unlink(journal);
+    close(fd);
+    fprintf(file_info, "%s : %lld traces, %lld headers patched\n", name, nb_traces, nb_changed);
+    return 0;
 }
 
 main(argc,argv)
@@ -1324,6 +7080,9 @@ char    *argv[];
         exit(1);
     }
 
+    if( mygetopt(argc, argv, "-brick_extract", buf) )
+	exit(brick_extract(buf, argv[0]));
+
     /*  Open the input file */
     
     if( mygetopt(argc, argv, "-i", buf) == 0 ) {
@@ -1336,6 +7095,64 @@ char    *argv[];
     if( strchr(input_name, ':') )
         exec_remote(argc, argv);
 
+    /*  Parallel validation : nothing else is done */
+
+    if( mygetopt(argc, argv, "-check", buf) ) {
+	if( mygetopt(argc, argv, "-threads", buf) )
+	    nb_threads = atoi(buf);
+	dump_hd = mygetopt(argc, argv, "-dump", buf);
+	exit(check_file(input_name, stdout) == 0 ? 0 : 1);
+    }
+    if( mygetopt(argc, argv, "-verify", buf) ) {
+	char crc_name[500];
+	strcpy(crc_name, buf);
+	if( mygetopt(argc, argv, "-threads", buf) )
+	    nb_threads = atoi(buf);
+	exit(verify_file(input_name, crc_name, stdout) == 0 ? 0 : 1);
+    }
+    if( mygetopt(argc, argv, "-diff", buf) ) {
+	char arg[600];
+	strcpy(arg, buf);
+	if( mygetopt(argc, argv, "-threads", buf) )
+	    nb_threads = atoi(buf);
+	exit(diff_files(input_name, arg, stdout) == 0 ? 0 : 1);
+    }
+    if( mygetopt(argc, argv, "-patch", buf) ) {
+	char journal[500];
+	strcpy(journal, buf);
+	if( mygetopt(argc, argv, "-threads", buf) )
+	    nb_threads = atoi(buf);
+	if( mygetopt(argc, argv, "-geometry", buf) )
+	    setup_geometry(buf);
+	if( mygetopt(argc, argv, "-set", buf) )
+	    set_prog = compile_set(buf);
+	if( !set_prog && !geometry ) {
+	    fprintf(stderr, "-patch needs -set or -geometry\n");
+	    exit(1);
+	}
+	exit(patch_file(input_name, journal, stdout) == 0 ? 0 : 1);
+    }
+    if( mygetopt(argc, argv, "-threads", buf) )
+	nb_threads = atoi(buf);
+
+    if( mygetopt(argc, argv, "-ckpt", buf) ) {
+	char **side;
+	sscanf(buf, "%499s %d", ckpt_name, &ckpt_every);
+	if( ckpt_every <= 0 )
+	    ckpt_every = 10000;
+	for( side = ckpt_side ; *side && !mygetopt(argc, argv, *side, buf) ; side++ )
+	    ;
+	if( *side ) {
+	    /* Before anything is opened : -resume must not truncate them */
+	    fprintf(stderr, "No checkpoint with %s : its output is not saved\n", *side);
+	    if( mygetopt(argc, argv, "-resume", buf) )
+		exit(1);
+	    ckpt_name[0] = 0;
+	}
+	else if( mygetopt(argc, argv, "-resume", buf) )
+	    read_checkpoint();
+    }
+
     /*  Open output file */
 
     fdout = 0;
@@ -1350,7 +7167,7 @@ char    *argv[];
             file_info = stderr;
         }
         else if( buf[0] ) {
-            fdout = fopen(buf, "w");
+	    fdout = resume_pending ? resume_output(buf) : fopen(buf, "w");
 	    strcpy(dev_name, buf);
 
             if( fdout == 0 ) {
@@ -1359,9 +7176,20 @@ char    *argv[];
             }
         }
 
-        fstat(fileno(fdout), &bstat);
-        if( S_ISCHR(bstat.st_mode) )
+	if( fdout && fstat(fileno(fdout), &bstat) == 0 && S_ISCHR(bstat.st_mode) )
             output_is_tape = 1;
+	if( mygetopt(argc, argv, "-aws_out", buf) )
+	    output_is_tape = aws_out = 1;
+	if( mygetopt(argc, argv, "-tape_block", buf) )
+	    tape_block = atoi(buf) > 0 ? atoi(buf) : 1;
+    }
+    aws_in = mygetopt(argc, argv, "-aws_in", buf) != 0;
+    if( mygetopt(argc, argv, "-tape_buffer", buf) ) {
+	tape_buffer_size = (size_t)atol(buf) << 20;
+	if( tape_buffer_size < sizeof(RING_REC) + RING_ALIGN(TAPE_MAX_RECORD) ) {
+	    fprintf(stderr, "-tape_buffer : at least 2 MB, a record being up to 1 MB\n");
+	    exit(1);
+	}
     }
 
     if( input_name[0] == '-' ) 
@@ -1369,6 +7197,13 @@ char    *argv[];
     else if( input_name[0] == '+' ) {
 	/* Multiple File in input */
 	multiple_input = input_name+1;
+	if( resume_pending && ckpt.range > 1 ) {
+	    /* Go on with the input of the checkpoint */
+	    range = ckpt.range - 1;
+	    tape_number = ckpt.tape_number;
+	    nb_samples = ckpt.nb_samples;
+	    byte_per_sample = ckpt.byte_per_sample;
+	}
 	fdin = open_multiple_input();
 
 	if( fdin == 0 )  {
@@ -1377,11 +7212,11 @@ char    *argv[];
         }
 
         fstat(fileno(fdin), &bstat);
-        if( S_ISCHR(bstat.st_mode) )
+	if( S_ISCHR(bstat.st_mode) || aws_in )
             is_tape = 1;
     }
     else {
-        fdin = fopen(input_name, "r");
+	fdin = open_input(input_name);
 
         if( fdin == 0 )  {
             perror(input_name);
@@ -1389,7 +7224,7 @@ char    *argv[];
         }
 
         fstat(fileno(fdin), &bstat);
-        if( S_ISCHR(bstat.st_mode) )
+	if( S_ISCHR(bstat.st_mode) || aws_in )
             is_tape = 1;
     }
 
@@ -1431,18 +7266,90 @@ char    *argv[];
             fprintf(stderr, " Output format %s not supported\n", buf);
     }
 
+    su_in = mygetopt(argc, argv, "-su_in", buf) != 0;
+    if( mygetopt(argc, argv, "-su_out", buf) )
+	su_out = process_samples = 1, output_fmt = 5;
+
     if( mygetopt(argc, argv, "-all", buf) ) 
         all_files_in_input = 1;
 
     if( mygetopt(argc, argv, "-quiet", buf) ) 
         quiet = 1;
 
+    resync = mygetopt(argc, argv, "-resync", buf);
+
+    if( mygetopt(argc, argv, "-tmin", buf) ) {
+	tmin = atof(buf);
+	process_samples = 1;
+    }
+    if( mygetopt(argc, argv, "-tmax", buf) ) {
+	tmax = atof(buf);
+	process_samples = 1;
+    }
+    if( mygetopt(argc, argv, "-crc", buf) )
+	setup_checksum(buf);
+
+    if( mygetopt(argc, argv, "-area", buf) )
+	setup_area(buf);
+
+    if( mygetopt(argc, argv, "-route", buf) )
+	setup_route(buf);
+
+    if( mygetopt(argc, argv, "-geometry", buf) )
+	setup_geometry(buf);
+
+    if( mygetopt(argc, argv, "-set", buf) )
+	set_prog = compile_set(buf);
+
+    if( mygetopt(argc, argv, "-where", buf) )
+	where_prog = compile_where(buf);
+
+    if( mygetopt(argc, argv, "-filter", buf) ) {
+	setup_filter(buf);
+	process_samples = 1;
+    }
+    if( mygetopt(argc, argv, "-nmo", buf) ) {
+	setup_nmo(buf);
+	process_samples = 1;
+    }
+    if( mygetopt(argc, argv, "-agc", buf) ) {
+	agc_window = atof(buf);
+	process_samples = 1;
+    }
+    if( mygetopt(argc, argv, "-stack", buf) ) {
+	stack_mode = process_samples = 1;
+	if( buf[0] != 0 && buf[0] != '-' && strcmp(buf, "sorted") ) {
+	    stack_sorted = 0;
+	    stack_mem = atol(buf) << 20;
+	}
+    }
+    if( mygetopt(argc, argv, "-resample", buf) ) {
+	resample = atoi(buf);
+	if( resample < 1 ) {
+	    fprintf(stderr, "Bad resampling factor %s\n", buf);
+	    exit(1);
+	}
+	process_samples = 1;
+    }
+
     if( mygetopt(argc, argv, "-cube", buf) ) 
         setup_cube(buf);
 
     if( mygetopt(argc, argv, "-cov", buf) )
 	parse_coverage(buf);
 
+    if( mygetopt(argc, argv, "-bricks", buf) )
+	setup_bricks(buf);
+
+    if( mygetopt(argc, argv, "-stats", buf) )
+	setup_stats(buf);
+
+    if( mygetopt(argc, argv, "-pyramid", buf) )
+	setup_pyramid(buf);
+
+    if( mygetopt(argc, argv, "-dedupe", buf) )
+	setup_dedupe(buf);
+
     is_blocked = mygetopt(argc, argv, "-blocked", buf);
     dump_hd = mygetopt(argc, argv, "-dump", buf);
     no_headers = mygetopt(argc, argv, "-no_headers", buf);
@@ -1464,10 +7371,12 @@ char    *argv[];
 
     do {
         int st = read_a_tape(fdin, fdout, file_info, tape_number, file_dump_sp);
-	if( multiple_input != 0 ) {
+	if( max_reached )
+	    buf[0] = 'N';
+	else if( multiple_input != 0 ) {
 	    FILE *next_file = open_multiple_input();
 	    if( next_file ) {
-		fclose(fdin);
+		close_input(fdin);
 		fdin = next_file;
 		buf[0] = 'Y';
 		tape_number++;
@@ -1479,9 +7388,9 @@ char    *argv[];
 	    buf[0] = st == -1 ? 'N' : 'Y';
 	}
 	else {
-	    fclose(fdin);
+	    close_input(fdin);
 
-	    if( is_tape && quiet==0 ) {
+	    if( is_tape && !aws_in && quiet==0 ) {
 		do {
 		    fprintf(tty, "Do you have another tape ? \n(Mount it if any then type  Y or N ) ");
 		    fflush(tty);
@@ -1505,18 +7414,48 @@ char    *argv[];
 	}
     } while( buf[0] == 'Y' );
 
+    if( stack_mode )
+	stack_flush();
+
     fprintf( stdout, "Total Number of traces output %d\n", nb_written_traces);
     fprintf( stdout, "first cdp ensemble output %d\n", cdpfirst);
     fprintf( stdout, "last cdp ensemble output %d\n", cdplast);
+    if( resync )
+	fprintf( stdout, "%d resynchronizations, %lld bytes skipped\n",
+		 resync_count, resync_skipped);
+    if( dedupe_mode )
+	fprintf( stdout, "%lld duplicated traces %s\n", dedupe_nb,
+		 dedupe_mode == 1 ? "dropped" : "found");
     
+    if( fdout && output_is_tape )
+	close_tape_output(fdout);
+    if( ring_in )
+	ring_free(ring_in);
     if( fdout )
 	fclose(fdout);
 
+    if( crc_file )
+	close_checksum();
+
+    if( route_field )
+	close_route();
+
+    tee_finish();
+
+    if( stats_file )
+	close_stats();
+
     if( cube_out )
 	fclose(cube_out);
 
+    if( brick_written )
+	close_bricks();
+
+    if( pyr_out )
+	close_pyramid();
+
     if( cov.file )
 	fclose(cov.file);
 
-    exit(0);
+    exit(max_reached || decomp_failed ? 1 : 0);
 }
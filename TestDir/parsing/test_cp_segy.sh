@@ -0,0 +1,363 @@
+#!/bin/sh
+#
+# Fixture test of cp_segy on small synthetic files, one section per option.
+#
+#   sh test_cp_segy.sh [compiler]
+#
+# Builds 70529294_1488380518.c in a scratch directory, prints one line per
+# case and exits 1 if one of them fails.  Needs python3 to write the files.
+
+SRC=$(cd "$(dirname "$0")" && pwd)/70529294_1488380518.c
+CC=${1:-gcc}
+T=$(mktemp -d) || exit 1
+trap 'rm -rf "$T"' 0
+NB_FAIL=0
+
+ok() { echo "ok   $1"; }
+ko() { echo "FAIL $1"; NB_FAIL=$((NB_FAIL+1)); }
+
+# expect name status pattern command... : exit status and a line of output
+expect()
+{
+    name=$1 status=$2 pattern=$3
+    shift 3
+    "$@" > "$T/out" 2>&1
+    rc=$?
+    if [ $rc -ne "$status" ]; then
+	ko "$name ( exit $rc, expected $status )"
+	sed 's/^/     /' "$T/out"
+    elif [ -n "$pattern" ] && ! grep -q -- "$pattern" "$T/out"; then
+	ko "$name ( no \"$pattern\" )"
+	sed 's/^/     /' "$T/out"
+    else
+	ok "$name"
+    fi
+}
+
+# poke file offset byte : overwrite one byte in place
+poke()
+{
+    printf "$(printf '\\%03o' "$3")" | dd of="$1" bs=1 seek="$2" conv=notrunc 2>/dev/null
+}
+
+# segy file traces samples [bad_trace] : IEEE floats ( format 5 ), 4 ms,
+# cdp_ens going up every 3 traces, the number of samples of bad_trace
+# being wrong
+segy()
+{
+    python3 - "$@" <<'EOF'
+import struct, sys
+name, nt, ns = sys.argv[1], int(sys.argv[2]), int(sys.argv[3])
+bad = int(sys.argv[4]) if len(sys.argv) > 4 else 0
+f = open(name, 'wb')
+f.write(b'\x40' * 3200)
+bh = bytearray(400)
+struct.pack_into('>hhh', bh, 16, 4000, 4000, ns)
+struct.pack_into('>h', bh, 24, 5)
+f.write(bh)
+for t in range(1, nt+1):
+    hd = bytearray(240)
+    struct.pack_into('>iiiiii', hd, 0, t, t, 1, t, t, 100 + t//3)
+    struct.pack_into('>h', hd, 28, 1)
+    struct.pack_into('>hh', hd, 68, 1, 1)
+    struct.pack_into('>hh', hd, 114, ns + (t == bad), 4000)
+    f.write(hd)
+    f.write(struct.pack('>%df' % ns, *[(t*7 + i) % 23 - 11.0 for i in range(ns)]))
+f.close()
+EOF
+}
+
+# hd file trace offset : the 4 bytes header value at offset in trace ( from 1 )
+hd()
+{
+    python3 - "$@" <<'EOF'
+import struct, sys
+f = open(sys.argv[1], 'rb')
+f.seek(3220)
+ns, fmt = struct.unpack('>hxxh', f.read(6))
+lg = 240 + ns * (2 if fmt == 3 else 4)
+f.seek(3600 + (int(sys.argv[2]) - 1) * lg + int(sys.argv[3]))
+print(struct.unpack('>i', f.read(4))[0])
+EOF
+}
+
+$CC -std=gnu89 -O2 -w -o "$T/cp_segy" "$SRC" -lm -lpthread 2>/dev/null || {
+    echo "FAIL build"
+    exit 1
+}
+CP=$T/cp_segy
+cd "$T"
+segy ok.sgy 9 50 || { echo "FAIL python3 needed"; exit 1; }
+segy bad.sgy 9 50 9
+segy big.sgy 200 64
+
+# -check : each chunk is merged, the last one included
+expect "check clean" 0 "Total number of errors 0" $CP -i ok.sgy -check -threads 4
+expect "check last trace, 4 threads" 1 "trace 9 :" $CP -i bad.sgy -check -threads 4
+expect "check last trace, 7 threads" 1 "trace 9 :" $CP -i bad.sgy -check -threads 7
+expect "check 1 thread" 1 "trace 9 :" $CP -i bad.sgy -check -threads 1
+
+# -set : batches in the copy loop, trace by trace with the checkpoints
+SET="cdp_ens = cdp_ens + 1000; esp = traseqlin * 2"
+expect "set copy" 0 "" $CP -i big.sgy -o set.sgy -set "$SET"
+expect "set cdp_ens" 0 "^1150$" hd set.sgy 150 20
+expect "set esp" 0 "^400$" hd set.sgy 200 16
+expect "set samples unchanged" 0 "" cmp -i 3840 -n 200 set.sgy big.sgy
+cat big.sgy | $CP -i - -o pipe.sgy -set "$SET" > /dev/null 2>&1
+expect "set through a pipe" 0 "" cmp set.sgy pipe.sgy
+expect "set with checkpoints" 0 "" $CP -i big.sgy -o ckpt.sgy -set "$SET" -ckpt ckpt.state
+expect "set trace by trace" 0 "" cmp set.sgy ckpt.sgy
+expect "set where" 0 "" $CP -i big.sgy -o setw.sgy -where "traseqlin % 2" -set "$SET"
+expect "set where esp" 0 "^398$" hd setw.sgy 100 16
+expect "set syntax error" 1 "Syntax error" $CP -i big.sgy -o err.sgy -set "esp = = 1"
+expect "set help" 0 "numbers, + - \\* / %," $CP
+
+# -crc and -verify, the traces of 400 and 3200 bytes counted as traces
+expect "crc copy" 0 "9 traces" $CP -i ok.sgy -o copy.sgy -crc copy.crc
+expect "copy unchanged" 0 "" cmp ok.sgy copy.sgy
+expect "verify" 0 " 0 errors" $CP -i copy.sgy -verify copy.crc -threads 4
+cp copy.sgy flip.sgy
+poke flip.sgy $((3600 + 4*440 + 240 + 10)) 255
+expect "verify flipped sample" 1 "Trace 5 differs" $CP -i flip.sgy -verify copy.crc -threads 3
+expect "crc -max_traces" 1 "" $CP -i ok.sgy -o cut.sgy -crc cut.crc -max_traces 5
+expect "verify -max_traces" 0 "5 traces verified, 0 errors" $CP -i cut.sgy -verify cut.crc
+cp copy.crc open.crc
+for i in 16 17 18 19; do poke open.crc $i 0; done
+expect "verify unclosed sidecar" 1 "was not closed" $CP -i copy.sgy -verify open.crc
+segy tr400.sgy 12 40
+segy tr3200.sgy 5 740
+expect "crc 400 bytes traces" 0 "12 traces" $CP -i tr400.sgy -o c400.sgy -crc c400.crc
+expect "verify 400 bytes traces" 0 "12 traces verified, 0 errors" $CP -i c400.sgy -verify c400.crc
+expect "crc 3200 bytes traces" 0 "5 traces" $CP -i tr3200.sgy -o c3200.sgy -crc c3200.crc
+expect "verify 3200 bytes traces" 0 "5 traces verified, 0 errors" $CP -i c3200.sgy -verify c3200.crc
+cp c400.sgy f400.sgy
+poke f400.sgy $((3600 + 400 + 300)) 255
+expect "verify flipped 400 bytes trace" 1 "Trace 2 differs" $CP -i f400.sgy -verify c400.crc
+
+# -route : one output per cdp_ens, the traces of 400 bytes included
+expect "route" 0 "5 outputs" $CP -i tr400.sgy -o +rt -route cdp_ens
+expect "route list" 0 "^rt-101 3$" cat rt
+expect "route output size" 0 "^4800$" sh -c "wc -c < rt-101"
+expect "route headers" 0 "" cmp -n 3600 rt-101 tr400.sgy
+expect "route samples" 0 "" cmp -i 3840:4640 -n 160 rt-101 tr400.sgy
+expect "route 3200 bytes traces" 0 "2 outputs" $CP -i tr3200.sgy -o +r32 -route cdp_ens
+expect "route 3200 output size" 0 "^13200$" sh -c "wc -c < r32-101"
+expect "route 3 outputs open" 0 "" $CP -i big.sgy -o +rb -route "cdp_ens 3"
+expect "route all traces" 0 "^200$" sh -c "awk '{ n += \$2 } END { print n }' rb"
+
+# -su_out and -su_in : no tape headers, native headers and floats
+expect "su_out 400 bytes traces" 0 "" $CP -i tr400.sgy -o tr400.su -su_out
+expect "su_out size" 0 "^4800$" sh -c "wc -c < tr400.su"
+expect "su_out native header" 0 "^ *3$" od -An -tu4 -j 800 -N 4 tr400.su
+expect "su_in back" 0 "" $CP -i tr400.su -su_in -o back400.sgy
+expect "su round trip size" 0 "^8400$" sh -c "wc -c < back400.sgy"
+expect "su round trip samples" 0 "" cmp -i 3840 -n 160 back400.sgy tr400.sgy
+expect "su_out 3200 bytes traces" 0 "" $CP -i tr3200.sgy -o tr3200.su -su_out
+expect "su_out 3200 size" 0 "^16000$" sh -c "wc -c < tr3200.su"
+
+# -patch : same headers as a copy with -set, the journal replayed or
+# skipped after a crash
+cp big.sgy patch.sgy
+expect "patch" 0 "200 headers patched" $CP -i patch.sgy -patch patch.jnl -set "$SET" -threads 4
+expect "patch equals copy" 0 "" cmp patch.sgy set.sgy
+expect "patch journal removed" 1 "" test -f patch.jnl
+expect "patch without -set" 1 "needs -set" $CP -i patch.sgy -patch patch.jnl
+
+# journal file next nb : the journal left by a crash, next traces done,
+# its batch being the headers of the nb traces before next in set.sgy
+journal()
+{
+    python3 - "$@" <<'EOF'
+import struct, sys
+def crc32c(crc, data):
+    crc ^= 0xffffffff
+    for b in data:
+        crc ^= b
+        for k in range(8):
+            crc = (crc >> 1) ^ 0x82f63b78 if crc & 1 else crc >> 1
+    return crc ^ 0xffffffff
+name, nxt, nb = sys.argv[1], int(sys.argv[2]), int(sys.argv[3])
+d = open('set.sgy', 'rb').read()
+lg = 240 + 4 * struct.unpack_from('>h', d, 3220)[0]
+off = [3600 + t * lg for t in range(nxt - nb, nxt)]
+hd = b''.join(d[o:o+240] for o in off)
+offs = struct.pack('<%dq' % nb, *off)
+crc = crc32c(crc32c(0, offs), hd)
+f = open(name, 'wb')
+f.write(struct.pack('<8sqiiIi', b'SEGYPAT1', nxt, nb, lg, crc, 0))
+f.write(offs + hd if nb else b'\xff' * 4096)
+EOF
+}
+# crashed file : set.sgy up to trace done, big.sgy after
+crashed()
+{
+    head -c $((3600 + $1*496)) set.sgy > crash.sgy
+    tail -c +$((3600 + $1*496 + 1)) big.sgy >> crash.sgy
+}
+crashed 100
+journal crash.jnl 100 0
+expect "patch after emptied journal" 0 "going on at trace 101" $CP -i crash.sgy -patch crash.jnl -set "$SET"
+expect "patch after emptied journal equals copy" 0 "" cmp crash.sgy set.sgy
+crashed 60
+journal crash.jnl 100 40
+expect "patch replay" 0 "Journal replayed, 40 headers" $CP -i crash.sgy -patch crash.jnl -set "$SET"
+expect "patch replay equals copy" 0 "" cmp crash.sgy set.sgy
+crashed 60
+journal crash.jnl 100 40
+poke crash.jnl 1000 255
+expect "patch damaged journal" 1 "damaged" $CP -i crash.sgy -patch crash.jnl -set "$SET"
+
+# -area with an index : same traces as without, one index per +name input
+$CP -i big.sgy -o geo.sgy -set "src_X = traseqlin % 20 * 10; src_Y = traseqlin / 20 * 10; grp_X = src_X + 2; grp_Y = src_Y" > /dev/null 2>&1
+AREA="mid 40 20 120 60"
+expect "area" 0 "output 32$" $CP -i geo.sgy -o area.sgy -area "$AREA"
+expect "area index built" 0 "Index ix : 200 traces" $CP -i geo.sgy -o areai.sgy -area "$AREA index ix"
+expect "area index same traces" 0 "" cmp area.sgy areai.sgy
+$CP -i geo.sgy -o areai.sgy -area "$AREA index ix" > reuse.log 2>&1
+expect "area index used" 0 "32 traces of 200 in the area" cat reuse.log
+expect "area index not rebuilt" 1 "" grep -q "Index ix :" reuse.log
+expect "area index used same traces" 0 "" cmp area.sgy areai.sgy
+cp geo.sgy in1
+cp geo.sgy in2
+expect "area index per input" 0 "Index ixm2 : 200 traces" $CP -i +in -o aream.sgy -area "$AREA index ixm"
+expect "area index first input" 0 "" test -s ixm1
+
+# -filter : each response file in its own specification
+printf '0 1\n1000 1\n' > pass.txt
+printf '0 0\n1000 0\n' > stop.txt
+$CP -i big.sgy -o flt.sgy -filter "response pass.txt" -stats flt.st > /dev/null 2>&1
+expect "filter all pass" 0 "^dead 0$" cat flt.st
+$CP -i big.sgy -o flt.sgy -filter "response pass.txt; response stop.txt" -stats flt.st > /dev/null 2>&1
+expect "filter second response" 0 "^dead 200$" cat flt.st
+$CP -i big.sgy -o flt.sgy -filter "response stop.txt; response pass.txt" -stats flt.st > /dev/null 2>&1
+expect "filter first response" 0 "^dead 200$" cat flt.st
+expect "filter no response file" 1 "" $CP -i big.sgy -o flt.sgy -filter "response none.txt"
+expect "filter unknown" 1 "Unknown filter" $CP -i big.sgy -o flt.sgy -filter "lowpass 10"
+
+# -geometry : midpoint, distance, azimuth and bins on geo.sgy ( receivers 2
+# east of the sources ), the batches of the copy loop as one trace at a time
+$CP -i geo.sgy -o geom.sgy -geometry "0 0 0 10 10 tracnb_fld" > /dev/null 2>&1
+expect "geometry srdist" 0 "^2$" hd geom.sgy 46 36
+expect "geometry X_mid" 0 "^61$" hd geom.sgy 46 216
+expect "geometry Y_mid" 0 "^23$" hd geom.sgy 46 220
+expect "geometry azimuth" 0 "^90$" hd geom.sgy 46 12
+expect "geometry inline" 0 "^7$" hd geom.sgy 46 208
+expect "geometry crossline" 0 "^3$" hd geom.sgy 46 212
+$CP -i geo.sgy -o geomf.sgy -geometry "0 0 0 10 10 il=field_rec xl=esp" > /dev/null 2>&1
+expect "geometry il= field" 0 "^7$" hd geomf.sgy 46 8
+expect "geometry xl= field" 0 "^3$" hd geomf.sgy 46 16
+$CP -i geo.sgy -o geomc.sgy -ckpt geom.ck -geometry "0 0 0 10 10 tracnb_fld" > /dev/null 2>&1
+expect "geometry batches equal checkpoints" 0 "" cmp geom.sgy geomc.sgy
+
+# -bricks and -brick_extract : grp_X gives the line, grp_Y the trace
+$CP -i big.sgy -o grid.sgy -set "grp_X = traseqlin / 20; grp_Y = traseqlin % 20" > /dev/null 2>&1
+expect "bricks" 0 "" $CP -i grid.sgy -bricks "grid.brk 0 9 1 0 19 1 0 63 1"
+expect "brick inline" 0 "" $CP -i grid.sgy -brick_extract "grid.brk inline 3 il.bin"
+expect "brick inline size" 0 "^5120$" wc -c < il.bin
+expect "brick inline first trace" 0 "" cmp -n 256 il.bin grid.sgy 0 $((3600 + 59*496 + 240))
+expect "brick time slice" 0 "" $CP -i grid.sgy -brick_extract "grid.brk time 5 ts.bin"
+expect "brick time slice size" 0 "^800$" wc -c < ts.bin
+expect "brick unknown extraction" 1 "Usage\|-brick_extract" $CP -i grid.sgy -brick_extract "grid.brk foo 3 foo.bin"
+expect "brick unknown extraction no output" 1 "" test -f foo.bin
+expect "brick out of the volume" 1 "out of the volume" $CP -i grid.sgy -brick_extract "grid.brk inline 99 il.bin"
+
+# compressed input : same traces as the plain file, closing it early is no
+# failure, a truncated file is; a zstd file of several frames cut in chunks
+gzip -c big.sgy > big.sgy.gz
+$CP -i big.sgy -o plain.sgy > /dev/null 2>&1
+expect "gzip input" 0 "output 200$" $CP -i big.sgy.gz -o gz.sgy
+expect "gzip input same traces" 0 "" cmp plain.sgy gz.sgy
+expect "gzip input closed early" 0 "" $CP -i big.sgy.gz -dump
+head -c $(( $(wc -c < big.sgy.gz) / 2 )) big.sgy.gz > cut.sgy.gz
+expect "gzip input truncated" 1 "decompression failed" $CP -i cut.sgy.gz -o cut.sgy
+expect "gzip input refused by -check" 1 "compressed" $CP -i big.sgy.gz -check
+if command -v zstd > /dev/null; then
+    zstd -q big.sgy -o big.sgy.zst
+    expect "zstd input" 0 "output 200$" $CP -i big.sgy.zst -o zst.sgy
+    expect "zstd input same traces" 0 "" cmp plain.sgy zst.sgy
+    expect "zstd input closed early" 0 "" $CP -i big.sgy.zst -dump
+    # 12 MB which do not compress, in frames of 1.5 MB : 3 chunks
+    python3 -c "import os, sys; sys.stdout.buffer.write(os.urandom(12000000))" > noise
+    cat big.sgy noise > frames.sgy
+    split -b 1500000 frames.sgy frame.
+    for f in frame.*; do zstd -q --rm $f; done
+    cat frame.* > frames.sgy.zst
+    $CP -i frames.sgy -o frames1.sgy > /dev/null 2>&1
+    expect "zstd frames in parallel" 0 "" $CP -i frames.sgy.zst -o frames2.sgy -threads 3
+    expect "zstd frames same traces" 0 "" cmp frames1.sgy frames2.sgy
+    expect "zstd frames closed early" 0 "" $CP -i frames.sgy.zst -dump -threads 3
+    head -c 6000000 frames.sgy.zst > cut.sgy.zst
+    expect "zstd frames truncated" 1 "decompression failed" $CP -i cut.sgy.zst -o cut.sgy -threads 3
+fi
+
+# -pyramid : the options in any order, the header giving the levels and
+# the kind of reduction
+$CP -i big.sgy -pyramid "p1 rms" > /dev/null 2>&1
+expect "pyramid rms" 0 "^ *6 *1$" od -An -i -j12 -N8 p1
+$CP -i big.sgy -pyramid "p2 box 3" > /dev/null 2>&1
+expect "pyramid box 3 levels" 0 "^ *3 *0$" od -An -i -j12 -N8 p2
+expect "pyramid level 1" 0 "^ *100 *32$" od -An -i -j32 -N8 p2
+$CP -i big.sgy -pyramid "p4 2 rms" > /dev/null 2>&1
+expect "pyramid levels then rms" 0 "^ *2 *1$" od -An -i -j12 -N8 p4
+expect "pyramid unknown option" 1 "foo is not" $CP -i big.sgy -pyramid "p3 foo"
+expect "pyramid no level" 1 "0 is not" $CP -i big.sgy -pyramid "p5 0"
+
+# -diff : the whole binary header, the header fields and the samples above
+# the tolerance
+cp big.sgy diff.sgy
+expect "diff same" 0 "0 headers and 0 traces of samples differ" $CP -i big.sgy -diff diff.sgy
+poke diff.sgy 3350 7
+expect "diff binary header unassigned" 1 "Binary header : unass differs" $CP -i big.sgy -diff diff.sgy
+cp big.sgy diff.sgy
+poke diff.sgy $((3600 + 4*496 + 23)) 0
+expect "diff header field" 1 "cdp_ens differs in 1 traces" $CP -i big.sgy -diff diff.sgy
+expect "diff first traces" 1 "Trace 5 differs : header" $CP -i big.sgy -diff "diff.sgy 0 1"
+cp big.sgy diff.sgy
+poke diff.sgy $((3600 + 9*496 + 240 + 11)) 71
+expect "diff samples" 1 "0 headers and 1 traces of samples differ" $CP -i big.sgy -diff diff.sgy
+expect "diff samples within tolerance" 0 "0 traces of samples differ" $CP -i big.sgy -diff "diff.sgy 1e30"
+
+# -where : on a disk file only the selected traces are read, the same as
+# through a pipe; with -area and an index it filters the area
+expect "where" 0 "48 traces of 200 selected" $CP -i big.sgy -o where1.sgy -where "cdp_ens > 150"
+cat big.sgy | $CP -i /dev/stdin -o where2.sgy -where "cdp_ens > 150" > /dev/null 2>&1
+expect "where pipe same traces" 0 "" cmp where1.sgy where2.sgy
+expect "where and" 0 "24 traces of 200 selected" $CP -i big.sgy -o where3.sgy -where "cdp_ens > 150 && traseqlin % 2 == 0"
+expect "where syntax error" 1 "Syntax error" $CP -i big.sgy -o where3.sgy -where "cdp_ens >"
+$CP -i geo.sgy -o wa1.sgy -area "$AREA" -where "traseqlin > 100" > /dev/null 2>&1
+expect "where in an area" 0 "8 traces of 32 selected" $CP -i geo.sgy -o wa2.sgy -area "$AREA index ix" -where "traseqlin > 100"
+expect "where in an area same traces" 0 "" cmp wa1.sgy wa2.sgy
+
+# -dedupe : dup.sgy is big.sgy with trace 5 again after trace 10 and
+# trace 20 after trace 50; the samples of big.sgy repeat every 23 traces
+python3 - <<'EOF'
+d = open('big.sgy', 'rb').read()
+tr = [d[3600 + i*496:3600 + (i+1)*496] for i in range(200)]
+open('dup.sgy', 'wb').write(d[:3600] + b''.join(tr[:10] + [tr[4]] + tr[10:50] + [tr[19]] + tr[50:]))
+EOF
+$CP -i dup.sgy -o dedup.sgy -dedupe "report cdp_ens" > dedup.log 2>&1
+expect "dedupe report first" 0 "trace 11 of input 1 is a duplicate" cat dedup.log
+expect "dedupe report second" 0 "trace 52 of input 1 is a duplicate" cat dedup.log
+expect "dedupe report count" 0 "^2 duplicated traces found" cat dedup.log
+expect "dedupe report keeps" 0 "output 202$" cat dedup.log
+expect "dedupe drop" 0 "^2 duplicated traces dropped" $CP -i dup.sgy -o dedup.sgy -dedupe "drop cdp_ens"
+$CP -i big.sgy -o plain.sgy > /dev/null 2>&1
+expect "dedupe drop same traces" 0 "" cmp dedup.sgy plain.sgy
+expect "dedupe samples only" 0 "^177 duplicated traces dropped" $CP -i big.sgy -o dedup.sgy -dedupe drop
+cp big.sgy dd1
+cp dup.sgy dd2
+expect "dedupe second input" 0 "trace 11 of input 2 is a duplicate" $CP -i +dd -o dedup.sgy -dedupe "report cdp_ens traseqlin"
+expect "dedupe bad mode" 1 "drop or report" $CP -i big.sgy -o dedup.sgy -dedupe foo
+
+# -ckpt and -resume : a copy stopped by -max_traces goes on from its last
+# checkpoint; no checkpoint with the side outputs
+expect "ckpt stopped" 1 "output 120$" $CP -i big.sgy -o resume.sgy -ckpt "resume.state 50" -max_traces 120
+expect "ckpt state" 0 "" test -s resume.state
+expect "resume" 0 "Resuming resume.sgy" $CP -i big.sgy -o resume.sgy -ckpt "resume.state 50" -resume
+expect "resume same traces" 0 "" cmp plain.sgy resume.sgy
+expect "resume without state" 1 "no checkpoint in none.state" $CP -i big.sgy -o resume.sgy -ckpt "none.state 50" -resume
+expect "ckpt not with -crc" 0 "No checkpoint with -crc" $CP -i big.sgy -o resume.sgy -ckpt "crc.state 50" -crc resume.crc
+expect "ckpt not with -crc no state" 1 "" test -f crc.state
+
+[ $NB_FAIL -eq 0 ] && echo "All passed" || echo "$NB_FAIL failed"
+[ $NB_FAIL -eq 0 ]